@@ -0,0 +1,62 @@
+#include "canboose_acceptancefilter.h"
+#include "canboose_networktransportlayer.h"
+
+// Global (unaddressed) messages processed by this node. Bits set in ignore
+// are don't care bits of the MTI, so a rule can take a pair of messages
+struct globalMessage {
+  uint16_t mti;
+  uint16_t ignore;
+};
+
+static const globalMessage globalMessages[] = {
+  { INIT_COMPLETE_FULL,               0x001 },  // And INIT_COMPLETE_SIMPLE. Alias cache
+  { VERIFIED_NODE_ID_FULL,            0x001 },  // And VERIFIED_NODE_ID_SIMPLE. Alias cache
+  { VERIFY_NODE_ID_GLOBAL,            0x000 },
+  { PRODUCER_CONSUMER_EVENT_REPORT,   0x000 },
+  { IDENTIFY_CONSUMER,                0x000 },
+  { IDENTIFY_EVENTS_GLOBAL,           0x000 },
+};
+
+void AcceptanceFilterClass::addRule(uint32_t id, uint32_t mask) {
+  if (count < ACCEPTANCE_MAX_RULES) {
+    rules[count].id = id & mask;
+    rules[count].mask = mask;
+    count++;
+  }
+}
+
+uint8_t AcceptanceFilterClass::plan(uint16_t alias) {
+  uint32_t dst = (uint32_t) alias << 12;
+  count = 0;
+
+  // CAN control frames: bit 28 set, bit 27 (OpenLCB message) clear
+  addRule(0x10000000, 0x18000000);
+
+  // Our alias as source
+  addRule(alias, 0x00000FFF);
+
+  // Addressed messages: MTI bit 3
+  addRule(0x19008000, 0x1F008000);
+
+  // Global messages
+  for (uint8_t i = 0; i < sizeof(globalMessages) / sizeof(globalMessages[0]); i++) {
+    addRule(0x19000000 | ((uint32_t) globalMessages[i].mti << 12),
+            0x1FFFF000 & ~((uint32_t) globalMessages[i].ignore << 12));
+  }
+
+  // Datagrams to us. Frame types 0x1A/0x1B and 0x1C/0x1D, one rule each pair
+  addRule(0x1A000000 | dst, 0x1EFFF000);
+  addRule(0x1C000000 | dst, 0x1EFFF000);
+
+  // Stream data to us
+  addRule(0x1F000000 | dst, 0x1FFFF000);
+
+  return count;
+}
+
+bool AcceptanceFilterClass::accepts(uint32_t id) {
+  for (uint8_t i = 0; i < count; i++) {
+    if ((id & rules[i].mask) == rules[i].id) return true;
+  }
+  return false;
+}
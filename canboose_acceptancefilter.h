@@ -0,0 +1,35 @@
+/*
+ * Acceptance filter planner.
+ *
+ * Builds the list of identifier/mask rules for the CAN controller, so only frames this node
+ * cares about ever raise an interrupt:
+ *   - CAN control frames (CID, RID, AMD, AME, AMR) from every node
+ *   - any frame using our alias as source, to detect collisions
+ *   - addressed messages. Destination is in the data, so the network layer still checks it
+ *   - the global messages in the table below
+ *   - datagram and stream frames addressed to our alias
+ *
+ * Rules depend on our alias, so they are planned again every time it changes. Twelve rules
+ * fit in the 14 receive mailboxes of the Teensy FlexCAN.
+ */
+
+#ifndef __CANBOOSE_ACCEPTANCEFILTER_H__
+#define __CANBOOSE_ACCEPTANCEFILTER_H__
+
+#include "canboose_hal.h"
+
+#define ACCEPTANCE_MAX_RULES  14
+
+class AcceptanceFilterClass {
+  public:
+    uint8_t plan(uint16_t alias);   // Returns number of rules
+    bool accepts(uint32_t id);      // Software check of the current plan
+
+    acceptanceRule rules[ACCEPTANCE_MAX_RULES];
+    uint8_t count = 0;
+
+  private:
+    void addRule(uint32_t id, uint32_t mask);
+};
+
+#endif
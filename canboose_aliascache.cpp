@@ -0,0 +1,147 @@
+#include "canboose_aliascache.h"
+
+uint64_t nodeIDFromBytes(const uint8_t bytes[]) {
+  uint64_t nodeID = 0;
+  for (int i = 0; i < 6; i++) {
+    nodeID = (nodeID << 8) | bytes[i];
+  }
+  return nodeID;
+}
+
+void nodeIDToBytes(uint64_t nodeID, uint8_t bytes[]) {
+  for (int i = 5; i >= 0; i--) {
+    bytes[i] = nodeID & 0xFF;
+    nodeID >>= 8;
+  }
+}
+
+AliasCacheClass::AliasCacheClass() {
+  clear();
+}
+
+void AliasCacheClass::clear() {
+  for (int i = 0; i < ALIAS_CACHE_BUCKETS; i++) {
+    buckets[i] = -1;
+  }
+  for (int i = 0; i < ALIAS_CACHE_SIZE; i++) {
+    entries[i].alias = 0;
+  }
+  used = 0;
+  hand = 0;
+}
+
+uint8_t AliasCacheClass::hashAlias(uint16_t alias) {
+  // Fibonacci hashing, like the datagram pool
+  return ((alias * 2654435761u) >> 24) & (ALIAS_CACHE_BUCKETS - 1);
+}
+
+int8_t AliasCacheClass::findBucket(uint16_t alias) {
+  uint8_t b = hashAlias(alias);
+  for (int i = 0; i < ALIAS_CACHE_BUCKETS; i++) {
+    int8_t entry = buckets[b];
+    if (entry < 0) return -1;
+    if (entries[entry].alias == alias) return b;
+    b = (b + 1) & (ALIAS_CACHE_BUCKETS - 1);
+  }
+
+  return -1;
+}
+
+void AliasCacheClass::add(uint16_t alias, uint64_t nodeID) {
+  if (alias == 0) return;
+
+  // A node that got a new alias leaves the old one behind
+  uint16_t oldAlias = findAlias(nodeID);
+  if (oldAlias != 0 && oldAlias != alias) remove(oldAlias);
+
+  // Known alias. Node ID may be a new one if the alias was reused
+  int8_t b = findBucket(alias);
+  if (b >= 0) {
+    entries[buckets[b]].nodeID = nodeID;
+    entries[buckets[b]].referenced = true;
+    return;
+  }
+
+  // Free entry, or the one chosen by the clock
+  uint8_t index;
+  if (used < ALIAS_CACHE_SIZE) {
+    index = 0;
+    while (entries[index].alias != 0) index++;
+  }
+  else {
+    index = victim();
+    remove(entries[index].alias);
+    evictions++;
+  }
+
+  b = hashAlias(alias);
+  while (buckets[b] >= 0) {
+    b = (b + 1) & (ALIAS_CACHE_BUCKETS - 1);
+  }
+  buckets[b] = index;
+  entries[index].alias = alias;
+  entries[index].nodeID = nodeID;
+  entries[index].referenced = false;
+  used++;
+}
+
+uint8_t AliasCacheClass::victim() {
+  // Second chance: referenced entries lose their bit and are skipped once
+  for (;;) {
+    aliasEntry *entry = &entries[hand];
+    uint8_t index = hand;
+    hand = (hand + 1) & (ALIAS_CACHE_SIZE - 1);
+    if (!entry->referenced) return index;
+    entry->referenced = false;
+  }
+}
+
+void AliasCacheClass::remove(uint16_t alias) {
+  int8_t b = findBucket(alias);
+  if (b < 0) return;
+
+  entries[buckets[b]].alias = 0;
+  buckets[b] = -1;
+  used--;
+
+  // Backward shift deletion, see DatagramPoolClass::deleteSlot
+  uint8_t hole = b;
+  uint8_t next = (hole + 1) & (ALIAS_CACHE_BUCKETS - 1);
+  while (buckets[next] >= 0) {
+    uint8_t home = hashAlias(entries[buckets[next]].alias);
+    if (((next - home) & (ALIAS_CACHE_BUCKETS - 1)) >= ((next - hole) & (ALIAS_CACHE_BUCKETS - 1))) {
+      buckets[hole] = buckets[next];
+      buckets[next] = -1;
+      hole = next;
+    }
+    next = (next + 1) & (ALIAS_CACHE_BUCKETS - 1);
+  }
+}
+
+bool AliasCacheClass::findNodeID(uint16_t alias, uint64_t &nodeID) {
+  int8_t b = findBucket(alias);
+  if (b < 0) {
+    misses++;
+    return false;
+  }
+
+  hits++;
+  entries[buckets[b]].referenced = true;
+  nodeID = entries[buckets[b]].nodeID;
+  return true;
+}
+
+uint16_t AliasCacheClass::findAlias(uint64_t nodeID) {
+  for (int i = 0; i < ALIAS_CACHE_SIZE; i++) {
+    if (entries[i].alias != 0 && entries[i].nodeID == nodeID) {
+      entries[i].referenced = true;
+      return entries[i].alias;
+    }
+  }
+
+  return 0;
+}
+
+uint8_t AliasCacheClass::size() {
+  return used;
+}
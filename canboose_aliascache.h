@@ -0,0 +1,62 @@
+/*
+ * Map of the other nodes' 12 bit aliases to their 48 bit Node IDs, learned from the bus.
+ *
+ * Alias Map Definition, Initialization Complete and Verified Node ID frames add or refresh
+ * entries and Alias Map Reset removes them, so the node can address peers by Node ID without
+ * asking the bus with AME.
+ *
+ * Entries live in a fixed array found through an open addressing hash keyed by alias. When the
+ * cache is full the clock algorithm picks the victim: every hit sets the entry's referenced bit
+ * and the hand sweeps the array clearing bits until it finds one that was not used since its
+ * last pass. Looking up an alias by Node ID is a linear scan of the array.
+ */
+
+#ifndef __CANBOOSE_ALIASCACHE_H__
+#define __CANBOOSE_ALIASCACHE_H__
+
+#include "canboose_hal.h"
+
+#ifndef ALIAS_CACHE_SIZE
+#define ALIAS_CACHE_SIZE      32                        // Nodes remembered. Power of two, up to 64
+#endif
+#define ALIAS_CACHE_BUCKETS   (2 * ALIAS_CACHE_SIZE)    // Load factor never above 50%
+
+struct aliasEntry {
+  uint64_t  nodeID;
+  uint16_t  alias;        // 0 if entry is free
+  bool      referenced;
+};
+
+// Node IDs travel as 6 bytes, most significant first
+uint64_t nodeIDFromBytes(const uint8_t bytes[]);
+void nodeIDToBytes(uint64_t nodeID, uint8_t bytes[]);
+
+class AliasCacheClass {
+  static_assert(ALIAS_CACHE_SIZE >= 2 && ALIAS_CACHE_SIZE <= 64 &&
+                (ALIAS_CACHE_SIZE & (ALIAS_CACHE_SIZE - 1)) == 0, "Alias cache size must be a power of two up to 64");
+
+  public:
+    AliasCacheClass();
+    void clear();
+    void add(uint16_t alias, uint64_t nodeID);
+    void remove(uint16_t alias);
+    bool findNodeID(uint16_t alias, uint64_t &nodeID);
+    uint16_t findAlias(uint64_t nodeID);    // 0 if unknown
+    uint8_t size();
+
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t evictions = 0;
+
+  private:
+    uint8_t hashAlias(uint16_t alias);
+    int8_t findBucket(uint16_t alias);
+    uint8_t victim();
+
+    aliasEntry entries[ALIAS_CACHE_SIZE];
+    int8_t buckets[ALIAS_CACHE_BUCKETS];    // Entry index or -1 if empty
+    uint8_t used;
+    uint8_t hand;
+};
+
+#endif
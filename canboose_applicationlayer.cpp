@@ -1,28 +1,242 @@
-#include <EEPROM.h>
 #include "canboose_applicationlayer.h"
+#include "canboose_cdi.h"
+
+// User and configuration spaces are served from the RAM mirror
+static_assert(CONFIGURATION_EEPROM_OFFSET + CONFIGURATION_SPACE_SIZE <= STORAGE_MIRROR_SIZE,
+              "Configuration space does not fit in the storage mirror");
+
+// Replies are queued whole, so the longest one must fit in an empty TX queue
+static_assert(SNIP_MAX_LENGTH <= 253, "Simple Node Information reply longer than 253 bytes");
+static_assert(SNIP_MAX_FRAMES <= TX_QUEUE_SIZE, "Simple Node Information reply does not fit in the TX queue");
+
+// Manufacturer space (0xFC): the version byte, then these in fixed size fields.
+// The same strings, null terminated, start the Simple Node Information reply
+struct manufacturerField {
+  uint8_t  address;
+  uint8_t  size;
+  textView text;
+};
+
+static const manufacturerField manufacturerFields[] = {
+  {   1, 41, TEXT(MANUFACTURER) },
+  {  42, 41, TEXT(MANUFACTURER_MODEL) },
+  {  83, 21, TEXT(MANUFACTURER_HW_VERSION) },
+  { 104, 21, TEXT(MANUFACTURER_SW_VERSION) },
+};
+
+// Every message the node handles, one table built by the compiler
+static constexpr MtiDispatchClass buildMessageDispatch() {
+  MtiDispatchClass dispatch;
+  NetworkTransportLayer::registerMessageHandlers(dispatch);
+  ApplicationLayer::registerMessageHandlers(dispatch);
+  return dispatch;
+}
+
+static constexpr MtiDispatchClass messageDispatch = buildMessageDispatch();
+static_assert(messageDispatch.longestProbe == 1, "Two MTIs share a dispatch slot, change MtiDispatchClass::slotFor()");
+
+bool ApplicationLayer::init(CanDriver *driver, NonVolatileStorage *nvStorage, const uint8_t *nodeID) {
+#if defined(CANBOOSE_TRACE)
+  traceRecorder.begin();
+#endif
+  // Every space is read in place from the storage mirror. The alias is kept right after it
+  if (nvStorage->size() < ALIAS_EEPROM_OFFSET + 2 || !storage.begin(nvStorage)) return false;
+  snipValid = false;
+  snipPendingCount = 0;
+
+  // Turnouts position is unknown until the first event
+  halOutputBegin(NUMBER_OF_TURNOUTS);
+  for (int i = 0; i < NUMBER_OF_TURNOUTS; i++) {
+    turnoutPosition[i] = TURNOUT_UNKNOWN;
+  }
+  loadEventTable();
+
+  // Erased EEPROM reads 0xFFFF: no alias
+  storedAlias = (storage.read(ALIAS_EEPROM_OFFSET) << 8) | storage.read(ALIAS_EEPROM_OFFSET + 1);
+  network.setMessageDispatch(&messageDispatch, this);
+  network.init(this, driver, nodeID, storedAlias);
+  started = true;
+  return true;
+}
+
+/* -------------------------------------------------------------
+ *  Called from loop(). All protocol work happens here, not in
+ *  interrupts
+ */
+void ApplicationLayer::run() {
+  if (!started) return;
+  network.run();
+  storage.run();
+  if (snipPendingCount > 0) sendPendingSimpleNodeInformation();
+
+  // Keep the alias for the next start up
+  uint16_t alias = network.frameTransferLayer.permittedAlias();
+  if (alias != 0 && alias != storedAlias) {
+    storage.write(ALIAS_EEPROM_OFFSET, alias >> 8);
+    storage.write(ALIAS_EEPROM_OFFSET + 1, alias & 0xFF);
+    storedAlias = alias;
+  }
+#if defined(CANBOOSE_TRACE)
+  traceRecorder.run();
+#endif
+}
+
+void ApplicationLayer::simpleNodeInformationRequest(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  sendSimpleNodeInformationReply(srcAlias);
+}
+
+void ApplicationLayer::eventReport(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  if (len == 8) consumeEvent(data);
+}
+
+void ApplicationLayer::identifyConsumerRequest(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  if (len == 8) identifyConsumer(data);
+}
+
+void ApplicationLayer::identifyEventsRequest(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  identifyEvents();
+}
+
+/* -------------------------------------------------------------
+ *  Event transport
+ */
+void ApplicationLayer::loadEventTable() {
+  // Called at init and every time configuration changes. The frame transfer
+  // layer filter drops most foreign events before they are queued
+  EventFilterClass *filter = &network.frameTransferLayer.eventFilter;
+  eventTable.clear();
+  filter->beginUpdate();
+  for (int turnout = 0; turnout < NUMBER_OF_TURNOUTS; turnout++) {
+    for (int position = TURNOUT_STRAIGHT; position <= TURNOUT_DIVERGING; position++) {
+      uint64_t eventID = getEventID(turnout, position);
+
+      // Blank EEPROM or not configured
+      if (eventID != 0 && eventID != 0xFFFFFFFFFFFFFFFF) {
+        eventTable.add(eventID, turnout * 2 + position);
+        filter->add(eventID);
+      }
+    }
+  }
+  filter->commitUpdate();
+}
+
+uint64_t ApplicationLayer::getEventID(uint8_t turnout, uint8_t position) {
+  uint16_t address = CONFIGURATION_EEPROM_OFFSET + (turnout * 2 + position) * 8;
+  uint64_t eventID = 0;
+  for (int i = 0; i < 8; i++) {
+    eventID = (eventID << 8) | storage.read(address + i);
+  }
+  return eventID;
+}
+
+static uint64_t eventFromData(uint8_t data[]) {
+  uint64_t eventID = 0;
+  for (int i = 0; i < 8; i++) {
+    eventID = (eventID << 8) | data[i];
+  }
+  return eventID;
+}
+
+void ApplicationLayer::consumeEvent(uint8_t data[]) {
+  // Most events on a layout are not for us. They stop here
+  uint8_t actions[EVENT_TABLE_ENTRIES];
+  uint8_t found = eventTable.lookup(eventFromData(data), actions);
+  for (int i = 0; i < found; i++) {
+    setTurnout(actions[i] >> 1, actions[i] & 0x01);
+  }
+}
 
-void ApplicationLayer::init() {
-  network.init(this);
+void ApplicationLayer::identifyConsumer(uint8_t data[]) {
+  uint8_t actions[EVENT_TABLE_ENTRIES];
+  uint8_t found = eventTable.lookup(eventFromData(data), actions);
+  for (int i = 0; i < found; i++) {
+    sendConsumerIdentified(actions[i] >> 1, actions[i] & 0x01);
+  }
 }
 
-void ApplicationLayer::processApplicationMessage(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
-  switch (mti) {
-    case SIMPLE_NODE_INFORMATION_REQUEST:
-      sendSimpleNodeInformationReply(srcAlias);
-      break;
+void ApplicationLayer::identifyEvents() {
+  for (int turnout = 0; turnout < NUMBER_OF_TURNOUTS; turnout++) {
+    for (int position = TURNOUT_STRAIGHT; position <= TURNOUT_DIVERGING; position++) {
+      uint64_t eventID = getEventID(turnout, position);
+      if (eventID != 0 && eventID != 0xFFFFFFFFFFFFFFFF) {
+        sendConsumerIdentified(turnout, position);
+      }
+    }
   }
 }
 
+void ApplicationLayer::sendConsumerIdentified(uint8_t turnout, uint8_t position) {
+  // Valid if the turnout is in this position, invalid if it is in the other one
+  uint16_t mti = CONSUMER_IDENTIFIED_UNKNOWN;
+  if (turnoutPosition[turnout] == position) mti = CONSUMER_IDENTIFIED_VALID;
+  else if (turnoutPosition[turnout] != TURNOUT_UNKNOWN) mti = CONSUMER_IDENTIFIED_INVALID;
+
+  uint64_t eventID = getEventID(turnout, position);
+  uint8_t data[8];
+  for (int i = 0; i < 8; i++) {
+    data[i] = (eventID >> (56 - 8 * i)) & 0xFF;
+  }
+  network.sendMessage(mti, data, 8);
+}
+
+void ApplicationLayer::setTurnout(uint8_t turnout, uint8_t position) {
+  turnoutPosition[turnout] = position;
+  halOutputWrite(turnout, position == TURNOUT_DIVERGING);
+}
+
 void ApplicationLayer::sendSimpleNodeInformationReply(uint16_t srcAlias) {
+  // Asked again before getting it: one reply is enough
+  for (int i = 0; i < snipPendingCount; i++) {
+    if (snipPending[i] == srcAlias) return;
+  }
+
+  if (snipPendingCount == SNIP_PENDING_REQUESTS) {
+    // Startup storm. Tell the node to try again later
+    snipRequestsRejected++;
+    uint8_t reject[6] = { (uint8_t) ((srcAlias & 0x0F00) >> 8), (uint8_t) (srcAlias & 0xFF),
+                          DATAGRAM_BUFFER_UNAVAILABLE >> 8, DATAGRAM_BUFFER_UNAVAILABLE & 0xFF,
+                          SIMPLE_NODE_INFORMATION_REQUEST >> 8, SIMPLE_NODE_INFORMATION_REQUEST & 0xFF };
+    network.sendMessage(OPTIONAL_INTERACTION_REJ, reject, 6);
+    return;
+  }
+
+  snipPending[snipPendingCount++] = srcAlias;
+  sendPendingSimpleNodeInformation();
+  if (snipPendingCount > 0 && snipPending[snipPendingCount - 1] == srcAlias) snipRequestsDeferred++;
+}
+
+// Called when a request arrives and from run(). A reply is only queued when all its
+// frames fit: a frame dropped from the middle would leave the other node with a
+// corrupt reply and no error
+void ApplicationLayer::sendPendingSimpleNodeInformation() {
+  // Reply is encoded once and kept until user information changes
+  if (!snipValid) buildSimpleNodeInformationReply();
+
+  while (snipPendingCount > 0 && network.frameTransferLayer.queueFree(TX_CLASS_ADDRESSED) >= snipNumFrames) {
+    uint16_t dstAlias = snipPending[0];
+
+    // Only destination alias changes from one request to another
+    for (int frame = 0; frame < snipNumFrames; frame++) {
+      uint8_t *block2send = snipFrames[frame];
+      block2send[0] = (block2send[0] & 0xF0) | ((dstAlias & 0x0F00) >> 8);
+      block2send[1] = dstAlias & 0xFF;
+      network.sendMessage(SIMPLE_NODE_INFORMATION_REPLY, block2send, snipFrameLength[frame]);
+    }
+
+    snipPendingCount--;
+    memmove(&snipPending[0], &snipPending[1], snipPendingCount * sizeof(snipPending[0]));
+  }
+}
+
+void ApplicationLayer::buildSimpleNodeInformationReply() {
   // An array to put everything
   uint8_t data2send[253] = { 0x04 };
   uint8_t index = 1;
   
   // Put everything in array
-  index = addStringToArray(mft, data2send, index);
-  index = addStringToArray(mft_model, data2send, index);
-  index = addStringToArray(mft_hw_version, data2send, index);
-  index = addStringToArray(mft_sw_version, data2send, index);
+  for (const manufacturerField &field : manufacturerFields) {
+    index = addStringToArray(field.text, data2send, index);
+  }
   data2send[index] = 0x02;
   index++;
   index = addStringToArray(getNameProvidedByUser(), data2send, index);
@@ -34,51 +248,49 @@ void ApplicationLayer::sendSimpleNodeInformationReply(uint16_t srcAlias) {
   if (last_block_size > 0) num_blocks++;
   if (last_block_size == 0) last_block_size = 6;
 
-  // loops, loops everywhere. OK send 
-  uint8_t dest[2];
-  dest[0] = (srcAlias & 0x0F00) >> 8;
-  dest[1] = srcAlias & 0xFF;
+  // loops, loops everywhere. OK encode. First 2 bytes of every frame
+  // are the destination alias, filled when sending
   for (int block = 0; block < num_blocks; block++) {
-    uint8_t block2send[8];
-    block2send[0] = dest[0];
-    block2send[1] = dest[1];
+    uint8_t *block2send = snipFrames[block];
     
     // Only block, first, middle or last block ?
     // Only one block
     if (num_blocks == 1) {  
+      block2send[0] = 0x00;
       memcpy(&block2send[2], data2send, index);
-      network.sendMessage(SIMPLE_NODE_INFORMATION_REPLY, block2send, 2 + index);
+      snipFrameLength[block] = 2 + index;
     }
     // First block
     else if (block == 0) { 
-      block2send[0] += 0x10;
+      block2send[0] = 0x10;
       memcpy(&block2send[2], &data2send[block * 6], 6);
-      network.sendMessage(SIMPLE_NODE_INFORMATION_REPLY, block2send, 8);
+      snipFrameLength[block] = 8;
     }
     // Last block
     else if (block + 1 == num_blocks) {
-      block2send[0] += 0x20;
+      block2send[0] = 0x20;
       memcpy(&block2send[2], &data2send[block * 6], last_block_size);
-      network.sendMessage(SIMPLE_NODE_INFORMATION_REPLY, block2send, 2 + last_block_size);
+      snipFrameLength[block] = 2 + last_block_size;
     }
     // Middle block
     else {
-      block2send[0] += 0x30;
+      block2send[0] = 0x30;
       memcpy(&block2send[2], &data2send[block * 6], 6);
-      network.sendMessage(SIMPLE_NODE_INFORMATION_REPLY, block2send, 8);
+      snipFrameLength[block] = 8;
     }
   }
-}
 
-uint8_t ApplicationLayer::addStringToArray(String s, uint8_t dest[], uint8_t atPosition) {
-  uint8_t size = s.length();
-  memcpy(&dest[atPosition], &s[0], size);
-  dest[atPosition + size] = 0; // Null terminated strings
+  snipNumFrames = num_blocks;
+  snipValid = true;
+}
 
-  return size + atPosition + 1;
+uint8_t ApplicationLayer::addStringToArray(textView s, uint8_t dest[], uint8_t atPosition) {
+  // Null terminated strings
+  return atPosition + copyText(s, &dest[atPosition], s.length + 1);
 }
 
 void ApplicationLayer::processApplicationDatagram(uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  TRACE(TRACE_APP_DATAGRAM, len > 0 ? data[0] : 0);
   if (len > 0) {
     switch (data[0]) {
       case 0x20:
@@ -93,6 +305,7 @@ void ApplicationLayer::processApplicationDatagram(uint16_t srcAlias, uint8_t dat
   else {
     network.sendDatagramRejected(srcAlias, 0x1042);  // Datagram type Uknown
   }
+  TRACE(TRACE_APP_DATAGRAM_END, len > 0 ? data[0] : 0);
 }
 
 void ApplicationLayer::processMemoryConfigurationProtocol(uint16_t srcAlias, uint8_t data[], uint8_t len) {
@@ -106,6 +319,14 @@ void ApplicationLayer::processMemoryConfigurationProtocol(uint16_t srcAlias, uin
         writeCommand(srcAlias, data, len);
         break;
       
+      // Write Stream Command
+      case 0x20:
+      case 0x21:
+      case 0x22:
+      case 0x23:
+        writeStreamCommand(srcAlias, data, len);
+        break;
+
       // Read Command
       case 0x40:
       case 0x41:
@@ -114,6 +335,14 @@ void ApplicationLayer::processMemoryConfigurationProtocol(uint16_t srcAlias, uin
         readReply(srcAlias, data, len);
         break;
 
+      // Read Stream Command
+      case 0x60:
+      case 0x61:
+      case 0x62:
+      case 0x63:
+        readStreamCommand(srcAlias, data, len);
+        break;
+
       // Get configuration options command
       case 0x80:
         getConfigurationOptionsReply(srcAlias, data, len);
@@ -163,6 +392,9 @@ void ApplicationLayer::writeCommand(uint16_t srcAlias, uint8_t data[], uint8_t l
         if (space == 0xFB) {
           writeUserSpace(srcAlias, address, &data[min_length_should_be - 1], count);
         }
+        else if (space == 0xFD) {
+          writeConfigurationSpace(srcAlias, address, &data[min_length_should_be - 1], count);
+        }
         else {
           // TODO - 0xFC is a read only space. Manufacturer info space
           
@@ -170,7 +402,8 @@ void ApplicationLayer::writeCommand(uint16_t srcAlias, uint8_t data[], uint8_t l
         break;
 
       case 0x01:
-        // TODO - Device configuration space
+        // Device configuration space
+        writeConfigurationSpace(srcAlias, address, &data[min_length_should_be - 1], count);
         break;
 
       case 0x02:
@@ -204,6 +437,8 @@ void ApplicationLayer::writeUserSpace(uint16_t srcAlias, uint32_t address, uint8
     return;
   }
 
+  // Simple Node Information reply has to be encoded again
+  snipValid = false;
   network.sendDatagramOK(srcAlias);
 }
 
@@ -239,6 +474,12 @@ void ApplicationLayer::readReply(uint16_t srcAlias, uint8_t data[], uint8_t len)
         else if (space == 0xFB) {
           readUserSpace(srcAlias, address, count);
         }
+        else if (space == 0xFD) {
+          readConfigurationSpace(srcAlias, address, count);
+        }
+        else if (space == STATISTICS_SPACE) {
+          readStatisticsSpace(srcAlias, address, count);
+        }
         break;
       case 0x41:
         // Space = 0xFD;
@@ -266,13 +507,10 @@ void ApplicationLayer::readReply(uint16_t srcAlias, uint8_t data[], uint8_t len)
 void ApplicationLayer::readCDI(uint16_t srcAlias, uint32_t address, uint8_t count) {
   // Some configuration tool is asking for the xml
   uint16_t size = count;
-  uint16_t xml_size = cdi_string.length() + 1;
-  if (address < xml_size && size <= 64) {
+  if (address < CDI_SIZE && size <= 64) {
     // Create array and send it
-    if (address + size > xml_size) size = xml_size - address;
-    uint8_t data[size];
-    memcpy(data, &cdi_string[address], size);
-    sendReply(srcAlias, 0x53, address, 0, data, size);
+    if (address + size > CDI_SIZE) size = CDI_SIZE - address;
+    sendReply(srcAlias, 0x53, address, 0, (const uint8_t*) &cdi_xml.chars[address], size);
   }
   else {
     // Out of bounds, sorry
@@ -282,42 +520,26 @@ void ApplicationLayer::readCDI(uint16_t srcAlias, uint32_t address, uint8_t coun
 
 void ApplicationLayer::readManufacturerSpace(uint16_t srcAlias, uint32_t address, uint8_t count) {
   // Five addresses can be read from manufacturer configuration: 0, 1, 42, 83 and 104
-  uint8_t data[41] = { 0 };
-  uint8_t size;
-  String text = "";
+  uint8_t data[41];
   if (address == 0) {
-    size = 1;
     data[0] = mft_version;
-  }
-  else if (address == 1) {
-    size = 41;
-    text = mft;
-  }
-  else if (address == 42) {
-    size = 41;
-    text = mft_model;
-  }
-  else if (address == 83) {
-    size = 21;
-    text = mft_hw_version;
-  }
-  else if (address == 104) {
-    size = 21;
-    text = mft_sw_version;
-  }
-  else {
-    // TODO- Address unknown
-
+    sendReply(srcAlias, 0x40, address, 0xFC, data, 1);
     return;
   }
 
-  if (address > 0) memcpy(data, &text[0], text.length() + 1);  
-  sendReply(srcAlias, 0x40, address, 0xFC, data, size);  
+  for (const manufacturerField &field : manufacturerFields) {
+    if (field.address == address) {
+      copyText(field.text, data, field.size);
+      sendReply(srcAlias, 0x40, address, 0xFC, data, field.size);
+      return;
+    }
+  }
+  // TODO- Address unknown
 }
 
 void ApplicationLayer::readUserSpace(uint16_t srcAlias, uint32_t address, uint8_t count) {
   // Three addresses can be read from user configuration: 0, 1 and 64
-  uint8_t data[64] = { 0 };
+  uint8_t data[64];
   uint8_t size;
   if (address == 0) {  // Version (byte)
     data[0] = getVersionProvidedByUser();
@@ -325,17 +547,13 @@ void ApplicationLayer::readUserSpace(uint16_t srcAlias, uint32_t address, uint8_
     sendReply(srcAlias, 0x50, address, 0xFB, data, size);
   }
   else if (address == 1) {
-    String text = getNameProvidedByUser();
-    uint8_t text_size = text.length();
     size = 63;
-    memcpy(data, &text[0], text_size + 1);
+    copyText(getNameProvidedByUser(), data, size);
     sendReply(srcAlias, 0x50, address, 0xFB, data, size);
   }
   else if (address == 64) {
-    String text = getDescriptionProvidedByUser();
-    uint8_t text_size = text.length();
     size = 64;
-    memcpy(data, &text[0], text_size + 1);  
+    copyText(getDescriptionProvidedByUser(), data, size);
     sendReply(srcAlias, 0x50, address, 0xFB, data, size);  
   }
   else {
@@ -344,70 +562,393 @@ void ApplicationLayer::readUserSpace(uint16_t srcAlias, uint32_t address, uint8_
   }
 }
 
+/* -------------------------------------------------------------
+ *  Statistics space. Read only, a fresh snapshot on every read.
+ *  Layout in canboose_statistics.h
+ */
+void ApplicationLayer::readStatisticsSpace(uint16_t srcAlias, uint32_t address, uint8_t count) {
+  uint8_t data[64];
+  uint8_t size = 0;
+  if (count <= 64 && address < STATISTICS_SPACE_SIZE) {
+    uint8_t image[STATISTICS_SPACE_SIZE];
+    buildStatistics(image);
+    size = count;
+    if (address + size > STATISTICS_SPACE_SIZE) size = STATISTICS_SPACE_SIZE - address;
+    memcpy(data, &image[address], size);
+  }
+#if defined(CANBOOSE_TRACE)
+  else if (count <= 64 && address >= STATISTICS_TRACE_OFFSET && address < statisticsSpaceEnd()) {
+    size = readTrace(address - STATISTICS_TRACE_OFFSET, data, count);
+  }
+#endif
+
+  if (size == 0) {
+    uint8_t error[2] = { 0x10, 0x82 };  // Out of bounds
+    sendReply(srcAlias, 0x58, address, STATISTICS_SPACE, error, 2);
+    return;
+  }
+  sendReply(srcAlias, 0x50, address, STATISTICS_SPACE, data, size);
+}
+
+uint32_t ApplicationLayer::statisticsSpaceEnd() {
+#if defined(CANBOOSE_TRACE)
+  return STATISTICS_TRACE_OFFSET + 12 + 8 * TRACE_BUFFER_SIZE;
+#else
+  return STATISTICS_SPACE_SIZE;
+#endif
+}
+
+#if defined(CANBOOSE_TRACE)
+uint8_t ApplicationLayer::readTrace(uint32_t offset, uint8_t data[], uint8_t count) {
+  // The ring stays still while a tool reads it in pieces
+  if (offset == 0) traceRecorder.freeze();
+
+  uint32_t end = 12 + 8 * traceRecorder.count();
+  if (offset >= end) return 0;
+  if (offset + count > end) count = end - offset;
+
+  for (uint8_t i = 0; i < count; i++) {
+    uint32_t at = offset + i;
+    uint32_t value;
+    uint8_t shift;
+    if (at < 12) {
+      uint32_t header[3] = { halTraceTicksPerMicro(), traceRecorder.count(), traceRecorder.recorded };
+      value = header[at / 4];
+      shift = 24 - 8 * (at % 4);
+    }
+    else {
+      traceRecord &r = traceRecorder.at((at - 12) / 8);
+      uint8_t field = (at - 12) % 8;
+      if (field < 4) {
+        value = r.ticks;
+        shift = 24 - 8 * field;
+      }
+      else {
+        value = ((uint32_t) r.point << 24) | r.arg;
+        shift = 24 - 8 * (field - 4);
+      }
+    }
+    data[i] = value >> shift;
+  }
+
+  if (offset + count == end) traceRecorder.resume();
+  return count;
+}
+#endif
+
+static uint8_t* putStatistic(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+  return p + 4;
+}
+
+void ApplicationLayer::buildStatistics(uint8_t image[]) {
+  FrameTransferLayer &ftl = network.frameTransferLayer;
+  frameCounters &counters = ftl.counters;
+  uint32_t rxOverflows, txOverflows;
+  uint16_t rxHighWater, txHighWater[TX_CLASSES];
+  uint8_t incomingInUse, outgoingInUse;
+  ftl.queueStatistics(rxOverflows, rxHighWater, txOverflows, txHighWater);
+  network.datagramStatistics(incomingInUse, outgoingInUse);
+
+  uint8_t *p = image;
+  p = putStatistic(p, STATISTICS_VERSION);
+  p = putStatistic(p, halMillis());
+  for (int i = 0; i < 8; i++) p = putStatistic(p, counters.rxFrames[i]);
+  for (int i = 0; i < 8; i++) p = putStatistic(p, counters.txFrames[i]);
+  p = putStatistic(p, counters.rxFiltered);
+  p = putStatistic(p, rxOverflows);
+  p = putStatistic(p, rxHighWater);
+  for (int i = 0; i < TX_CLASSES; i++) p = putStatistic(p, txHighWater[i]);
+  p = putStatistic(p, txOverflows);
+  p = putStatistic(p, counters.aliasCollisions);
+  p = putStatistic(p, ftl.aliasCache.size());
+  p = putStatistic(p, ftl.aliasCache.hits);
+  p = putStatistic(p, ftl.aliasCache.misses);
+  p = putStatistic(p, incomingInUse);
+  p = putStatistic(p, outgoingInUse);
+  p = putStatistic(p, network.datagramsResent);
+  p = putStatistic(p, network.datagramsRejected);
+  p = putStatistic(p, network.datagramsAbandoned);
+  p = putStatistic(p, network.datagramsTimedOut);
+  p = putStatistic(p, network.reassemblyTimeouts);
+  p = putStatistic(p, network.reassemblyOverflows);
+  p = putStatistic(p, network.reassemblyOutOfOrder);
+  p = putStatistic(p, network.reassemblyPoolFull);
+  p = putStatistic(p, counters.isrCount);
+  p = putStatistic(p, counters.isrMicros);
+  p = putStatistic(p, counters.isrMaxMicros);
+  p = putStatistic(p, halHeapUsed());
+  p = putStatistic(p, storage.flushes);
+  putStatistic(p, storage.bytesFlushed);
+}
+
 uint8_t ApplicationLayer::getVersionProvidedByUser() {
-  return EEPROM.read(0);
+  return storage.read(0);
 }
 
 void ApplicationLayer::setVersionProvidedByUser(uint8_t b) {
-  EEPROM.write(0, b);
+  storage.write(0, b);
 }
 
-String ApplicationLayer::getNameProvidedByUser() {
-  uint8_t b[63];
-  for (int i = 0; i < 63; i++) {
-    b[i] = EEPROM.read(i + 1);
-  }
-  return (const char*) b;
+textView ApplicationLayer::getNameProvidedByUser() {
+  return getUserString(1, 63);
 }
 
 void ApplicationLayer::setNameProvidedByUser(uint8_t data[], uint8_t len) {
   uint8_t max = len;
   if (max > 63) max = 63;
   for (int i = 0; i < max; i++) {
-    EEPROM.write(i + 1, data[i]);
+    storage.write(i + 1, data[i]);
   }
 }
 
-String ApplicationLayer::getDescriptionProvidedByUser() {
-  uint8_t b[64];
-  for (int i = 0; i < 64; i++) {
-    b[i] = EEPROM.read(i + 64);
-  }
-  return (const char*) b;
+textView ApplicationLayer::getDescriptionProvidedByUser() {
+  return getUserString(64, 64);
 }
 
 void ApplicationLayer::setDescriptionProvidedByUser(uint8_t data[], uint8_t len) {
   uint8_t max = len;
   if (max > 64) max = 64;
   for (int i = 0; i < max; i++) {
-    EEPROM.write(i + 64, data[i]);
+    storage.write(i + 64, data[i]);
   }
 }
 
+textView ApplicationLayer::getUserString(uint16_t address, uint8_t maxLength) {
+  // Text ends at the first null, or at the first blank (0xFF) byte of a
+  // never written EEPROM, and never goes beyond its field. Read in place
+  // from the mirror, valid until the next write
+  const uint8_t *stored = storage.mirrored(address);
+  uint8_t length = 0;
+  while (length < maxLength && stored[length] != 0x00 && stored[length] != 0xFF) {
+    length++;
+  }
+  return textView { (const char*) stored, length };
+}
+
 void ApplicationLayer::readConfigurationSpace(uint16_t srcAlias, uint32_t address, uint8_t count) {
-  uint8_t data[count] = { 0 };
-  sendReply(srcAlias, 0x51, address, 0, data, count);
+  if (address < CONFIGURATION_SPACE_SIZE) {
+    // A reply carries 64 bytes at most, the tool asks again for the rest
+    if (count > 64) count = 64;
+    if (address + count > CONFIGURATION_SPACE_SIZE) count = CONFIGURATION_SPACE_SIZE - address;
+    sendReply(srcAlias, 0x51, address, 0, storage.mirrored(CONFIGURATION_EEPROM_OFFSET + address), count);
+  }
+  else {
+    uint8_t error[2] = { 0x10, 0x82 };  // Out of bounds
+    sendReply(srcAlias, 0x58, address, 0xFD, error, 2);
+  }
+}
+
+void ApplicationLayer::writeConfigurationSpace(uint16_t srcAlias, uint32_t address, uint8_t data[], uint8_t count) {
+  if (address + count <= CONFIGURATION_SPACE_SIZE) {
+    for (int i = 0; i < count; i++) {
+      storage.write(CONFIGURATION_EEPROM_OFFSET + address + i, data[i]);
+    }
+
+    // Event IDs may have changed
+    loadEventTable();
+    network.sendDatagramOK(srcAlias);
+  }
+  else {
+    // Nothing written. Datagram OK, then the write failure
+    uint8_t error[2] = { 0x10, 0x82 };  // Out of bounds
+    sendReply(srcAlias, 0x18, address, 0xFD, error, 2);
+  }
 }
 
-void ApplicationLayer::sendReply(uint16_t srcAlias, uint8_t command_type, uint32_t address, uint8_t space, uint8_t data[], uint8_t count) {
-  uint8_t array_of_data[72] = {0x20, command_type, (uint8_t) ((address & 0xFF000000) >> 24), 
-                                                   (uint8_t) ((address & 0x00FF0000) >> 16),
-                                                   (uint8_t) ((address & 0x0000FF00) >> 8),
-                                                   (uint8_t) (address & 0x000000FF) };
+// The reply is written straight into the buffer the datagram is sent from, and kept in for retries
+void ApplicationLayer::sendReply(uint16_t srcAlias, uint8_t command_type, uint32_t address, uint8_t space, const uint8_t data[], uint8_t count) {
+  uint8_t local[72];
+  uint8_t *reply = network.datagramBuffer(srcAlias);
+  if (reply == NULL) reply = local;
+
+  reply[0] = 0x20;
+  reply[1] = command_type;
+  reply[2] = (address & 0xFF000000) >> 24;
+  reply[3] = (address & 0x00FF0000) >> 16;
+  reply[4] = (address & 0x0000FF00) >> 8;
+  reply[5] = address & 0x000000FF;
   uint8_t index = 6;
   if (space > 0) {
-    array_of_data[6] = space;
+    reply[6] = space;
     index++;
   }
   
-  memcpy(&array_of_data[index], data, count);
-  network.sendDatagram(srcAlias, array_of_data, count + index, true);
+  memcpy(&reply[index], data, count);
+  if (reply == local) network.sendDatagram(srcAlias, local, count + index, true);
+  else network.sendDatagramBuffer(srcAlias, count + index, true);
+}
+
+/* -------------------------------------------------------------
+ *  Memory configuration over streams. Whole spaces in one go:
+ *  the data goes in stream frames, 7 bytes each, and there is
+ *  one proceed per window instead of one datagram round trip
+ *  every 64 bytes
+ */
+uint8_t* ApplicationLayer::streamSpace(uint8_t space, uint32_t &size) {
+  switch (space) {
+    case 0xFF:
+      size = CDI_SIZE;
+      return (uint8_t*) cdi_xml.chars;
+
+    case 0xFD:
+      size = CONFIGURATION_SPACE_SIZE;
+      return (uint8_t*) storage.mirrored(CONFIGURATION_EEPROM_OFFSET);
+
+    case 0xFB:
+      size = 128;
+      return (uint8_t*) storage.mirrored(0);
+  }
+
+  size = 0;
+  return NULL;
+}
+
+void ApplicationLayer::readStreamCommand(uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  // Space is in the command or in byte 6
+  uint8_t index = 6;
+  uint8_t space = 0xFC + (data[1] & 0x03);
+  if (data[1] == 0x60) {
+    space = data[6];
+    index = 7;
+  }
+
+  // Source stream ID (ours, reserved), destination stream ID and read count
+  if (len < index + 6) {
+    network.sendDatagramRejected(srcAlias, 0x1000);  // Not well formed
+    return;
+  }
+
+  uint32_t address = ((uint32_t) data[2] << 24) + (data[3] << 16) + (data[4] << 8) + data[5];
+  uint8_t dstStreamID = data[index + 1];
+  uint32_t count = ((uint32_t) data[index + 2] << 24) + (data[index + 3] << 16) + (data[index + 4] << 8) + data[index + 5];
+  uint8_t replySpace = data[1] == 0x60 ? space : 0;
+
+  uint16_t error = 0;
+  uint32_t size;
+  uint8_t *bytes = streamSpace(space, size);
+  uint8_t srcStreamID = STREAM_NONE;
+  if (bytes == NULL) {
+    error = 0x1081;  // Unknown space
+  }
+  else if (address >= size) {
+    error = 0x1082;  // Out of bounds
+  }
+  else {
+    // Count 0 means up to the end of the space
+    if (count == 0 || address + count > size) count = size - address;
+    srcStreamID = network.openOutgoingStream(srcAlias, dstStreamID, &bytes[address], count);
+    if (srcStreamID == STREAM_NONE) error = 0x2000;  // Busy, try later
+  }
+
+  if (error == 0) {
+    // Read Stream Reply. The stream follows
+    uint8_t reply[6] = { srcStreamID, dstStreamID, (uint8_t) (count >> 24), (uint8_t) (count >> 16),
+                         (uint8_t) (count >> 8), (uint8_t) (count & 0xFF) };
+    sendReply(srcAlias, 0x70 | (data[1] & 0x03), address, replySpace, reply, 6);
+  }
+  else {
+    uint8_t reply[2] = { (uint8_t) (error >> 8), (uint8_t) (error & 0xFF) };
+    sendReply(srcAlias, 0x78 | (data[1] & 0x03), address, replySpace, reply, 2);
+  }
+}
+
+void ApplicationLayer::writeStreamCommand(uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  // Space is in the command or in byte 6
+  uint8_t index = 6;
+  uint8_t space = 0xFC + (data[1] & 0x03);
+  if (data[1] == 0x20) {
+    space = data[6];
+    index = 7;
+  }
+
+  // Source stream ID (sender's)
+  if (len < index + 1) {
+    network.sendDatagramRejected(srcAlias, 0x1000);  // Not well formed
+    return;
+  }
+
+  uint32_t address = ((uint32_t) data[2] << 24) + (data[3] << 16) + (data[4] << 8) + data[5];
+  uint8_t replySpace = data[1] == 0x20 ? space : 0;
+
+  // Only one write stream at a time, and never the CDI
+  uint16_t error = 0;
+  uint32_t size;
+  if (space == 0xFF || streamSpace(space, size) == NULL) {
+    error = 0x1081;  // Unknown or read only space
+  }
+  else if (address >= size) {
+    error = 0x1082;  // Out of bounds
+  }
+  else if (streamWriteID != STREAM_NONE) {
+    error = 0x2000;  // Busy, try later
+  }
+  else {
+    streamWriteID = network.openIncomingStream(srcAlias, data[index]);
+    if (streamWriteID == STREAM_NONE) error = 0x2000;
+  }
+
+  if (error == 0) {
+    // Write Stream Reply goes when the stream is complete
+    streamWriteAlias = srcAlias;
+    streamWriteSourceID = data[index];
+    streamWriteCommand = data[1];
+    streamWriteSpace = space;
+    streamWriteStart = address;
+    streamWriteAddress = address;
+    network.sendDatagramOK(srcAlias);
+  }
+  else {
+    uint8_t reply[2] = { (uint8_t) (error >> 8), (uint8_t) (error & 0xFF) };
+    sendReply(srcAlias, 0x38 | (data[1] & 0x03), address, replySpace, reply, 2);
+  }
+}
+
+void ApplicationLayer::processStreamData(uint16_t srcAlias, uint8_t streamID, uint8_t data[], uint8_t len) {
+  if (streamID != streamWriteID || srcAlias != streamWriteAlias) return;
+
+  // Bytes beyond the end of the space are dropped
+  uint32_t size;
+  streamSpace(streamWriteSpace, size);
+  uint16_t offset = streamWriteSpace == 0xFD ? CONFIGURATION_EEPROM_OFFSET : 0;
+  for (int i = 0; i < len && streamWriteAddress < size; i++) {
+    storage.write(offset + streamWriteAddress, data[i]);
+    streamWriteAddress++;
+  }
+}
+
+void ApplicationLayer::streamClosed(uint16_t srcAlias, uint8_t streamID, bool completed) {
+  if (streamID != streamWriteID || srcAlias != streamWriteAlias) return;
+  streamWriteID = STREAM_NONE;
+
+  // Configuration may have changed
+  if (streamWriteSpace == 0xFD) loadEventTable();
+  if (streamWriteSpace == 0xFB) snipValid = false;
+
+  // Write Stream Reply, OK or failed. The command was acknowledged already
+  uint8_t reply[10] = { 0x20, (uint8_t) ((completed ? 0x30 : 0x38) | (streamWriteCommand & 0x03)),
+                        (uint8_t) (streamWriteStart >> 24), (uint8_t) (streamWriteStart >> 16),
+                        (uint8_t) (streamWriteStart >> 8), (uint8_t) (streamWriteStart & 0xFF) };
+  uint8_t index = 6;
+  if (streamWriteCommand == 0x20) reply[index++] = streamWriteSpace;
+  if (completed) {
+    reply[index++] = streamWriteSourceID;
+    reply[index++] = streamID;
+  }
+  else {
+    reply[index++] = 0x20;  // Timed out, try again
+    reply[index++] = 0x00;
+  }
+  network.sendDatagram(srcAlias, reply, index, false);
 }
 
 void ApplicationLayer::getConfigurationOptionsReply(uint16_t srcAlias, uint8_t data[], uint8_t len) {
   // Send GetConfigurationOptionsReply
   // TODO
-  uint8_t data2send[7] = {0x20, 0x82, 0x08 + 0x04 + 0x02, 0x00, 0x80 + 0x02, 0xFF, 0xFB};
+  uint8_t data2send[7] = {0x20, 0x82, 0x08 + 0x04 + 0x02, 0x00, 0x80 + 0x02, 0xFF, STATISTICS_SPACE};
   network.sendDatagram(srcAlias, data2send, 7, true);
 }
 
@@ -415,50 +956,56 @@ void ApplicationLayer::getAddressSpaceInformationReply(uint16_t srcAlias, uint8_
   if (len == 3) {
     // Send getAddressSpaceInformationReply
     // TODO - Calculate high address of each space
-    String description = "";
+    textView description = TEXT("");
     uint8_t spacePresent = 0x87;  // true
     uint8_t flags = 0x00;
     uint32_t high_address = 0;
 
     switch (data[2]) {
       case 0xFF:
-        description = "Configuration definition information";
-        high_address = cdi_string.length() + 1;
+        description = TEXT("Configuration definition information");
+        high_address = CDI_SIZE;
         flags = 0x01;
         break;
 
       case 0xFE:
-        description = "All device's memory";
+        description = TEXT("All device's memory");
         break;
 
       case 0xFD:
-        description = "Device configuration";
+        description = TEXT("Device configuration");
+        high_address = CONFIGURATION_SPACE_SIZE;
         break;
 
       case 0xFC:
-        description = "Manufacturer information";
+        description = TEXT("Manufacturer information");
         high_address = 125;
         flags = 0x01;
         break;
 
       case 0xFB:
-        description = "User entered information";
+        description = TEXT("User entered information");
         high_address = 128;
         break;
 
+      case STATISTICS_SPACE:
+        description = TEXT("Node statistics");
+        high_address = statisticsSpaceEnd();
+        flags = 0x01;
+        break;
+
       default:
         spacePresent = 0x86;
         break;
     }
 
     // Prepare array to send as a datagram
-    uint8_t descLength = description.length();
-    uint8_t arrayLength = 9 + descLength;
-    uint8_t data2send[arrayLength] = {0x20, spacePresent, data[2], (uint8_t) ((high_address & 0xFF000000) >> 24), 
-                                                                   (uint8_t) ((high_address & 0x00FF0000) >> 16),
-                                                                   (uint8_t) ((high_address & 0x0000FF00) >> 8),
-                                                                   (uint8_t) (high_address & 0x000000FF), flags};
-    memcpy(&data2send[8], &description[0], descLength + 1);
+    uint8_t arrayLength = 9 + description.length;
+    uint8_t data2send[DATAGRAM_MAX_LENGTH] = {0x20, spacePresent, data[2], (uint8_t) ((high_address & 0xFF000000) >> 24), 
+                                                                          (uint8_t) ((high_address & 0x00FF0000) >> 16),
+                                                                          (uint8_t) ((high_address & 0x0000FF00) >> 8),
+                                                                          (uint8_t) (high_address & 0x000000FF), flags};
+    copyText(description, &data2send[8], description.length + 1);
 
     // Send it
     network.sendDatagram(srcAlias, data2send, arrayLength, true);
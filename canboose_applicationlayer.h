@@ -1,9 +1,11 @@
 #ifndef __CANBOOSE_APPLICATIONLAYER_H__
 #define __CANBOOSE_APPLICATIONLAYER_H__
 
-#include <Arduino.h>
-
+#include "canboose_hal.h"
 #include "canboose_networktransportlayer.h"
+#include "canboose_eventtable.h"
+#include "canboose_storagemanager.h"
+#include "canboose_text.h"
 
 /* -------------------------------------------------------------
  *  Application Layer. Implementation of application protocols
@@ -16,18 +18,91 @@
 #define SIMPLE_NODE_INFORMATION_REQUEST     0xDE8
 #define SIMPLE_NODE_INFORMATION_REPLY       0xA08
 
+// Longest reply: two version bytes, the manufacturer strings, user name (63) and description (64),
+// all null terminated. 6 bytes in each frame. A whole reply is queued at once or not at all: while
+// the addressed TX queue has no room requests wait, up to SNIP_PENDING_REQUESTS of them
+#define SNIP_MAX_LENGTH                     (2 + sizeof(MANUFACTURER) + sizeof(MANUFACTURER_MODEL) + \
+                                             sizeof(MANUFACTURER_HW_VERSION) + sizeof(MANUFACTURER_SW_VERSION) + 64 + 65)
+#define SNIP_MAX_FRAMES                     ((SNIP_MAX_LENGTH + 5) / 6)
+#define SNIP_PENDING_REQUESTS               8
+
+/* -------------------------------------------------------------
+ * Manufacturer information. Also used to build the CDI xml at
+ * compile time, see canboose_cdi.h
+ */
+
+#define MANUFACTURER                  "Canboose Inc."
+#define MANUFACTURER_MODEL            "Canboose 16 I/O node"
+#define MANUFACTURER_HW_VERSION       "1.0"
+#define MANUFACTURER_SW_VERSION       "1.0"
+
+/* -------------------------------------------------------------
+ * Turnouts. Configuration space 0xFD holds a Straight and a Diverging
+ * event ID for each turnout. It is stored in EEPROM after user space
+ */
+
+#define NUMBER_OF_TURNOUTS            16
+#define CONFIGURATION_SPACE_SIZE      (NUMBER_OF_TURNOUTS * 2 * 8)
+#define CONFIGURATION_EEPROM_OFFSET   128
+
+// Alias of the last time, tried first at the next start up. 2 bytes after the mirrored
+// spaces, written only when it changes
+#define ALIAS_EEPROM_OFFSET           STORAGE_MIRROR_SIZE
+
+#define TURNOUT_STRAIGHT              0
+#define TURNOUT_DIVERGING             1
+#define TURNOUT_UNKNOWN               0xFF
+
 class ApplicationLayer : public ApplicationListener {
   public:
-    void init();
-    void processApplicationMessage(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    // False if the storage is too small for the spaces. The node then stays off the bus
+    bool init(CanDriver *driver, NonVolatileStorage *nvStorage, const uint8_t *nodeID = UID_array);
+    void run();
     void processApplicationDatagram(uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void processStreamData(uint16_t srcAlias, uint8_t streamID, uint8_t data[], uint8_t len);
+    void streamClosed(uint16_t srcAlias, uint8_t streamID, bool completed);
+
+    // Messages this layer handles, in the same dispatch table as the network layer ones
+    static constexpr void registerMessageHandlers(MtiDispatchClass &dispatch) {
+      dispatch.add(SIMPLE_NODE_INFORMATION_REQUEST, MTI_ADDRESSED | MTI_APPLICATION, MTI_HANDLER(ApplicationLayer, simpleNodeInformationRequest));
+      dispatch.add(PRODUCER_CONSUMER_EVENT_REPORT,  MTI_GLOBAL | MTI_APPLICATION,    MTI_HANDLER(ApplicationLayer, eventReport));
+      dispatch.add(IDENTIFY_CONSUMER,               MTI_GLOBAL | MTI_APPLICATION,    MTI_HANDLER(ApplicationLayer, identifyConsumerRequest));
+      dispatch.add(IDENTIFY_EVENTS_GLOBAL,          MTI_GLOBAL | MTI_APPLICATION,    MTI_HANDLER(ApplicationLayer, identifyEventsRequest));
+      dispatch.add(IDENTIFY_EVENTS_ADDRESSED,       MTI_ADDRESSED | MTI_APPLICATION, MTI_HANDLER(ApplicationLayer, identifyEventsRequest));
+    }
     
     NetworkTransportLayer network;
 
+    // User provided information and configuration live here. Mirrored in RAM,
+    // written to EEPROM once writes stop
+    StorageManagerClass storage;
+
+    // Simple Node Information requests answered later for lack of TX queue room, and
+    // rejected (temporary error) because too many were waiting already
+    uint32_t snipRequestsDeferred = 0;
+    uint32_t snipRequestsRejected = 0;
+
   private:
+    // Message handlers
+    void simpleNodeInformationRequest(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void eventReport(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void identifyConsumerRequest(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void identifyEventsRequest(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+
     // Simple Node Information Protocol
     void sendSimpleNodeInformationReply(uint16_t srcAlias);
-    uint8_t addStringToArray(String s, uint8_t dest[], uint8_t atPosition);
+    void sendPendingSimpleNodeInformation();
+    void buildSimpleNodeInformationReply();
+    uint8_t addStringToArray(textView s, uint8_t dest[], uint8_t atPosition);
+
+    // Event transport. Turnouts consume events
+    void loadEventTable();
+    uint64_t getEventID(uint8_t turnout, uint8_t position);
+    void consumeEvent(uint8_t data[]);
+    void identifyConsumer(uint8_t data[]);
+    void identifyEvents();
+    void sendConsumerIdentified(uint8_t turnout, uint8_t position);
+    void setTurnout(uint8_t turnout, uint8_t position);
 
     // Memory configuration protocol
     void processMemoryConfigurationProtocol(uint16_t srcAlias, uint8_t data[], uint8_t len);
@@ -37,64 +112,54 @@ class ApplicationLayer : public ApplicationListener {
     void readCDI(uint16_t srcAlias, uint32_t address, uint8_t count);
     void readManufacturerSpace(uint16_t srcAlias, uint32_t address, uint8_t count);
     void readUserSpace(uint16_t srcAlias, uint32_t address, uint8_t count);
+    void readStatisticsSpace(uint16_t srcAlias, uint32_t address, uint8_t count);
+    void buildStatistics(uint8_t image[]);
+    uint32_t statisticsSpaceEnd();
+    uint8_t readTrace(uint32_t offset, uint8_t data[], uint8_t count);
     uint8_t getVersionProvidedByUser();
     void setVersionProvidedByUser(uint8_t b); 
-    String getNameProvidedByUser();
+    textView getNameProvidedByUser();
     void setNameProvidedByUser(uint8_t data[], uint8_t len);
-    String getDescriptionProvidedByUser();
+    textView getDescriptionProvidedByUser();
     void setDescriptionProvidedByUser(uint8_t data[], uint8_t len);
+    textView getUserString(uint16_t address, uint8_t maxLength);
     void readConfigurationSpace(uint16_t srcAlias, uint32_t address, uint8_t count);
-    void sendReply(uint16_t srcAlias, uint8_t command_type, uint32_t address, uint8_t space, uint8_t data[], uint8_t count);
+    void writeConfigurationSpace(uint16_t srcAlias, uint32_t address, uint8_t data[], uint8_t count);
+    void sendReply(uint16_t srcAlias, uint8_t command_type, uint32_t address, uint8_t space, const uint8_t data[], uint8_t count);
     void getConfigurationOptionsReply(uint16_t srcAlias, uint8_t data[], uint8_t len);
     void getAddressSpaceInformationReply(uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void readStreamCommand(uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void writeStreamCommand(uint16_t srcAlias, uint8_t data[], uint8_t len);
+    uint8_t* streamSpace(uint8_t space, uint32_t &size);
+
+    // Simple Node Information reply, already encoded in frames
+    uint8_t snipFrames[SNIP_MAX_FRAMES][8];
+    uint8_t snipFrameLength[SNIP_MAX_FRAMES];
+    uint8_t snipNumFrames;
+    bool snipValid;
+    uint16_t snipPending[SNIP_PENDING_REQUESTS];    // Aliases waiting for a reply, oldest first
+    uint8_t snipPendingCount = 0;
+
+    // Memory configuration write stream in progress
+    uint16_t streamWriteAlias;
+    uint8_t  streamWriteID = STREAM_NONE;   // Our destination stream ID
+    uint8_t  streamWriteSourceID;
+    uint8_t  streamWriteCommand;
+    uint8_t  streamWriteSpace;
+    uint32_t streamWriteStart;
+    uint32_t streamWriteAddress;
+
+    // Consumed events and turnout positions
+    EventTableClass eventTable;
+    uint8_t turnoutPosition[NUMBER_OF_TURNOUTS];
+
+    // Alias stored for the next start up
+    uint16_t storedAlias;
+
+    bool started = false;
 
-    // Manufacturer information
+    // Manufacturer information. The strings are constants, see canboose_applicationlayer.cpp
     uint8_t mft_version = 1;
-    String  mft = "Canboose Inc.";
-    String  mft_model = "Canboose 16 I/O node";
-    String  mft_hw_version = "1.0";
-    String  mft_sw_version = "1.0";
-
-    // String to store the xml
-    String cdi_string = "<?xml version=\"1.0\"?>\n"
-                        "<cdi xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
-                        "xsi:noNamespaceSchemaLocation=\"http://openlcb.org/schema/cdi/1/1/cdi.xsd\">\n"
-                        "<identification>\n"
-                          "<manufacturer>" + mft + "</manufacturer>\n"
-                          "<model>" + mft_model + "</model>\n"
-                          "<hardwareVersion>" + mft_hw_version + "</hardwareVersion>\n"
-                          "<softwareVersion>" + mft_sw_version + "</softwareVersion>\n"
-                        "</identification>\n"
-                        "<acdi/>\n"
-                        "<segment space=\"251\">\n"
-                          "<name>User Identification</name>\n"
-                          "<description>Add your own name and description for this node</description>\n"
-                          "<int size=\"1\">\n"
-                            "<name>Version</name>\n"
-                          "</int>\n"
-                          "<string size=\"63\">\n"
-                            "<name>Node Name</name>\n"
-                          "</string>\n"
-                          "<string size=\"64\">\n"
-                            "<name>Node Description</name>\n"
-                          "</string>\n"
-                        "</segment>\n"
-                        "<segment space=\"253\">\n"
-                          "<group replication=\"16\">\n"
-                            "<name>Turnouts</name>\n"
-                            "<description>16 output lines to control Kato turnouts</description>\n"
-                            "<repname>Turnout</repname>\n"
-                            "<eventid>\n"
-                              "<name>Straight EventId</name>\n"
-                              "<description>This event will set turnout to straight position</description>\n"
-                            "</eventid>\n"
-                            "<eventid>\n"
-                              "<name>Diverging EventId</name>\n"
-                              "<description>This event will set turnout to diverging position</description>\n"
-                            "</eventid>\n"
-                          "</group>\n"
-                        "</segment>\n"
-                        "</cdi>";
 };
 
 #endif
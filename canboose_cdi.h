@@ -0,0 +1,118 @@
+#ifndef __CANBOOSE_CDI_H__
+#define __CANBOOSE_CDI_H__
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Configuration Description Information (space 0xFF).
+ *
+ *  The xml is composed at compile time from the manufacturer fields and the turnout group, so it
+ *  is a constant byte array in flash with a known size. Nothing is built in RAM at run time and a
+ *  read is a straight memcpy.
+ *
+ *  Include it only from canboose_applicationlayer.cpp: every translation unit including it gets
+ *  its own copy of cdi_xml.
+ */
+
+#include "canboose_applicationlayer.h"
+
+/* -------------------------------------------------------------
+ *  A fixed size, null terminated text that can be concatenated
+ *  at compile time
+ */
+template <size_t N>
+struct ConstText {
+  char chars[N];
+};
+
+template <size_t N>
+constexpr ConstText<N> text(const char (&s)[N]) {
+  ConstText<N> result {};
+  for (size_t i = 0; i < N; i++) {
+    result.chars[i] = s[i];
+  }
+  return result;
+}
+
+template <size_t A, size_t B>
+constexpr ConstText<A + B - 1> operator+(const ConstText<A> &a, const ConstText<B> &b) {
+  ConstText<A + B - 1> result {};
+  for (size_t i = 0; i < A - 1; i++) {
+    result.chars[i] = a.chars[i];
+  }
+  for (size_t i = 0; i < B; i++) {
+    result.chars[A - 1 + i] = b.chars[i];
+  }
+  return result;
+}
+
+constexpr size_t decimalDigits(unsigned value) {
+  return value < 10 ? 1 : 1 + decimalDigits(value / 10);
+}
+
+template <unsigned VALUE>
+constexpr ConstText<decimalDigits(VALUE) + 1> number() {
+  ConstText<decimalDigits(VALUE) + 1> result {};
+  unsigned v = VALUE;
+  for (size_t i = decimalDigits(VALUE); i > 0; i--) {
+    result.chars[i - 1] = '0' + v % 10;
+    v /= 10;
+  }
+  return result;
+}
+
+/* -------------------------------------------------------------
+ *  The xml
+ */
+constexpr auto cdi_identification =
+  text("<identification>\n"
+         "<manufacturer>" MANUFACTURER "</manufacturer>\n"
+         "<model>" MANUFACTURER_MODEL "</model>\n"
+         "<hardwareVersion>" MANUFACTURER_HW_VERSION "</hardwareVersion>\n"
+         "<softwareVersion>" MANUFACTURER_SW_VERSION "</softwareVersion>\n"
+       "</identification>\n"
+       "<acdi/>\n");
+
+constexpr auto cdi_user_segment =
+  text("<segment space=\"251\">\n"
+         "<name>User Identification</name>\n"
+         "<description>Add your own name and description for this node</description>\n"
+         "<int size=\"1\">\n"
+           "<name>Version</name>\n"
+         "</int>\n"
+         "<string size=\"63\">\n"
+           "<name>Node Name</name>\n"
+         "</string>\n"
+         "<string size=\"64\">\n"
+           "<name>Node Description</name>\n"
+         "</string>\n"
+       "</segment>\n");
+
+constexpr auto cdi_turnout_segment =
+  text("<segment space=\"253\">\n"
+         "<group replication=\"") + number<NUMBER_OF_TURNOUTS>() + text("\">\n"
+           "<name>Turnouts</name>\n"
+           "<description>") + number<NUMBER_OF_TURNOUTS>() + text(" output lines to control Kato turnouts</description>\n"
+           "<repname>Turnout</repname>\n"
+           "<eventid>\n"
+             "<name>Straight EventId</name>\n"
+             "<description>This event will set turnout to straight position</description>\n"
+           "</eventid>\n"
+           "<eventid>\n"
+             "<name>Diverging EventId</name>\n"
+             "<description>This event will set turnout to diverging position</description>\n"
+           "</eventid>\n"
+         "</group>\n"
+       "</segment>\n");
+
+constexpr auto cdi_xml =
+  text("<?xml version=\"1.0\"?>\n"
+       "<cdi xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+       "xsi:noNamespaceSchemaLocation=\"http://openlcb.org/schema/cdi/1/1/cdi.xsd\">\n") +
+  cdi_identification +
+  cdi_user_segment +
+  cdi_turnout_segment +
+  text("</cdi>");
+
+// Size of space 0xFF, terminating null included
+constexpr uint16_t CDI_SIZE = sizeof(cdi_xml.chars);
+
+#endif
@@ -0,0 +1,100 @@
+#include "canboose_datagrampool.h"
+
+DatagramPoolClass::DatagramPoolClass() {
+  for (int i = 0; i < DATAGRAM_HASH_SIZE; i++) {
+    buckets[i] = -1;
+  }
+  for (int i = 0; i < DATAGRAM_POOL_SIZE; i++) {
+    freeSlots[i] = DATAGRAM_POOL_SIZE - 1 - i;
+    slots[i].inUse = false;
+    slots[i].fragments.queued = 0;
+    slots[i].fragments.sent = 0;
+  }
+  freeCount = DATAGRAM_POOL_SIZE;
+}
+
+uint8_t DatagramPoolClass::hashAlias(uint16_t alias) {
+  // Fibonacci hashing. Aliases are random but the top bits mix better
+  return ((alias * 2654435761u) >> 24) & (DATAGRAM_HASH_SIZE - 1);
+}
+
+int8_t DatagramPoolClass::findBucket(uint16_t alias) {
+  // Linear probing until the alias or an empty bucket
+  uint8_t b = hashAlias(alias);
+  for (int i = 0; i < DATAGRAM_HASH_SIZE; i++) {
+    int8_t slot = buckets[b];
+    if (slot < 0) return -1;
+    if (slots[slot].alias == alias) return b;
+    b = (b + 1) & (DATAGRAM_HASH_SIZE - 1);
+  }
+
+  return -1;
+}
+
+datagramSlot* DatagramPoolClass::insertSlot(uint16_t alias) {
+  // A little paranoic but maybe we are trying to insert a new slot but we have one already
+  // It will be overwritten because it is garbage
+  datagramSlot *slot = findSlot(alias);
+  if (slot != NULL) return slot;
+
+  // Pool exhausted? Free slots whose data is still being sent do not count
+  int8_t pick = freeCount - 1;
+  while (pick >= 0 && slots[freeSlots[pick]].fragments.pending() > 0) pick--;
+  if (pick < 0) return NULL;
+
+  uint8_t index = freeSlots[pick];
+  freeSlots[pick] = freeSlots[--freeCount];
+  uint8_t b = hashAlias(alias);
+  while (buckets[b] >= 0) {
+    b = (b + 1) & (DATAGRAM_HASH_SIZE - 1);
+  }
+  buckets[b] = index;
+
+  slot = &slots[index];
+  slot->alias = alias;
+  slot->len = 0;
+  slot->inUse = true;
+  slot->retries = 0;
+  slot->backingOff = false;
+  return slot;
+}
+
+datagramSlot* DatagramPoolClass::findSlot(uint16_t alias) {
+  int8_t b = findBucket(alias);
+  if (b < 0) return NULL;
+  return &slots[buckets[b]];
+}
+
+void DatagramPoolClass::deleteSlot(uint16_t alias) {
+  int8_t b = findBucket(alias);
+  if (b < 0) return;
+
+  // Free the slot
+  slots[buckets[b]].inUse = false;
+  freeSlots[freeCount++] = buckets[b];
+  buckets[b] = -1;
+
+  // Backward shift deletion. Move back every following entry that would not
+  // be found anymore through the hole we have just made
+  uint8_t hole = b;
+  uint8_t next = (hole + 1) & (DATAGRAM_HASH_SIZE - 1);
+  while (buckets[next] >= 0) {
+    uint8_t home = hashAlias(slots[buckets[next]].alias);
+    // Distance from home to next is bigger than distance from home to hole?
+    if (((next - home) & (DATAGRAM_HASH_SIZE - 1)) >= ((next - hole) & (DATAGRAM_HASH_SIZE - 1))) {
+      buckets[hole] = buckets[next];
+      buckets[next] = -1;
+      hole = next;
+    }
+    next = (next + 1) & (DATAGRAM_HASH_SIZE - 1);
+  }
+}
+
+datagramSlot* DatagramPoolClass::slotAt(uint8_t index) {
+  if (index >= DATAGRAM_POOL_SIZE || !slots[index].inUse) return NULL;
+  return &slots[index];
+}
+
+uint8_t DatagramPoolClass::used() {
+  return DATAGRAM_POOL_SIZE - freeCount;
+}
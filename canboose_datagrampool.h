@@ -0,0 +1,59 @@
+/*
+ * A fixed pool of slots to store datagrams and to reconstruct the original data.
+ * Also used to store sent datagrams before the OK or Rejected messages.
+ *
+ * Slots are found through a small open addressing hash table keyed by the 12 bit alias of the
+ * other node, so lookup, insert and delete take constant time and nothing is ever allocated.
+ * There can be only one datagram in flight between two nodes, so the alias is a unique key.
+ *
+ * An outgoing datagram is built in its slot and the TX queue sends the fragments straight from
+ * there. A slot freed while some of them are still in the queue is not given to a new datagram
+ * until they are gone.
+ */
+
+#ifndef __CANBOOSE_DATAGRAMPOOL_H__
+#define __CANBOOSE_DATAGRAMPOOL_H__
+
+#include "canboose_hal.h"
+#include "canboose_queue.h"
+
+#ifndef DATAGRAM_POOL_SIZE
+#define DATAGRAM_POOL_SIZE  8                         // Datagrams in flight. Must be a power of two
+#endif
+#define DATAGRAM_HASH_SIZE  (2 * DATAGRAM_POOL_SIZE)  // Load factor never above 50%
+
+struct datagramSlot {
+  uint16_t  alias;
+  uint8_t   data[72];
+  uint8_t   len;
+  bool      inUse;
+  uint8_t   retries;      // Outgoing: times it has been sent again
+  bool      backingOff;   // Outgoing: temporarily rejected, waiting to resend
+  uint32_t  timestamp;    // halMillis() when it was sent or started to arrive
+  uint32_t  deadline;     // halMillis() of the next timeout
+  bufferReferences fragments;   // Outgoing: fragments queued from data and sent
+};
+
+class DatagramPoolClass {
+  static_assert(DATAGRAM_POOL_SIZE >= 1 && DATAGRAM_POOL_SIZE <= 64 &&
+                (DATAGRAM_POOL_SIZE & (DATAGRAM_POOL_SIZE - 1)) == 0, "Pool size must be a power of two up to 64");
+
+  public:
+    DatagramPoolClass();
+    datagramSlot* insertSlot(uint16_t alias);  // NULL if there is no slot available
+    datagramSlot* findSlot(uint16_t alias);
+    void deleteSlot(uint16_t alias);
+    datagramSlot* slotAt(uint8_t index);       // For sweeps. NULL if slot is free
+    uint8_t used();
+
+  private:
+    uint8_t hashAlias(uint16_t alias);
+    int8_t findBucket(uint16_t alias);
+
+    datagramSlot slots[DATAGRAM_POOL_SIZE];
+    int8_t buckets[DATAGRAM_HASH_SIZE];         // Slot index or -1 if empty
+    uint8_t freeSlots[DATAGRAM_POOL_SIZE];      // Stack of free slot indexes
+    uint8_t freeCount;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include "canboose_eventfilter.h"
+
+EventFilterClass::EventFilterClass() {
+  // An empty filter rejects everything
+  memset(bitmaps, 0, sizeof(bitmaps));
+  active = 0;
+}
+
+uint32_t EventFilterClass::hashEvent(uint64_t eventID) {
+  // Both bit indexes come from one 32 bit hash
+  uint32_t folded = (uint32_t) (eventID ^ (eventID >> 32));
+  return folded * 2654435761u;
+}
+
+void EventFilterClass::beginUpdate() {
+  memset(bitmaps[active ^ 1], 0, EVENT_FILTER_BITS / 8);
+}
+
+void EventFilterClass::add(uint64_t eventID) {
+  uint8_t *bitmap = bitmaps[active ^ 1];
+  uint32_t h = hashEvent(eventID);
+  uint16_t first = (h >> 23) & (EVENT_FILTER_BITS - 1);
+  uint16_t second = (h >> 14) & (EVENT_FILTER_BITS - 1);
+  bitmap[first >> 3] |= 1 << (first & 0x07);
+  bitmap[second >> 3] |= 1 << (second & 0x07);
+}
+
+void EventFilterClass::commitUpdate() {
+  __sync_synchronize();  // New bitmap complete before it is published
+  active ^= 1;
+}
+
+bool EventFilterClass::mayContain(uint64_t eventID) {
+  const uint8_t *bitmap = bitmaps[active];
+  uint32_t h = hashEvent(eventID);
+  uint16_t first = (h >> 23) & (EVENT_FILTER_BITS - 1);
+  uint16_t second = (h >> 14) & (EVENT_FILTER_BITS - 1);
+
+  eventsChecked++;
+  if ((bitmap[first >> 3] & (1 << (first & 0x07))) && (bitmap[second >> 3] & (1 << (second & 0x07)))) {
+    return true;
+  }
+
+  eventsRejected++;
+  return false;
+}
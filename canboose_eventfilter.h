@@ -0,0 +1,42 @@
+/*
+ * Bloom filter over the event IDs this node consumes.
+ *
+ * The frame transfer layer checks every Producer/Consumer Event Report against it as soon as the
+ * header is decoded, inside the CAN interrupt, so events for other nodes never reach the RX queue.
+ * No false negatives; around 1.5% of foreign events get through with 32 events configured and
+ * are discarded later by the event table.
+ *
+ * There are two bitmaps. The application builds the inactive one and then publishes it, so the
+ * interrupt never sees a half built filter.
+ */
+
+#ifndef __CANBOOSE_EVENTFILTER_H__
+#define __CANBOOSE_EVENTFILTER_H__
+
+#include "canboose_hal.h"
+
+#define EVENT_FILTER_BITS   512   // Power of two
+
+class EventFilterClass {
+  public:
+    EventFilterClass();
+
+    // Application side
+    void beginUpdate();
+    void add(uint64_t eventID);
+    void commitUpdate();
+
+    // Interrupt side
+    bool mayContain(uint64_t eventID);
+
+    volatile uint32_t eventsChecked = 0;
+    volatile uint32_t eventsRejected = 0;
+
+  private:
+    uint32_t hashEvent(uint64_t eventID);
+
+    uint8_t bitmaps[2][EVENT_FILTER_BITS / 8];
+    volatile uint8_t active;
+};
+
+#endif
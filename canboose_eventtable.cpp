@@ -0,0 +1,51 @@
+#include "canboose_eventtable.h"
+
+void EventTableClass::clear() {
+  for (int i = 0; i < EVENT_TABLE_BUCKETS; i++) {
+    buckets[i].used = false;
+  }
+  entries = 0;
+}
+
+uint8_t EventTableClass::hashEvent(uint64_t eventID) {
+  // Fold 64 bits into 32 and use Fibonacci hashing. Event IDs of one node
+  // usually differ only in the last bytes, the multiplication spreads them
+  uint32_t folded = (uint32_t) (eventID ^ (eventID >> 32));
+  return ((folded * 2654435761u) >> 24) & (EVENT_TABLE_BUCKETS - 1);
+}
+
+bool EventTableClass::add(uint64_t eventID, uint8_t action) {
+  if (entries == EVENT_TABLE_ENTRIES) return false;
+
+  // The same event can be configured for several turnouts, so every
+  // (event, action) pair gets its own bucket
+  uint8_t b = hashEvent(eventID);
+  while (buckets[b].used) {
+    b = (b + 1) & (EVENT_TABLE_BUCKETS - 1);
+  }
+
+  buckets[b].eventID = eventID;
+  buckets[b].action = action;
+  buckets[b].used = true;
+  entries++;
+  return true;
+}
+
+uint8_t EventTableClass::lookup(uint64_t eventID, uint8_t actions[]) {
+  uint8_t found = 0;
+
+  // Linear probing until an empty bucket. There is always one
+  uint8_t b = hashEvent(eventID);
+  while (buckets[b].used) {
+    if (buckets[b].eventID == eventID) {
+      actions[found++] = buckets[b].action;
+    }
+    b = (b + 1) & (EVENT_TABLE_BUCKETS - 1);
+  }
+
+  return found;
+}
+
+uint8_t EventTableClass::size() {
+  return entries;
+}
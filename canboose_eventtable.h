@@ -0,0 +1,37 @@
+/*
+ * Table of the events this node consumes. 16 turnouts with a Straight and a Diverging event each.
+ *
+ * A compact open addressing hash keyed by the 64 bit event ID, rebuilt from configuration
+ * every time it changes. An event report costs one hash and usually one probe; an event that
+ * is not for us stops at the first empty bucket.
+ */
+
+#ifndef __CANBOOSE_EVENTTABLE_H__
+#define __CANBOOSE_EVENTTABLE_H__
+
+#include "canboose_hal.h"
+
+#define EVENT_TABLE_ENTRIES   32                          // 16 turnouts x 2 positions
+#define EVENT_TABLE_BUCKETS   (2 * EVENT_TABLE_ENTRIES)   // Load factor never above 50%. Power of two
+
+struct eventEntry {
+  uint64_t  eventID;
+  uint8_t   action;   // What to do. For turnouts: turnout * 2 + position
+  bool      used;
+};
+
+class EventTableClass {
+  public:
+    void clear();
+    bool add(uint64_t eventID, uint8_t action);
+    uint8_t lookup(uint64_t eventID, uint8_t actions[]);  // Returns number of actions found
+    uint8_t size();
+
+  private:
+    uint8_t hashEvent(uint64_t eventID);
+
+    eventEntry buckets[EVENT_TABLE_BUCKETS];
+    uint8_t entries = 0;
+};
+
+#endif
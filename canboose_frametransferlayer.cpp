@@ -1,56 +1,87 @@
 #include "canboose_frametransferlayer.h"
+#include "canboose_text.h"
+
+void FrameTransferLayer::init(NetworkTransportListener *listener, CanDriver *driver, const uint8_t *id, uint16_t lastAlias) {
+  memcpy(nodeID, id, 6);
 
-void FrameTransferLayer::init(NetworkTransportListener *listener) {
   // Timer to send messages not running
   queueTimerRunning = false;
+  draining = 0;
+  txInFlight = 0;
+  txCompleteSeen = false;
+  memset(txStats, 0, sizeof(txStats));
+  memset(&counters, 0, sizeof(counters));
+  initializationPending = false;
+  acceptanceFilterPending = false;
   
   // A listener to notify LCC message to the above layer
   netListener = listener;
   
-  // We want to transmit in order so number of TX mailboxes = 1
-  Can0.begin(125000);
-  Can0.attachObj(this);
-  Can0.setNumTxBoxes(1);
-  
-  // Teensy 3.x has 16 mailboxes. We will configure like this:
-  // 0 -    -> Receive standard frames
-  // 1 - 14 -> Receive extended frames
-  // 15     -> Transmit frames
-  CAN_filter_t extFilter;
-  extFilter.id=0;
-  extFilter.ext=1;
-  extFilter.rtr=0;
-  for (int filterNum = 1; filterNum < 15; filterNum++) {
-    Can0.setFilter(extFilter, filterNum);
-  }
-  
   // This instance will process/receive all frames
-  attachGeneralHandler();
+  can = driver;
+  can->begin(125000, this);
   
-  // OK. Let's start generating a Node source alias
-  // Initialize a new ramdom seed. Pin A0 Teensy 3.6 should be empty
-  randomSeed(analogRead(A0));
+  // OK. Let's start generating a Node source alias. The sequence
+  // starts at our Node ID, the last alias we had goes first
+  aliasLFSR = nodeIDFromBytes(nodeID);
+  sourceNodeID = 0;
+  preferredAlias = lastAlias <= 0xFFF ? lastAlias : 0;
+  spareState = SPARE_NONE;
+  checkIDInFlight = false;
+  txWritten = 0;
+  txCompleted = 0;
   checkID();
 }
 
+/* -------------------------------------------------------------
+ *  Alias generator of the CAN Frame Transfer standard: 48 bit
+ *  state, x = (2^9 + 1) * x + c, alias folded from its 12 bit
+ *  groups. Never 0, never the alias we hold
+ */
+uint16_t FrameTransferLayer::nextAlias() {
+  uint16_t alias = preferredAlias;
+  preferredAlias = 0;
+
+  while (alias == 0 || alias == sourceNodeID) {
+    alias = (aliasLFSR ^ (aliasLFSR >> 12) ^ (aliasLFSR >> 24) ^ (aliasLFSR >> 36)) & 0xFFF;
+    aliasLFSR = ((aliasLFSR << 9) + aliasLFSR + ALIAS_LFSR_CONSTANT) & 0xFFFFFFFFFFFF;
+  }
+  return alias;
+}
+
+bool FrameTransferLayer::sendCheckIDs(uint16_t alias) {
+  uint64_t uid = nodeIDFromBytes(nodeID);
+  bool sent = sendFrame(CID_FIRST  | (uint32_t) ((uid & 0xFFF000000000) >> 24), NULL, 0, alias);
+  sent = sendFrame(CID_SECOND | (uint32_t) ((uid & 0x000FFF000000) >> 12), NULL, 0, alias) && sent;
+  sent = sendFrame(CID_THIRD  | (uint32_t) (uid & 0x000000FFF000), NULL, 0, alias) && sent;
+  sent = sendFrame(CID_FOURTH | (uint32_t) (uid & 0x000000000FFF) << 12, NULL, 0, alias) && sent;
+
+  // The wait counts from the moment they are on the bus, not from now: a busy bus can
+  // hold them in the driver a long time. TX complete restarts the timer then
+  checkIDLastFrame = txWritten;
+  checkIDInFlight = sent;
+  return sent;
+}
+
 void FrameTransferLayer::checkID() {
   checkID_timer.end();
   
-  // Generate a tentative sourceNodeID
-  sourceNodeID = random(1, 4095);
+  // Generate a tentative sourceNodeID, not the one that failed. A spare being checked is given up
+  permitted = false;
+  if (spareState == SPARE_CHECKING) spareState = SPARE_NONE;
+  sourceNodeID = nextAlias();
+
+  // Controller only receives frames for the new alias from the next run(). Control frames
+  // always pass, so CheckIDs and Reserve IDs of a node already using it are not missed
+  acceptanceFilterPending = true;
   
   // We are in inhibited state
-  permitted = false;
   collisionNodeID = false;
   
-  // Send 4 CheckID messages
-  sendFrame(CID_FIRST  | (uint32_t) ((UID & 0xFFF000000000) >> 24), NULL, 0);
-  sendFrame(CID_SECOND | (uint32_t) ((UID & 0x000FFF000000) >> 12), NULL, 0);
-  sendFrame(CID_THIRD  | (uint32_t) (UID & 0x000000FFF000), NULL, 0);
-  sendFrame(CID_FOURTH | (uint32_t) (UID & 0x000000000FFF) << 12, NULL, 0);
-  
-  // Wait 250 milliseconds. Standard says a minimum of 200
-  checkID_timer.begin(proxyReserveID, 250000);
+  // Send 4 CheckID messages and wait
+  aliasTimerID = TIMER_RESERVE_ID;
+  sendCheckIDs(sourceNodeID);
+  checkID_timer.begin(this, TIMER_RESERVE_ID, ALIAS_WAIT_MICROS);
 }
 
 void FrameTransferLayer::reserveID() {
@@ -58,17 +89,62 @@ void FrameTransferLayer::reserveID() {
   
   // If there was no collision we have to send a ReserveID and Alias Mad Definition message
   // Then we have a valid sourceID
-  if (!collisionNodeID && sendFrame(RID, NULL, 0) && sendFrame(AMD, UID_array, 6)) {
+  checkIDInFlight = false;
+  if (!collisionNodeID && sendFrame(RID, NULL, 0) && sendFrame(AMD, nodeID, 6)) {
     permitted = true;
-    if (netListener != NULL) netListener->initializationComplete();
+    aliasActivityMillis = halMillis();
+    initializationPending = true;
   }
   else {
+    if (collisionNodeID) counters.aliasCollisions++;
+
     // Wait another 250 milliseconds before starting again
-    checkID_timer.begin(proxyCheckID, 250000);
+    checkID_timer.begin(this, TIMER_CHECK_ID, ALIAS_WAIT_MICROS);
   }
 }
 
+uint16_t FrameTransferLayer::permittedAlias() {
+  return permitted ? sourceNodeID : 0;
+}
+
+/* -------------------------------------------------------------
+ *  Spare alias. Checked like ours while we are permitted, on
+ *  the checkID timer, then kept reserved and defended
+ */
+void FrameTransferLayer::checkSpareAlias() {
+  spareAlias = nextAlias();
+  spareCollision = !sendCheckIDs(spareAlias);
+  spareState = SPARE_CHECKING;
+  aliasTimerID = TIMER_RESERVE_SPARE;
+  checkID_timer.begin(this, TIMER_RESERVE_SPARE, ALIAS_WAIT_MICROS);
+}
+
+void FrameTransferLayer::reserveSpareAlias() {
+  checkID_timer.end();
+  checkIDInFlight = false;
+  if (spareState != SPARE_CHECKING) return;
+
+  if (!spareCollision && sendFrame(RID, NULL, 0, spareAlias)) spareState = SPARE_RESERVED;
+  else checkSpareAlias();
+}
+
+// Our alias collided while permitted. AMR already sent for it
+void FrameTransferLayer::useSpareAlias() {
+  sourceNodeID = spareAlias;
+  spareState = SPARE_NONE;
+  spareAliasesUsed++;
+  acceptanceFilterPending = true;
+  queueFrame(AMD, nodeID, 6);
+
+  // Next spare, later
+  aliasActivityMillis = halMillis();
+}
+
 bool FrameTransferLayer::sendFrame(uint32_t header, uint8_t data[], uint8_t len) {
+  return sendFrame(header, data, len, sourceNodeID);
+}
+
+bool FrameTransferLayer::sendFrame(uint32_t header, uint8_t data[], uint8_t len, uint16_t alias) {
   if (len >= 0 && len <= 8) {
     // In the inhibited state we can send only CID, RID and AMD frames
     if (!permitted) {
@@ -82,101 +158,348 @@ bool FrameTransferLayer::sendFrame(uint32_t header, uint8_t data[], uint8_t len)
       }
     }
     
-    // Just to be sure, 12 lower bits will be zeroed and we will add sourceNodeID
-    CAN_message_t msg = {0, 0, {1, 0, 0, 0}, 0};
-    msg.id = (header & 0x3FFFF000) | sourceNodeID;
-    msg.flags.extended = 1;
+    // Just to be sure, 12 lower bits will be zeroed and we will add the alias
+    canFrame msg = {0, {1, 0, 0}, 0};
+    msg.id = (header & 0x3FFFF000) | alias;
     msg.len = len;
     memcpy(msg.buf, data, len);
     
-    return Can0.write(msg) == 1;
+    if (!can->write(msg)) return false;
+    __sync_fetch_and_add(&txInFlight, 1);
+    __sync_fetch_and_add(&txWritten, 1);
+    counters.txFrames[counterFrameType(msg.id)]++;
+    return true;
   }
   
   return false;
 }
 
-void FrameTransferLayer::queueFrame(uint32_t header, uint8_t data[], uint8_t len) {
-  queueOperation(0, header, data, len);
+// With references data is a shared buffer: the frame only points to it
+bool FrameTransferLayer::queueFrame(uint32_t header, uint8_t data[], uint8_t len, bufferReferences *references) {
+  if (len > 8) return false;
+
+  // Ring full? The frame is lost and counted as an overflow
+  RingQueueClass<queueNode, TX_QUEUE_SIZE> *queue = &txQueues[frameClass(header)];
+  queueNode *slot = queue->pushSlot();
+  if (slot == NULL) return false;
+
+  slot->header = header;
+  slot->len = len;
+  slot->references = references;
+  if (references != NULL) {
+    slot->payload = data;
+    references->queued++;
+  }
+  else {
+    memcpy(slot->data, data, len);
+  }
+  slot->queuedMicros = halMicros();
+  queue->commitPush();
+  TRACE(TRACE_TX_QUEUED, frameClass(header));
+
+#if defined(TX_DRAIN_POLLING)
+  // Drivers without TX complete events: every 2 ms we will fill TX queue
   if (!queueTimerRunning) {
-    queueTimer.begin(proxySendQueue, 2000); // Every 2 ms we will fill TX queue
     queueTimerRunning = true;
+    queueTimer.begin(this, TIMER_SEND_QUEUE, TX_WATCHDOG_MICROS);
+  }
+#else
+  // Send it right now if there is room in CAN TX queue
+  sendQueuedFrames();
+#endif
+  return true;
+}
+
+uint16_t FrameTransferLayer::queueFree(uint8_t txClass) {
+  return txQueues[txClass].capacity() - txQueues[txClass].count();
+}
+
+uint8_t FrameTransferLayer::frameClass(uint32_t header) {
+  // Alias allocation frames
+  if ((header & 0x08000000) == 0) return TX_CLASS_CONTROL;
+
+  // Datagram and stream frames
+  uint8_t frameType = (header >> 24) & 0x07;
+  if (frameType != 1) return TX_CLASS_BULK;
+
+  // Global or addressed message. MTI bit 3 is the address present flag
+  return (header & 0x00008000) ? TX_CLASS_ADDRESSED : TX_CLASS_EVENT;
+}
+
+/* -------------------------------------------------------------
+ *  Strict priority: the first class with frames, unless a lower
+ *  class has been waiting too long. Then the highest of those
+ *  starved classes goes first. -1 if every queue is empty
+ */
+int8_t FrameTransferLayer::nextTxClass(uint32_t now, bool &promoted) {
+  int8_t next = -1;
+  promoted = false;
+  for (uint8_t c = 0; c < TX_CLASSES; c++) {
+    queueNode *front = txQueues[c].readFront();
+    if (front == NULL) continue;
+    if (next < 0) {
+      next = c;
+    }
+    else if (now - front->queuedMicros > TX_STARVATION_MICROS) {
+      promoted = true;
+      return c;
+    }
+  }
+  return next;
+}
+
+void FrameTransferLayer::transmitComplete() {
+  uint32_t start = halMicros();
+  TRACE(TRACE_TX_INTERRUPT, 0);
+
+  // One frame less waiting inside the CAN driver
+  uint8_t inFlight = txInFlight;
+  while (inFlight > 0 && !__sync_bool_compare_and_swap(&txInFlight, inFlight, inFlight - 1)) {
+    inFlight = txInFlight;
+  }
+  txCompleteSeen = true;
+  txCompleted++;
+
+  // CheckIDs on the bus. The alias wait starts now
+  if (checkIDInFlight && (int32_t) (txCompleted - checkIDLastFrame) >= 0) {
+    checkIDInFlight = false;
+    checkID_timer.begin(this, aliasTimerID, ALIAS_WAIT_MICROS);
+  }
+
+  // There is room again in CAN TX queue
+  sendQueuedFrames();
+  countInterrupt(start);
+  TRACE(TRACE_TX_INTERRUPT_END, 0);
+}
+
+void FrameTransferLayer::countInterrupt(uint32_t start) {
+  uint32_t spent = halMicros() - start;
+  counters.isrCount++;
+  counters.isrMicros += spent;
+  if (spent > counters.isrMaxMicros) counters.isrMaxMicros = spent;
+}
+
+void FrameTransferLayer::queueStatistics(uint32_t &rxOverflows, uint16_t &rxHighWater, uint32_t &txOverflows, uint16_t txHighWater[]) {
+  rxOverflows = rxQueue.overflows;
+  rxHighWater = rxQueue.highWater;
+  txOverflows = 0;
+  for (uint8_t c = 0; c < TX_CLASSES; c++) {
+    txOverflows += txQueues[c].overflows;
+    txHighWater[c] = txQueues[c].highWater;
   }
 }
 
+/* -------------------------------------------------------------
+ *  Called from queueFrame, the TX complete interrupt and the
+ *  watchdog timer. Only one of them can be the consumer of the
+ *  queues at a time: the others just return, the one sending
+ *  will find their frames.
+ */
 void FrameTransferLayer::sendQueuedFrames() {
-  bool result;
-  
+  bool retry;
+
   do {
-    result = false;
-    queueNode *queuedFrame = queueOperation(1, 0, NULL, 0);
-    if (queuedFrame != NULL) {  // Message in queue, we will try to send to CAN TX queue
-      result = sendFrame(queuedFrame->header, queuedFrame->data, queuedFrame->len);
-      if (result) queueOperation(2, 0, NULL, 0);  // Queued in CAN TX queue, delete from our queue
+    if (__sync_lock_test_and_set(&draining, 1)) return;
+
+    bool framesLeft = false;
+    bool promoted;
+    int8_t c;
+    uint32_t now = halMicros();
+    while ((c = nextTxClass(now, promoted)) >= 0) {  // Message in queue, we will try to send to CAN TX queue
+#if !defined(TX_DRAIN_POLLING)
+      // Bulk waits here, not in the driver, so later frames of higher classes can pass
+      if (c == TX_CLASS_BULK && txInFlight >= TX_BULK_IN_FLIGHT) {
+        framesLeft = true;
+        break;
+      }
+#endif
+      queueNode *queuedFrame = txQueues[c].readFront();
+      uint8_t *data = queuedFrame->references != NULL ? (uint8_t*) queuedFrame->payload : queuedFrame->data;
+      if (!sendFrame(queuedFrame->header, data, queuedFrame->len)) {
+        framesLeft = true;
+        break;
+      }
+      if (queuedFrame->references != NULL) queuedFrame->references->sent++;
+
+      uint32_t waited = now - queuedFrame->queuedMicros;
+      txClassStats *stats = &txStats[c];
+      stats->frames++;
+      stats->totalMicros += waited;
+      if (waited > stats->maxMicros) stats->maxMicros = waited;
+      if (promoted) stats->promoted++;
+      TRACE(TRACE_TX_SENT, c);
+      txQueues[c].deleteFront();  // Queued in CAN TX queue, delete from our queue
     }
-    else {
-      queueTimer.end();  // No more messages in our queue to send. Stop timer
+
+    // Frames left: TX complete will send them. Watchdog just in case one is lost
+    // or we are not permitted yet. No frames left: no watchdog
+    if (framesLeft && !queueTimerRunning) {
+      queueTimerRunning = true;
+      queueTimer.begin(this, TIMER_SEND_QUEUE, TX_WATCHDOG_MICROS);
+    }
+    else if (!framesLeft && queueTimerRunning) {
+      queueTimer.end();
       queueTimerRunning = false;
     }
-  } while (result);
+
+    __sync_lock_release(&draining);
+
+    // A frame may have been queued while we were holding the queues
+    retry = false;
+    for (uint8_t i = 0; i < TX_CLASSES && !framesLeft; i++) {
+      if (txQueues[i].count() > 0) retry = true;
+    }
+  } while (retry);
+}
+
+void FrameTransferLayer::timerExpired(uint8_t timerID) {
+  switch (timerID) {
+    case TIMER_CHECK_ID:
+      checkID();
+      break;
+
+    case TIMER_RESERVE_ID:
+      reserveID();
+      break;
+
+    case TIMER_RESERVE_SPARE:
+      reserveSpareAlias();
+      break;
+
+    case TIMER_SEND_QUEUE:
+      // No TX complete for a whole period: the driver does not report them or one
+      // was lost. Do not keep bulk frames waiting for it
+      if (!txCompleteSeen) txInFlight = 0;
+      txCompleteSeen = false;
+      sendQueuedFrames();
+      break;
+  }
+}
+
+void FrameTransferLayer::printFrame(canFrame &frame) {
+  char buffer[96];
+  TextWriterClass result(buffer, sizeof(buffer));
+  result.append("CANBus message -> ID: ");
+  result.appendNumber(frame.id, 16);
+  result.append(" X:");
+  result.appendNumber(frame.flags.extended);
+  result.append(" R:");
+  result.appendNumber(frame.flags.remote);
+  result.append(" OvR:");
+  result.appendNumber(frame.flags.overrun);
+  result.append(" Len:");
+  result.appendNumber(frame.len);
+  result.append(" Data: ");
+  for (int c = 0; c < frame.len; c++) {
+    result.appendNumber(frame.buf[c], 16);
+    result.append(' ');
+  }
+  Serial.println(result.c_str());
 }
 
 /* -------------------------------------------------------------
- *  OpType can be:
- *
- *  0 - Push operation
- *  1 - Read front element
- *  2 - Delete front element
- *
- *  Because we will delete it from queue only and only if we have send it
+ *  CAN interrupt. Frames are only copied to the RX queue and
+ *  processed later from loop()
  */
-queueNode* FrameTransferLayer::queueOperation(uint8_t opType, uint32_t header, uint8_t data[], uint8_t len) {
-  // Only when we "pop" from the queue
-  queueNode* temp = NULL;
-  
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    // PUSH operation
-    if (opType == 0) {
-      temp = queue.push();
-      
-      temp->header = header;
-      memcpy(temp->data, data, len);
-      temp->len = len;
-    }
-    // READ operation first element in queue
-    else if (opType == 1) {
-      temp = queue.readFront();
+bool FrameTransferLayer::frameHandler(canFrame &frame) {
+  uint32_t start = halMicros();
+  TRACE(TRACE_RX_INTERRUPT, 0);
+  counters.rxFrames[counterFrameType(frame.id)]++;
+
+  // While we are checking an alias a collision must be flagged before the reserveID timer
+  // expires, whatever loop() is doing. It is just a compare
+  if (!permitted && (frame.id & 0xFFF) == sourceNodeID) {
+    uint16_t cid_header = frame.id >> 24;
+    if (cid_header < 0x14 || cid_header > 0x17) collisionNodeID = true;
+  }
+
+  // Event reports for other nodes are dropped right here. Not if the source is our alias,
+  // it is a collision and has to be processed
+  if ((frame.id & 0x1FFFF000) == EVENT_REPORT && frame.len == 8 && (frame.id & 0xFFF) != sourceNodeID) {
+    uint64_t eventID = 0;
+    for (int i = 0; i < 8; i++) {
+      eventID = (eventID << 8) | frame.buf[i];
     }
-    // DELETE front element
-    else if (opType == 2) {
-      queue.deleteFront();
+    if (!eventFilter.mayContain(eventID)) {
+      counters.rxFiltered++;
+      countInterrupt(start);
+      TRACE(TRACE_RX_INTERRUPT_END, 0);
+      return true;
     }
   }
-  
-  return temp;
-}
-
-void FrameTransferLayer::printFrame(CAN_message_t &frame, int mailbox) {
-  String result = "CANBus message -> ID: ";
-  result.concat(String(frame.id, HEX));
-  result.concat(" X:");
-  result.concat(frame.flags.extended);
-  result.concat(" R:");
-  result.concat(frame.flags.remote);
-  result.concat(" OvR:");
-  result.concat(frame.flags.overrun);
-  result.concat(" Len:");
-  result.concat(frame.len);
-  result.concat(" Data: ");
-  for (int c = 0; c < frame.len; c++) {
-    result.concat(String(frame.buf[c], HEX));
-    result.concat(" ");
+
+  // RX queue full? The frame is lost and counted as an overflow
+  canFrame *slot = rxQueue.pushSlot();
+  if (slot != NULL) {
+    *slot = frame;
+    rxQueue.commitPush();
+    TRACE(TRACE_RX_QUEUED, rxTraceQueued++);
   }
-  Serial.println(result);
+
+  countInterrupt(start);
+  TRACE(TRACE_RX_INTERRUPT_END, 0);
+  return true;
 }
 
-bool FrameTransferLayer::frameHandler(CAN_message_t &frame, int mailbox, uint8_t controller) {
-  // First we have to check source NodeID alias in case of collisions
+/* -------------------------------------------------------------
+ *  Cooperative executor. Called from loop()
+ */
+void FrameTransferLayer::run() {
+  // Alias changed, maybe in the timer interrupt. Reprogramming the controller freezes
+  // it, so that is done from here
+  if (acceptanceFilterPending) {
+    acceptanceFilterPending = false;
+    acceptanceFilter.plan(sourceNodeID);
+    can->setAcceptanceFilter(acceptanceFilter.rules, acceptanceFilter.count);
+  }
+
+  // No more than RX_FRAMES_PER_RUN frames each time, so the rest of loop() is not starved
+  for (uint8_t i = 0; i < RX_FRAMES_PER_RUN; i++) {
+    canFrame *frame = rxQueue.readFront();
+    if (frame == NULL) break;
+    TRACE(TRACE_RX_PROCESS, rxTraceProcessed);
+    processFrame(*frame);
+    rxQueue.deleteFront();
+    TRACE(TRACE_RX_PROCESSED, rxTraceProcessed++);
+  }
+
+  // Alias was reserved in the timer interrupt. Tell the above layer from here
+  if (initializationPending) {
+    initializationPending = false;
+    if (netListener != NULL) netListener->initializationComplete();
+  }
+
+  // Time to have a spare alias, once nobody is checking aliases
+  if (permitted && spareState == SPARE_NONE && halMillis() - aliasActivityMillis > SPARE_ALIAS_DELAY_MILLIS) {
+    checkSpareAlias();
+  }
+}
+
+void FrameTransferLayer::trackAlias(canFrame &frame) {
+  uint16_t alias = frame.id & 0xFFF;
+  if ((frame.id & 0xFFFFF000) == AMD) {
+    if (frame.len == 6) aliasCache.add(alias, nodeIDFromBytes(frame.buf));
+  }
+  else {
+    // Anything in flight with that node is lost
+    aliasCache.remove(alias);
+    if (netListener != NULL) netListener->aliasReleased(alias);
+  }
+}
+
+void FrameTransferLayer::processFrame(canFrame &frame) {
+  // Somebody else with our spare alias. CheckIDs are answered like for ours,
+  // anything else means the spare is theirs
   uint16_t incoming_sourceNodeID = frame.id & 0xFFF;
+  if ((frame.id >> 24) == 0x17) aliasActivityMillis = halMillis();
+  if (spareState != SPARE_NONE && incoming_sourceNodeID == spareAlias) {
+    uint16_t cid_header = frame.id >> 24;
+    if (cid_header >= 0x14 && cid_header <= 0x17) sendFrame(RID, NULL, 0, spareAlias);
+    else if (spareState == SPARE_CHECKING) spareCollision = true;
+    else spareState = SPARE_NONE;
+  }
+
+  // First we have to check source NodeID alias in case of collisions
   if (incoming_sourceNodeID == sourceNodeID) {
     uint16_t cid_header = frame.id >> 24;
     bool isCheckID_frame = cid_header == 0x17 || cid_header == 0x16 ||
@@ -188,29 +511,35 @@ bool FrameTransferLayer::frameHandler(CAN_message_t &frame, int mailbox, uint8_t
       sendFrame(RID, NULL, 0);
     }
     // We have received a frame with the same source NodeID alias we have
-    // We have to transition to inhibited state
+    // We have to transition to inhibited state, or to the spare alias if we have one
     else if (permitted) {
-      sendFrame(AMR, UID_array, 6);
-      checkID();
+      counters.aliasCollisions++;
+      sendFrame(AMR, nodeID, 6);
+      if (spareState == SPARE_RESERVED) useSpareAlias();
+      else checkID();
     }
     // Collision during checkID phase. Flag it. The timer will restart the process
     else {
       collisionNodeID = true;
     }
   }
+  // Other nodes defining or releasing their aliases. Followed in any state
+  else if ((frame.id & 0xFFFFF000) == AMD || (frame.id & 0xFFFFF000) == AMR) {
+    trackAlias(frame);
+  }
   // No collisions, we will process rest of incoming messages if we are in permitted state
   else if (permitted) {
     // Only in permitted state we will process Alias Map Enquiry frames
     if ((frame.id & 0xFFFFF000) == AME) {
       if (frame.len == 0) {
-          queueFrame(AMD, UID_array, 6);
+          queueFrame(AMD, nodeID, 6);
       }
       else {
         if (frame.len == 6 &&
-            frame.buf[0] == UID_array[0] && frame.buf[1] == UID_array[1] &&
-            frame.buf[2] == UID_array[2] && frame.buf[3] == UID_array[3] &&
-            frame.buf[4] == UID_array[4] && frame.buf[5] == UID_array[5])
-          queueFrame(AMD, UID_array, 6);
+            frame.buf[0] == nodeID[0] && frame.buf[1] == nodeID[1] &&
+            frame.buf[2] == nodeID[2] && frame.buf[3] == nodeID[3] &&
+            frame.buf[4] == nodeID[4] && frame.buf[5] == nodeID[5])
+          queueFrame(AMD, nodeID, 6);
       }  
     }
     // Message for the above layer (Network layer)
@@ -226,6 +555,4 @@ bool FrameTransferLayer::frameHandler(CAN_message_t &frame, int mailbox, uint8_t
       }
     }
   }
-    
-  return true;
 }
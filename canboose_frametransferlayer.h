@@ -1,24 +1,18 @@
 #ifndef __CANBOOSE_FRAME_TRANSFER_LAYER_H__
 #define __CANBOOSE_FRAME_TRANSFER_LAYER_H__
 
-#include <FlexCAN.h>
-#include <util/atomic.h>
-#include "Arduino.h"
+#include "canboose_hal.h"
 #include "canboose_queue.h"
+#include "canboose_eventfilter.h"
+#include "canboose_aliascache.h"
+#include "canboose_acceptancefilter.h"
+#include "canboose_statistics.h"
+#include "canboose_trace.h"
 
-// This is the Unique Identifier given to us by openLCB organization
-#define UID 0x050101012D00
+// This is the Unique Identifier given to us by openLCB organization. Defined by the sketch,
+// it is the Node ID layers use unless init() is given another one
 extern uint8_t UID_array[6];
 
-/* -----------------------------------------------------------------------------------------------------------
- * Dummy functions, will be implemented later, because we can not call a instance method
- * from a IntervalTimer
- * They are just proxies to call the right method in the singleton instance
- */
-extern void proxyCheckID();
-extern void proxyReserveID();
-extern void proxySendQueue();
-
 /* -----------------------------------------------------------------------------------------------------------
  *  Frame Transfer Layer. Low level communications at CAN bus
  *  level
@@ -34,36 +28,137 @@ extern void proxySendQueue();
 #define AME           0x10702000  // Alias Map Enquiry
 #define AMR           0x10703000  // Alias Map Reset
 #define LCC_MSG       0X18000000  // Mask to detect LCC Messages
+#define EVENT_REPORT  0x195B4000  // Producer/Consumer Event Report. Checked against eventFilter
+
+// Aliases come from the pseudo random sequence of the CAN Frame Transfer standard, seeded with
+// the Node ID: boards that power up together get different sequences whatever their hardware.
+// The first try is the alias the node had last time. Once permitted, the node reserves a spare
+// alias (CheckID and Reserve ID, no Alias Map Definition) so that losing its alias to a
+// collision only costs an AMR and an AMD
+#define ALIAS_WAIT_MICROS         250000  // From the last CheckID on the bus. Standard says a minimum of 200 ms
+#define ALIAS_LFSR_CONSTANT       0x1B0CA37A4BA9
+#define SPARE_ALIAS_DELAY_MILLIS  2000    // Without CheckIDs on the bus, so the spare does not add to a startup storm
+
+#define SPARE_NONE      0
+#define SPARE_CHECKING  1     // CheckIDs sent, waiting for objections
+#define SPARE_RESERVED  2
+
+// TX queue is sent when the CAN driver reports TX complete. The timer is only a watchdog.
+// Define TX_DRAIN_POLLING for drivers without TX complete events: the timer does all the work
+#ifndef TX_WATCHDOG_MICROS
+#define TX_WATCHDOG_MICROS  2000
+#endif
+
+// Outgoing frames wait in one queue per priority class. The highest class with frames goes
+// first, but a frame that has waited more than TX_STARVATION_MICROS goes before higher classes.
+// Bulk frames are only handed to the CAN driver while fewer than TX_BULK_IN_FLIGHT frames wait
+// there, so a new event report never sits behind a whole datagram inside the driver
+#define TX_CLASS_CONTROL    0     // CAN control frames: AMD, AMR
+#define TX_CLASS_EVENT      1     // Event reports and other global messages
+#define TX_CLASS_ADDRESSED  2     // Addressed messages: SNIP, datagram acknowledges, stream control
+#define TX_CLASS_BULK       3     // Datagram and stream data frames
+#define TX_CLASSES          4
+#ifndef TX_STARVATION_MICROS
+#define TX_STARVATION_MICROS  20000
+#endif
+#ifndef TX_BULK_IN_FLIGHT
+#define TX_BULK_IN_FLIGHT     2
+#endif
+
+struct txClassStats {
+  uint32_t frames;        // Handed to the CAN driver
+  uint32_t promoted;      // Sent before a higher class by the starvation rule
+  uint32_t maxMicros;     // Worst wait from queueFrame() to the CAN driver
+  uint64_t totalMicros;   // Sum of waits. Mean is totalMicros / frames
+};
+
+// Received frames are queued by the CAN interrupt and processed from loop()
+#ifndef RX_QUEUE_SIZE
+#define RX_QUEUE_SIZE       32    // Frames. Must be a power of two
+#endif
+#ifndef RX_FRAMES_PER_RUN
+#define RX_FRAMES_PER_RUN   8     // Frames processed in each run()
+#endif
+
+// Timers
+#define TIMER_CHECK_ID      0
+#define TIMER_RESERVE_ID    1
+#define TIMER_SEND_QUEUE    2
+#define TIMER_RESERVE_SPARE 3   // On the checkID timer, idle while permitted
 
 class NetworkTransportListener {
 public:
-  virtual void initializationComplete();
-  virtual void processLCCMessage(uint8_t frameType, uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len);
+  virtual void initializationComplete() = 0;
+  virtual void processLCCMessage(uint8_t frameType, uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len) = 0;
+  virtual void aliasReleased(uint16_t alias) = 0;   // Another node has given its alias up (AMR)
 };
 
-class FrameTransferLayer : public CANListener {
+class FrameTransferLayer : public CanDriverListener, public HalTimerListener {
   public:
-    void init(NetworkTransportListener *listener);
-    void queueFrame(uint32_t header, uint8_t data[], uint8_t len);
+    void init(NetworkTransportListener *listener, CanDriver *driver, const uint8_t *id = UID_array, uint16_t lastAlias = 0);
+    bool queueFrame(uint32_t header, uint8_t data[], uint8_t len, bufferReferences *references = NULL);
+    uint16_t queueFree(uint8_t txClass);
     void sendQueuedFrames();
-    bool frameHandler(CAN_message_t &frame, int mailbox, uint8_t controller);
+    bool frameHandler(canFrame &frame);
+    void transmitComplete();
+    void run();
+    void timerExpired(uint8_t timerID);
     void checkID();
     void reserveID();
+    uint16_t permittedAlias();    // 0 while inhibited
+    void queueStatistics(uint32_t &rxOverflows, uint16_t &rxHighWater, uint32_t &txOverflows, uint16_t txHighWater[]);
     
     uint16_t sourceNodeID;
+    uint8_t nodeID[6];
+    EventFilterClass eventFilter;
+    AliasCacheClass aliasCache;
+    AcceptanceFilterClass acceptanceFilter;
+    txClassStats txStats[TX_CLASSES];
+    frameCounters counters;
+    uint32_t spareAliasesUsed = 0;
     
   private:
     bool sendFrame(uint32_t header, uint8_t data[], uint8_t len);
-    queueNode* queueOperation(uint8_t opType, uint32_t header, uint8_t data[], uint8_t len);
-    void printFrame(CAN_message_t &frame, int mailbox);
+    bool sendFrame(uint32_t header, uint8_t data[], uint8_t len, uint16_t alias);
+    bool sendCheckIDs(uint16_t alias);
+    uint16_t nextAlias();
+    void checkSpareAlias();
+    void reserveSpareAlias();
+    void useSpareAlias();
+    void processFrame(canFrame &frame);
+    void trackAlias(canFrame &frame);
+    uint8_t frameClass(uint32_t header);
+    int8_t nextTxClass(uint32_t now, bool &promoted);
+    void printFrame(canFrame &frame);
+    void countInterrupt(uint32_t start);
     
-    bool permitted;
-    bool collisionNodeID;
-    IntervalTimer checkID_timer;
-    IntervalTimer queueTimer;
-    bool queueTimerRunning;
+    volatile bool permitted;
+    volatile bool collisionNodeID;
+    volatile bool initializationPending;
+    volatile bool acceptanceFilterPending;  // Alias changed, controller not reprogrammed yet
+    volatile bool checkIDInFlight;      // Restart the alias timer when the CheckIDs have left
+    volatile uint32_t txWritten;        // Frames written to the CAN driver and reported sent, since init.
+    volatile uint32_t txCompleted;      // Unlike txInFlight, never reset by the watchdog
+    uint32_t checkIDLastFrame;          // txWritten after the last CheckID
+    uint8_t aliasTimerID;
+    uint64_t aliasLFSR;
+    uint16_t preferredAlias;            // Next alias to try before the sequence. 0 if none
+    uint16_t spareAlias;
+    volatile uint8_t spareState;
+    volatile bool spareCollision;
+    uint32_t aliasActivityMillis;       // Last CheckID seen or alias change
+    CanDriver *can;
+    HalTimer checkID_timer;
+    HalTimer queueTimer;
+    volatile bool queueTimerRunning;
+    volatile uint8_t draining;
+    volatile uint8_t txInFlight;        // Frames written to the CAN driver and not reported sent
+    volatile bool txCompleteSeen;       // Since the last watchdog
+    uint16_t rxTraceQueued = 0;         // RX sequence numbers for trace records
+    uint16_t rxTraceProcessed = 0;
     NetworkTransportListener *netListener;
-    QueueClass queue;
+    RingQueueClass<queueNode, TX_QUEUE_SIZE> txQueues[TX_CLASSES];
+    RingQueueClass<canFrame, RX_QUEUE_SIZE> rxQueue;
 };
 
 #endif
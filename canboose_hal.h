@@ -0,0 +1,122 @@
+#ifndef __CANBOOSE_HAL_H__
+#define __CANBOOSE_HAL_H__
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Hardware Abstraction Layer. Everything the protocol stack needs from the board:
+ *
+ *  - A CAN driver to send and receive extended frames
+ *  - Interval timers
+ *  - A clock (microseconds and milliseconds since start)
+ *  - Random numbers
+ *  - Non volatile storage (EEPROM)
+ *  - Digital output lines (turnouts)
+ *
+ *  There are two backends, selected at compile time:
+ *  - Teensy 3.x (FlexCAN, IntervalTimer, EEPROM). See canboose_hal_teensy.h
+ *  - Linux host (in-process virtual CAN bus or SocketCAN, real or simulated clock, file backed
+ *    EEPROM). See canboose_hal_host.h. So the whole stack can be compiled and profiled on a workstation
+ */
+
+#if defined(ARDUINO)
+  #include "Arduino.h"
+  #include <util/atomic.h>
+#else
+  #include <stdint.h>
+  #include <stddef.h>
+  #include <stdlib.h>
+  #include <string.h>
+#endif
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  CAN driver. Only extended frames are used by LCC
+ */
+struct canFrame {
+  uint32_t id;
+  struct {
+    uint8_t extended:1;
+    uint8_t remote:1;
+    uint8_t overrun:1;
+  } flags;
+  uint8_t len;
+  uint8_t buf[8];
+};
+
+class CanDriverListener {
+  public:
+    // Called for every received frame. On Teensy this runs in interrupt context
+    virtual bool frameHandler(canFrame &frame) = 0;
+    // Called when a frame has left the TX buffer, so there is room for another one
+    virtual void transmitComplete() {}
+};
+
+// Acceptance filter rule. A frame is received when (id & mask) == (rule.id & mask)
+// for at least one rule. Identifiers and masks are 29 bits, extended frames only
+struct acceptanceRule {
+  uint32_t id;
+  uint32_t mask;
+};
+
+class CanDriver {
+  public:
+    virtual bool begin(uint32_t baudRate, CanDriverListener *listener) = 0;
+    // Returns false if the transmit mailbox is full
+    virtual bool write(canFrame &frame) = 0;
+    // Receive only frames matching the rules. Returns false if the driver can not
+    // filter that many rules: then it keeps receiving everything
+    virtual bool setAcceptanceFilter(const acceptanceRule rules[], uint8_t count) { return false; }
+};
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Interval timers. A timer calls its listener every period until end() is called.
+ *  The timerID lets one listener own several timers.
+ *  HalTimer class itself is defined by each backend
+ */
+class HalTimerListener {
+  public:
+    virtual void timerExpired(uint8_t timerID) = 0;
+};
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Non volatile storage. Byte addressed like Arduino EEPROM library
+ */
+class NonVolatileStorage {
+  public:
+    virtual uint8_t read(uint16_t address) = 0;
+    virtual void write(uint16_t address, uint8_t value) = 0;
+    virtual uint16_t size() = 0;
+};
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Clock and random numbers
+ */
+uint32_t halMicros();
+uint32_t halMillis();
+void     halRandomSeed();
+uint32_t halRandom(uint32_t min, uint32_t max);  // min <= result < max
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Trace clock. CPU cycles on the Teensy, nanoseconds on the host. Wraps around, only
+ *  differences make sense
+ */
+void     halTraceClockBegin();
+uint32_t halTraceClock();
+uint32_t halTraceTicksPerMicro();
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Memory. Bytes allocated from the heap, for the statistics space
+ */
+uint32_t halHeapUsed();
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Digital output lines, numbered from 0. Each backend maps them to its own pins
+ */
+void halOutputBegin(uint8_t lines);
+void halOutputWrite(uint8_t line, bool state);
+
+#if defined(ARDUINO)
+  #include "canboose_hal_teensy.h"
+#else
+  #include "canboose_hal_host.h"
+#endif
+
+#endif
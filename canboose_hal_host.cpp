@@ -0,0 +1,503 @@
+/* -----------------------------------------------------------------
+ * Linux host backend of the Hardware Abstraction Layer
+ */
+
+#if !defined(ARDUINO)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include "canboose_hal.h"
+
+HostSerial Serial;
+
+/* -------------------------------------------------------------
+ *  Clock
+ */
+static bool simulatedClock = false;
+static uint64_t simulatedMicros = 0;
+static uint64_t realClockStart = 0;
+
+static uint64_t realClockMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  if (realClockStart == 0) realClockStart = now;
+  return now - realClockStart;
+}
+
+void hostUseSimulatedClock(bool simulated) {
+  simulatedClock = simulated;
+}
+
+uint64_t hostNowMicros() {
+  return simulatedClock ? simulatedMicros : realClockMicros();
+}
+
+void hostSetClock(uint64_t microseconds) {
+  simulatedMicros = microseconds;
+}
+
+uint32_t halMicros() {
+  return (uint32_t) hostNowMicros();
+}
+
+uint32_t halMillis() {
+  return (uint32_t) (hostNowMicros() / 1000);
+}
+
+/* -------------------------------------------------------------
+ *  Random numbers. Every call to halRandomSeed() is a new board
+ *  with a different floating A0 pin reading
+ */
+static uint32_t randomState = 0x12345678;
+static uint32_t configuredSeed = 0x12345678;
+static uint32_t seedCalls = 0;
+
+void hostRandomSeed(uint32_t seed) {
+  configuredSeed = seed;
+  seedCalls = 0;
+  randomState = seed != 0 ? seed : 1;
+}
+
+void halRandomSeed() {
+  seedCalls++;
+  randomState ^= configuredSeed + 0x9E3779B9 * seedCalls;
+  if (randomState == 0) randomState = 1;
+}
+
+uint32_t halRandom(uint32_t min, uint32_t max) {
+  // xorshift32
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  if (max <= min) return min;
+  return min + randomState % (max - min);
+}
+
+/* -------------------------------------------------------------
+ *  Trace clock. Always the real clock, even when the scheduler
+ *  runs on a simulated one: traces measure CPU time
+ */
+void halTraceClockBegin() {
+}
+
+uint32_t halTraceClock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) ((uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+uint32_t halTraceTicksPerMicro() {
+  return 1000;
+}
+
+/* -------------------------------------------------------------
+ *  Memory. The whole process heap, host programs included
+ */
+uint32_t halHeapUsed() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 info = mallinfo2();
+#else
+  struct mallinfo info = mallinfo();
+#endif
+  return (uint32_t) info.uordblks;
+}
+
+/* -------------------------------------------------------------
+ *  Scheduler
+ */
+static HostEventSource *sources = NULL;
+
+struct hostLoop {
+  void (*loop)(void *context);
+  void *context;
+};
+static std::vector<hostLoop> loops;
+
+void hostAddLoop(void (*loop)(void *context), void *context) {
+  loops.push_back({ loop, context });
+}
+
+static void runLoops() {
+  for (size_t i = 0; i < loops.size(); i++) {
+    loops[i].loop(loops[i].context);
+  }
+}
+
+void HostEventSource::registerSource() {
+  if (!registered) {
+    previousSource = NULL;
+    nextSource = sources;
+    if (sources != NULL) sources->previousSource = this;
+    sources = this;
+    registered = true;
+  }
+}
+
+void HostEventSource::unregisterSource() {
+  if (registered) {
+    if (previousSource != NULL) previousSource->nextSource = nextSource;
+    else sources = nextSource;
+    if (nextSource != NULL) nextSource->previousSource = previousSource;
+    nextSource = NULL;
+    previousSource = NULL;
+    registered = false;
+  }
+}
+
+bool hostRunNextEvent(uint64_t untilMicros) {
+  // Which source has the earliest event?
+  HostEventSource *earliest = NULL;
+  uint64_t earliestTime = HOST_NO_EVENT;
+  for (HostEventSource *s = sources; s != NULL; s = s->nextSource) {
+    uint64_t t = s->nextEventMicros();
+    if (t < earliestTime) {
+      earliestTime = t;
+      earliest = s;
+    }
+  }
+
+  // loop() keeps running on an idle board. Run the loops every
+  // HOST_IDLE_LOOP_MICROS while waiting for the next event
+  if (!loops.empty() && (earliest != NULL || untilMicros != HOST_NO_EVENT)) {
+    uint64_t idleTick = simulatedMicros + HOST_IDLE_LOOP_MICROS;
+    if (idleTick < earliestTime && idleTick <= untilMicros) {
+      simulatedMicros = idleTick;
+      runLoops();
+      return true;
+    }
+  }
+
+  if (earliest == NULL || earliestTime > untilMicros) {
+    // Nothing happens until then, but loop() keeps running and may act on the clock
+    if (untilMicros != HOST_NO_EVENT && untilMicros > simulatedMicros) {
+      simulatedMicros = untilMicros;
+      runLoops();
+    }
+    return false;
+  }
+
+  if (earliestTime > simulatedMicros) simulatedMicros = earliestTime;
+  earliest->runEvent();
+  runLoops();
+  return true;
+}
+
+void hostRunUntil(uint64_t untilMicros) {
+  while (hostRunNextEvent(untilMicros));
+}
+
+void hostPoll() {
+  uint64_t now = hostNowMicros();
+  HostEventSource *s = sources;
+  while (s != NULL) {
+    HostEventSource *next = s->nextSource;
+    if (s->nextEventMicros() <= now) s->runEvent();
+    s = next;
+  }
+  runLoops();
+}
+
+/* -------------------------------------------------------------
+ *  Timers
+ */
+bool HalTimer::begin(HalTimerListener *listener, uint8_t timerID, uint32_t microseconds) {
+  timerListener = listener;
+  id = timerID;
+  period = microseconds;
+  expiry = hostNowMicros() + microseconds;
+  registerSource();
+  return true;
+}
+
+void HalTimer::end() {
+  unregisterSource();
+}
+
+uint64_t HalTimer::nextEventMicros() {
+  return expiry;
+}
+
+void HalTimer::runEvent() {
+  // Next expiry first. The listener can end() or begin() again
+  expiry += period;
+  if (timerListener != NULL) timerListener->timerExpired(id);
+}
+
+/* -------------------------------------------------------------
+ *  Virtual CAN bus
+ */
+VirtualCanBus::VirtualCanBus(uint32_t rate) {
+  bitRate = rate;
+  registerSource();
+}
+
+void VirtualCanBus::attach(VirtualCanDriver *driver) {
+  drivers.push_back(driver);
+}
+
+void VirtualCanBus::transmitRequest() {
+  // Arbitration happens at the start of the next frame, so every request made
+  // at the same moment takes part in it
+  if (!busy && !arbitrationPending) {
+    arbitrationPending = true;
+    eventTime = hostNowMicros();
+  }
+}
+
+uint32_t VirtualCanBus::frameMicros(canFrame &frame) {
+  if (bitRate == 0) return 0;
+
+  // Nominal extended frame: 67 bits + data + 3 bits interframe space. No stuff bits
+  uint32_t bits = 67 + 8 * frame.len + 3;
+  return (bits * 1000000 + bitRate - 1) / bitRate;
+}
+
+uint64_t VirtualCanBus::nextEventMicros() {
+  return (busy || arbitrationPending) ? eventTime : HOST_NO_EVENT;
+}
+
+void VirtualCanBus::runEvent() {
+  if (arbitrationPending) {
+    // Lowest identifier wins the bus
+    arbitrationPending = false;
+    transmitter = NULL;
+    for (size_t i = 0; i < drivers.size(); i++) {
+      VirtualCanDriver *d = drivers[i];
+      if (d->txPending() && (transmitter == NULL || d->txFront().id < transmitter->txFront().id)) {
+        transmitter = d;
+      }
+    }
+
+    if (transmitter != NULL) {
+      uint32_t duration = frameMicros(transmitter->txFront());
+      busy = true;
+      eventTime += duration;
+      busyMicros += duration;
+    }
+  }
+  else if (busy) {
+    // Frame on the bus is complete. Everybody but the transmitter receives it
+    busy = false;
+    framesTransferred++;
+    canFrame frame = transmitter->txFront();
+    VirtualCanDriver *sender = transmitter;
+    sender->txDone();
+    for (size_t i = 0; i < drivers.size(); i++) {
+      VirtualCanDriver *d = drivers[i];
+      if (d != sender && d->canListener != NULL && d->accepts(frame.id)) {
+        canFrame copy = frame;
+        d->canListener->frameHandler(copy);
+      }
+    }
+
+    // Room in the transmitter TX buffer
+    if (sender->txCompleteEvents && sender->canListener != NULL) sender->canListener->transmitComplete();
+
+    // More frames waiting?
+    for (size_t i = 0; i < drivers.size(); i++) {
+      if (drivers[i]->txPending()) {
+        transmitRequest();
+        break;
+      }
+    }
+  }
+}
+
+bool VirtualCanDriver::begin(uint32_t baudRate, CanDriverListener *listener) {
+  canListener = listener;
+  bus->attach(this);
+  return true;
+}
+
+bool VirtualCanDriver::write(canFrame &frame) {
+  // TX buffer full?
+  if (txCount == HOST_TX_BUFFER) return false;
+
+  canFrame &slot = txBuffer[(txHead + txCount) % HOST_TX_BUFFER];
+  slot = frame;
+  slot.flags.extended = 1;
+  txCount++;
+  bus->transmitRequest();
+  return true;
+}
+
+bool VirtualCanDriver::setAcceptanceFilter(const acceptanceRule rules[], uint8_t count) {
+  acceptanceRules.assign(rules, rules + count);
+  return true;
+}
+
+bool VirtualCanDriver::accepts(uint32_t id) {
+  bool accepted = acceptanceRules.empty();
+  for (size_t i = 0; i < acceptanceRules.size() && !accepted; i++) {
+    accepted = (id & acceptanceRules[i].mask) == (acceptanceRules[i].id & acceptanceRules[i].mask);
+  }
+
+  if (accepted) framesAccepted++;
+  else framesFiltered++;
+  return accepted;
+}
+
+void VirtualCanDriver::txDone() {
+  txHead = (txHead + 1) % HOST_TX_BUFFER;
+  txCount--;
+}
+
+/* -------------------------------------------------------------
+ *  SocketCAN
+ */
+SocketCanDriver::~SocketCanDriver() {
+  if (fd >= 0) close(fd);
+}
+
+bool SocketCanDriver::begin(uint32_t baudRate, CanDriverListener *listener) {
+  // Bit rate is configured with "ip link", not here
+  canListener = listener;
+
+  fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (fd < 0) return false;
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifName, IFNAMSIZ - 1);
+  if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+    close(fd);
+    fd = -1;
+    return false;
+  }
+
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    fd = -1;
+    return false;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  registerSource();
+  return true;
+}
+
+bool SocketCanDriver::write(canFrame &frame) {
+  if (fd < 0) return false;
+
+  struct can_frame msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.can_id = (frame.id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+  msg.can_dlc = frame.len;
+  memcpy(msg.data, frame.buf, frame.len);
+
+  return ::write(fd, &msg, sizeof(msg)) == sizeof(msg);
+}
+
+bool SocketCanDriver::setAcceptanceFilter(const acceptanceRule rules[], uint8_t count) {
+  if (fd < 0) return false;
+
+  // Kernel does the filtering
+  std::vector<struct can_filter> filters(count);
+  for (uint8_t i = 0; i < count; i++) {
+    filters[i].can_id = (rules[i].id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    filters[i].can_mask = (rules[i].mask & CAN_EFF_MASK) | CAN_EFF_FLAG | CAN_RTR_FLAG;
+  }
+  return setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters.data(), count * sizeof(struct can_filter)) == 0;
+}
+
+uint64_t SocketCanDriver::nextEventMicros() {
+  // Always check the socket
+  return fd >= 0 ? hostNowMicros() : HOST_NO_EVENT;
+}
+
+void SocketCanDriver::runEvent() {
+  struct can_frame msg;
+  while (read(fd, &msg, sizeof(msg)) == sizeof(msg)) {
+    // LCC only uses extended frames
+    if ((msg.can_id & CAN_EFF_FLAG) && canListener != NULL) {
+      canFrame frame;
+      frame.id = msg.can_id & CAN_EFF_MASK;
+      frame.flags.extended = 1;
+      frame.flags.remote = (msg.can_id & CAN_RTR_FLAG) ? 1 : 0;
+      frame.flags.overrun = 0;
+      frame.len = msg.can_dlc;
+      memcpy(frame.buf, msg.data, 8);
+      canListener->frameHandler(frame);
+    }
+  }
+}
+
+/* -------------------------------------------------------------
+ *  Output lines
+ */
+static bool outputStates[HAL_OUTPUT_LINES];
+
+void halOutputBegin(uint8_t lines) {
+}
+
+void halOutputWrite(uint8_t line, bool state) {
+  if (line < HAL_OUTPUT_LINES) outputStates[line] = state;
+}
+
+bool hostOutputState(uint8_t line) {
+  return line < HAL_OUTPUT_LINES ? outputStates[line] : false;
+}
+
+/* -------------------------------------------------------------
+ *  EEPROM emulation. A blank EEPROM reads 0xFF
+ */
+HostStorage::HostStorage(uint16_t storageSize, const char *path) {
+  length = storageSize;
+  bytes = (uint8_t*) malloc(length);
+  memset(bytes, 0xFF, length);
+
+  if (path != NULL) {
+    file = fopen(path, "r+b");
+    if (file != NULL) {
+      size_t n = fread(bytes, 1, length, file);
+      (void) n;
+    }
+    else {
+      file = fopen(path, "w+b");
+      if (file != NULL) {
+        fwrite(bytes, 1, length, file);
+        fflush(file);
+      }
+    }
+  }
+}
+
+HostStorage::~HostStorage() {
+  if (file != NULL) fclose(file);
+  free(bytes);
+}
+
+uint8_t HostStorage::read(uint16_t address) {
+  return address < length ? bytes[address] : 0xFF;
+}
+
+void HostStorage::write(uint16_t address, uint8_t value) {
+  if (address < length) {
+    bytes[address] = value;
+    writeCount++;
+    if (file != NULL) {
+      fseek(file, address, SEEK_SET);
+      fputc(value, file);
+      fflush(file);
+    }
+  }
+}
+
+uint16_t HostStorage::size() {
+  return length;
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef __CANBOOSE_HAL_HOST_H__
+#define __CANBOOSE_HAL_HOST_H__
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Linux host backend of the Hardware Abstraction Layer. Included from canboose_hal.h
+ *
+ *  Everything runs in one thread. What is an interrupt on the Teensy (a received frame, a timer)
+ *  is an event run by the host scheduler, so ATOMIC_BLOCK has nothing to protect.
+ *
+ *  The clock can be real (CLOCK_MONOTONIC) or simulated. With a simulated clock hostRunNextEvent()
+ *  jumps straight to the next timer or bus event, so hours of bus time take milliseconds.
+ */
+
+#include <stdio.h>
+#include <vector>
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  The little part of Arduino core used by the stack
+ */
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_BLOCK(type) for (int __atomic_block_once = 1; __atomic_block_once; __atomic_block_once = 0)
+
+class HostSerial {
+  public:
+    void begin(unsigned long baudRate) {}
+    void print(const char *s) { fputs(s, stdout); }
+    void println(const char *s = "") { puts(s); }
+};
+
+extern HostSerial Serial;
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Host scheduler. Timers, virtual buses and SocketCAN drivers are event sources.
+ *  Only registered sources are taken into account
+ */
+#define HOST_NO_EVENT           UINT64_MAX
+#define HOST_IDLE_LOOP_MICROS   1000        // Simulated clock: loops run at least this often
+
+class HostEventSource {
+  public:
+    virtual ~HostEventSource() { unregisterSource(); }
+    virtual uint64_t nextEventMicros() = 0;  // HOST_NO_EVENT if there is nothing pending
+    virtual void runEvent() = 0;
+
+    void registerSource();
+    void unregisterSource();
+
+    HostEventSource *nextSource = NULL;
+    HostEventSource *previousSource = NULL;
+    bool registered = false;
+};
+
+void     hostUseSimulatedClock(bool simulated);
+uint64_t hostNowMicros();
+void     hostSetClock(uint64_t microseconds);          // Simulated clock only
+bool     hostRunNextEvent(uint64_t untilMicros);        // Simulated clock. false if nothing before untilMicros
+void     hostRunUntil(uint64_t untilMicros);            // Simulated clock
+void     hostPoll();                                    // Real clock. Run every event already due
+void     hostRandomSeed(uint32_t seed);
+void     hostAddLoop(void (*loop)(void *context), void *context);  // Like Arduino loop(). Run after every event
+                                                                    // and every HOST_IDLE_LOOP_MICROS when idle
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Timers
+ */
+class HalTimer : public HostEventSource {
+  public:
+    bool begin(HalTimerListener *listener, uint8_t timerID, uint32_t microseconds);
+    void end();
+    uint64_t nextEventMicros();
+    void runEvent();
+
+  private:
+    HalTimerListener *timerListener = NULL;
+    uint8_t id = 0;
+    uint32_t period = 0;
+    uint64_t expiry = 0;
+};
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  In-process virtual CAN bus. Every attached driver has one TX mailbox fed by a 16 frames
+ *  TX buffer, like FlexCAN on the Teensy. Pending frames win the bus by arbitration (lowest
+ *  identifier first) and take the time a nominal frame needs at bitRate. A bitRate of 0
+ *  means frames take no time
+ */
+#define HOST_TX_BUFFER  16
+
+class VirtualCanDriver;
+
+class VirtualCanBus : public HostEventSource {
+  public:
+    VirtualCanBus(uint32_t rate = 125000);
+    void attach(VirtualCanDriver *driver);
+    void transmitRequest();
+    uint32_t frameMicros(canFrame &frame);
+    uint64_t nextEventMicros();
+    void runEvent();
+
+    uint32_t bitRate;
+    uint32_t framesTransferred = 0;
+    uint64_t busyMicros = 0;
+
+  private:
+    std::vector<VirtualCanDriver*> drivers;
+    VirtualCanDriver *transmitter = NULL;
+    bool busy = false;
+    bool arbitrationPending = false;
+    uint64_t eventTime = 0;
+};
+
+class VirtualCanDriver : public CanDriver {
+  public:
+    VirtualCanDriver(VirtualCanBus *virtualBus) : bus(virtualBus) {}
+    bool begin(uint32_t baudRate, CanDriverListener *listener);
+    bool write(canFrame &frame);
+    bool setAcceptanceFilter(const acceptanceRule rules[], uint8_t count);
+    bool accepts(uint32_t id);
+
+    bool txPending() { return txCount > 0; }
+    canFrame& txFront() { return txBuffer[txHead]; }
+    void txDone();
+
+    VirtualCanBus *bus;
+    CanDriverListener *canListener = NULL;
+    bool txCompleteEvents = true;  // false emulates a driver without TX complete interrupt
+    uint32_t framesAccepted = 0;   // Software acceptance filter, like the controller mailboxes
+    uint32_t framesFiltered = 0;
+
+  private:
+    std::vector<acceptanceRule> acceptanceRules;   // Empty: everything is accepted
+    canFrame txBuffer[HOST_TX_BUFFER];
+    uint8_t txHead = 0;
+    uint8_t txCount = 0;
+};
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  SocketCAN driver (vcan0, can0...). Real clock only
+ */
+class SocketCanDriver : public CanDriver, public HostEventSource {
+  public:
+    SocketCanDriver(const char *interfaceName) : ifName(interfaceName) {}
+    ~SocketCanDriver();
+    bool begin(uint32_t baudRate, CanDriverListener *listener);
+    bool write(canFrame &frame);
+    bool setAcceptanceFilter(const acceptanceRule rules[], uint8_t count);
+    uint64_t nextEventMicros();
+    void runEvent();
+
+  private:
+    const char *ifName;
+    int fd = -1;
+    CanDriverListener *canListener = NULL;
+};
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Output lines are just remembered
+ */
+#define HAL_OUTPUT_LINES  16
+
+bool hostOutputState(uint8_t line);
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  EEPROM emulation. Kept in RAM and written through to a file when a path is given
+ */
+class HostStorage : public NonVolatileStorage {
+  public:
+    HostStorage(uint16_t storageSize = 4096, const char *path = NULL);
+    ~HostStorage();
+    uint8_t read(uint16_t address);
+    void write(uint16_t address, uint8_t value);
+    uint16_t size();
+
+    uint32_t writeCount = 0;
+
+  private:
+    uint8_t *bytes;
+    uint16_t length;
+    FILE *file = NULL;
+};
+
+#endif
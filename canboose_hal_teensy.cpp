@@ -0,0 +1,217 @@
+/* -----------------------------------------------------------------
+ * Teensy 3.x backend of the Hardware Abstraction Layer
+ */
+
+#if defined(ARDUINO)
+
+#include <EEPROM.h>
+#include <malloc.h>
+#include "canboose_hal.h"
+
+/* -------------------------------------------------------------
+ *  Timers. One proxy function per PIT channel
+ */
+static HalTimer *timerSlots[HAL_TIMER_SLOTS] = { NULL };
+
+static void proxyTimerSlot0() { if (timerSlots[0] != NULL) timerSlots[0]->expired(); }
+static void proxyTimerSlot1() { if (timerSlots[1] != NULL) timerSlots[1]->expired(); }
+static void proxyTimerSlot2() { if (timerSlots[2] != NULL) timerSlots[2]->expired(); }
+static void proxyTimerSlot3() { if (timerSlots[3] != NULL) timerSlots[3]->expired(); }
+
+static void (*timerProxies[HAL_TIMER_SLOTS])() = { proxyTimerSlot0, proxyTimerSlot1, proxyTimerSlot2, proxyTimerSlot3 };
+
+bool HalTimer::begin(HalTimerListener *listener, uint8_t timerID, uint32_t microseconds) {
+  end();
+
+  timerListener = listener;
+  id = timerID;
+
+  // Find a free slot
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    for (int i = 0; i < HAL_TIMER_SLOTS; i++) {
+      if (timerSlots[i] == NULL) {
+        timerSlots[i] = this;
+        slot = i;
+        break;
+      }
+    }
+  }
+
+  if (slot < 0) return false;
+  return timer.begin(timerProxies[slot], microseconds);
+}
+
+void HalTimer::end() {
+  if (slot >= 0) {
+    timer.end();
+    timerSlots[slot] = NULL;
+    slot = -1;
+  }
+}
+
+void HalTimer::expired() {
+  if (timerListener != NULL) timerListener->timerExpired(id);
+}
+
+/* -------------------------------------------------------------
+ *  CAN driver
+ */
+bool TeensyCanDriver::begin(uint32_t baudRate, CanDriverListener *listener) {
+  canListener = listener;
+
+  // We want to transmit in order so number of TX mailboxes = 1
+  Can0.begin(baudRate);
+  Can0.attachObj(this);
+  Can0.setNumTxBoxes(1);
+
+  // Teensy 3.x has 16 mailboxes. We will configure like this:
+  // 0 -    -> Receive standard frames
+  // 1 - 14 -> Receive extended frames
+  // 15     -> Transmit frames
+  CAN_filter_t extFilter;
+  extFilter.id=0;
+  extFilter.ext=1;
+  extFilter.rtr=0;
+  for (int filterNum = 1; filterNum < 15; filterNum++) {
+    Can0.setFilter(extFilter, filterNum);
+  }
+
+  // This instance will process/receive all frames and TX mailbox empty events
+  attachGeneralHandler();
+
+  return true;
+}
+
+bool TeensyCanDriver::write(canFrame &frame) {
+  CAN_message_t msg = {0, 0, {1, 0, 0, 0}, 0};
+  msg.id = frame.id;
+  msg.flags.extended = 1;
+  msg.len = frame.len;
+  memcpy(msg.buf, frame.buf, frame.len);
+
+  return Can0.write(msg) == 1;
+}
+
+bool TeensyCanDriver::setAcceptanceFilter(const acceptanceRule rules[], uint8_t count) {
+  // One rule per receive mailbox (1 - 14). Spare mailboxes repeat the first rule
+  if (count == 0 || count > 14) return false;
+
+  // Masks can only be written in freeze mode. FlexCAN setMask() enters and leaves it
+  // for each mailbox, and frames are lost while frozen: freeze once for all of them
+  FLEXCANb_MCR(FLEXCAN0_BASE) |= FLEXCAN_MCR_FRZ | FLEXCAN_MCR_HALT;
+  while (!(FLEXCANb_MCR(FLEXCAN0_BASE) & FLEXCAN_MCR_FRZ_ACK));
+
+  for (int mailbox = 1; mailbox < 15; mailbox++) {
+    const acceptanceRule &rule = rules[mailbox - 1 < count ? mailbox - 1 : 0];
+    CAN_filter_t extFilter;
+    extFilter.id = rule.id;
+    extFilter.ext = 1;
+    extFilter.rtr = 0;
+    Can0.setFilter(extFilter, mailbox);
+    FLEXCANb_MB_MASK(FLEXCAN0_BASE, mailbox) = rule.mask;  // Individual mask: 1 bits must match
+  }
+
+  FLEXCANb_MCR(FLEXCAN0_BASE) &= ~FLEXCAN_MCR_HALT;
+  while (FLEXCANb_MCR(FLEXCAN0_BASE) & FLEXCAN_MCR_FRZ_ACK);
+  while (FLEXCANb_MCR(FLEXCAN0_BASE) & FLEXCAN_MCR_NOT_RDY);
+
+  return true;
+}
+
+bool TeensyCanDriver::frameHandler(CAN_message_t &frame, int mailbox, uint8_t controller) {
+  // LCC only uses extended frames
+  if (canListener != NULL && frame.flags.extended) {
+    canFrame received;
+    received.id = frame.id;
+    received.flags.extended = 1;
+    received.flags.remote = frame.flags.remote;
+    received.flags.overrun = frame.flags.overrun;
+    received.len = frame.len;
+    memcpy(received.buf, frame.buf, 8);
+    canListener->frameHandler(received);
+  }
+
+  return true;
+}
+
+void TeensyCanDriver::txHandler(int mailbox, uint8_t controller) {
+  // TX mailbox is empty
+  if (canListener != NULL) canListener->transmitComplete();
+}
+
+/* -------------------------------------------------------------
+ *  EEPROM
+ */
+uint8_t EepromStorage::read(uint16_t address) {
+  return EEPROM.read(address);
+}
+
+void EepromStorage::write(uint16_t address, uint8_t value) {
+  EEPROM.write(address, value);
+}
+
+uint16_t EepromStorage::size() {
+  return EEPROM.length();
+}
+
+/* -------------------------------------------------------------
+ *  Clock and random numbers
+ */
+uint32_t halMicros() {
+  return micros();
+}
+
+uint32_t halMillis() {
+  return millis();
+}
+
+void halRandomSeed() {
+  // Pin A0 Teensy 3.6 should be empty
+  randomSeed(analogRead(A0));
+}
+
+uint32_t halRandom(uint32_t min, uint32_t max) {
+  return random(min, max);
+}
+
+/* -------------------------------------------------------------
+ *  Trace clock. DWT cycle counter, off after reset
+ */
+void halTraceClockBegin() {
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+}
+
+uint32_t halTraceClock() {
+  return ARM_DWT_CYCCNT;
+}
+
+uint32_t halTraceTicksPerMicro() {
+  return F_CPU / 1000000;
+}
+
+/* -------------------------------------------------------------
+ *  Memory
+ */
+uint32_t halHeapUsed() {
+  // newlib keeps the count. The stack itself never allocates, this is the core libraries
+  struct mallinfo info = mallinfo();
+  return info.uordblks;
+}
+
+/* -------------------------------------------------------------
+ *  Output lines
+ */
+static const uint8_t outputPins[HAL_OUTPUT_LINES] = { 5, 6, 7, 8, 9, 10, 11, 12, 24, 25, 26, 27, 28, 29, 30, 31 };
+
+void halOutputBegin(uint8_t lines) {
+  for (int i = 0; i < lines && i < HAL_OUTPUT_LINES; i++) {
+    pinMode(outputPins[i], OUTPUT);
+  }
+}
+
+void halOutputWrite(uint8_t line, bool state) {
+  if (line < HAL_OUTPUT_LINES) digitalWrite(outputPins[line], state ? HIGH : LOW);
+}
+
+#endif
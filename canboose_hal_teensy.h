@@ -0,0 +1,61 @@
+#ifndef __CANBOOSE_HAL_TEENSY_H__
+#define __CANBOOSE_HAL_TEENSY_H__
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Teensy 3.x backend of the Hardware Abstraction Layer. Included from canboose_hal.h
+ */
+
+#include <FlexCAN.h>
+#include <IntervalTimer.h>
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Teensy 3.x has 4 PIT channels, so no more than 4 IntervalTimers can run at the same time.
+ *  IntervalTimer can not call an instance method, so every running HalTimer takes a slot with
+ *  a proxy function that calls back the right instance
+ */
+#define HAL_TIMER_SLOTS   4
+
+class HalTimer {
+  public:
+    bool begin(HalTimerListener *listener, uint8_t timerID, uint32_t microseconds);
+    void end();
+    void expired();
+
+  private:
+    IntervalTimer timer;
+    HalTimerListener *timerListener = NULL;
+    uint8_t id = 0;
+    int8_t slot = -1;
+};
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Output lines. Pins 3 and 4 are CAN0 TX/RX, so they are skipped
+ */
+#define HAL_OUTPUT_LINES  16
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  FlexCAN driver on Can0
+ */
+class TeensyCanDriver : public CanDriver, public CANListener {
+  public:
+    bool begin(uint32_t baudRate, CanDriverListener *listener);
+    bool write(canFrame &frame);
+    bool setAcceptanceFilter(const acceptanceRule rules[], uint8_t count);
+    bool frameHandler(CAN_message_t &frame, int mailbox, uint8_t controller);
+    void txHandler(int mailbox, uint8_t controller);
+
+  private:
+    CanDriverListener *canListener = NULL;
+};
+
+/* -----------------------------------------------------------------------------------------------------------
+ *  Teensy internal EEPROM
+ */
+class EepromStorage : public NonVolatileStorage {
+  public:
+    uint8_t read(uint16_t address);
+    void write(uint16_t address, uint8_t value);
+    uint16_t size();
+};
+
+#endif
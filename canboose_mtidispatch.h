@@ -0,0 +1,80 @@
+#ifndef __CANBOOSE_MTIDISPATCH_H__
+#define __CANBOOSE_MTIDISPATCH_H__
+
+#include "canboose_hal.h"
+
+/* --------------------------------------------------------------------------------------------------------
+ *  Message dispatch table. MTI -> handler, built at compile time.
+ *
+ *  Every layer registers the messages it handles in a static constexpr registerMessageHandlers(), so a
+ *  protocol is added next to its code and there is no central switch to edit. The table is an open
+ *  addressing hash of MTI_DISPATCH_SLOTS entries, filled while compiling: a message takes one indexed
+ *  read, rarely two. An MTI registered twice, or too many of them, stops the build.
+ *
+ *  Handlers are member functions. mtiCall<> turns each one into a plain function that gets its layer
+ *  as a pointer, so the table holds no virtual calls and lives in flash.
+ */
+#define MTI_DISPATCH_SLOTS    64      // Power of two, at least twice the messages registered
+
+#define MTI_GLOBAL            0x00
+#define MTI_ADDRESSED         0x01    // Destination alias in data[0..1]: only handled when it is ours
+#define MTI_APPLICATION       0x02    // Handler of the application layer, not of the network layer
+
+typedef void (*mtiHandlerFunction)(void *layer, uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+
+template <class Layer, void (Layer::*method)(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len)>
+void mtiCall(void *layer, uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  (static_cast<Layer*>(layer)->*method)(mti, srcAlias, data, len);
+}
+
+#define MTI_HANDLER(Layer, method)    &mtiCall<Layer, &Layer::method>
+
+struct mtiHandler {
+  uint16_t mti = 0;
+  uint8_t flags = 0;
+  mtiHandlerFunction handle = NULL; // NULL: free slot
+};
+
+// Not constexpr: reaching them while the table is built is a compile error
+void mtiRegisteredTwice();
+void mtiDispatchFull();
+
+class MtiDispatchClass {
+  public:
+    constexpr MtiDispatchClass() : entries(), registered(0), longestProbe(0) {}
+
+    constexpr void add(uint16_t mti, uint8_t flags, mtiHandlerFunction handle) {
+      if (registered * 2 >= MTI_DISPATCH_SLOTS) mtiDispatchFull();
+      uint8_t slot = slotFor(mti);
+      uint8_t probes = 1;
+      while (entries[slot].handle != NULL) {
+        if (entries[slot].mti == mti) mtiRegisteredTwice();
+        slot = (slot + 1) & (MTI_DISPATCH_SLOTS - 1);
+        probes++;
+      }
+      entries[slot] = mtiHandler { mti, flags, handle };
+      registered++;
+      if (probes > longestProbe) longestProbe = probes;
+    }
+
+    const mtiHandler* find(uint16_t mti) const {
+      uint8_t slot = slotFor(mti);
+      while (entries[slot].handle != NULL) {
+        if (entries[slot].mti == mti) return &entries[slot];
+        slot = (slot + 1) & (MTI_DISPATCH_SLOTS - 1);
+      }
+      return NULL;
+    }
+
+    mtiHandler entries[MTI_DISPATCH_SLOTS];
+    uint8_t registered;
+    uint8_t longestProbe;         // Reads to find the worst placed MTI
+
+  private:
+    // The MTIs in use differ in both halves
+    static constexpr uint8_t slotFor(uint16_t mti) {
+      return (mti ^ (mti >> 6)) & (MTI_DISPATCH_SLOTS - 1);
+    }
+};
+
+#endif
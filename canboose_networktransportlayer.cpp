@@ -1,12 +1,45 @@
 #include "canboose_networktransportlayer.h"
 
-void NetworkTransportLayer::init(ApplicationListener *listener) {
+void NetworkTransportLayer::init(ApplicationListener *listener, CanDriver *driver, const uint8_t *nodeID, uint16_t lastAlias) {
   appListener = listener;
-  frameTransferLayer.init(this);
+  for (int i = 0; i < STREAM_OUTGOING; i++) outgoingStreams[i].state = STREAM_FREE;
+  for (int i = 0; i < STREAM_INCOMING; i++) incomingStreams[i].state = STREAM_FREE;
+  frameTransferLayer.init(this, driver, nodeID, lastAlias);
+}
+
+void NetworkTransportLayer::run() {
+  frameTransferLayer.run();
+  sweepOutgoingDatagrams();
+  if (incomingDatagrams.used() > 0) sweepIncomingDatagrams(halMillis());
+  sendStreams();
 }
 
 void NetworkTransportLayer::initializationComplete() {
-  sendMessage(INIT_COMPLETE_FULL, UID_array, 6);
+  sendMessage(INIT_COMPLETE_FULL, frameTransferLayer.nodeID, 6);
+}
+
+void NetworkTransportLayer::aliasReleased(uint16_t alias) {
+  // Datagrams and streams with that node will never be answered
+  outgoingDatagrams.deleteSlot(alias);
+  incomingDatagrams.deleteSlot(alias);
+  for (int i = 0; i < STREAM_OUTGOING; i++) {
+    if (outgoingStreams[i].state != STREAM_FREE && outgoingStreams[i].alias == alias) outgoingStreams[i].state = STREAM_FREE;
+  }
+  for (int i = 0; i < STREAM_INCOMING; i++) {
+    if (incomingStreams[i].state != STREAM_FREE && incomingStreams[i].alias == alias) closeIncomingStream(&incomingStreams[i], false);
+  }
+}
+
+// Alias of a node from the cache. If it is unknown we ask the node itself
+// with a Verify Node ID: its answer will fill the cache. Returns 0 meanwhile
+uint16_t NetworkTransportLayer::aliasForNode(uint64_t nodeID) {
+  uint16_t alias = frameTransferLayer.aliasCache.findAlias(nodeID);
+  if (alias == 0) {
+    uint8_t data[6];
+    nodeIDToBytes(nodeID, data);
+    sendMessage(VERIFY_NODE_ID_GLOBAL, data, 6);
+  }
+  return alias;
 }
 
 void NetworkTransportLayer::processLCCMessage(uint8_t frameType, uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len) {
@@ -19,6 +52,11 @@ void NetworkTransportLayer::processLCCMessage(uint8_t frameType, uint16_t mti_or
     // Datagram. All data in one message
     case 2:
       if (mti_or_dst == frameTransferLayer.sourceNodeID) {
+        // Sender gave up an unfinished one
+        if (incomingDatagrams.findSlot(srcAlias) != NULL) {
+          reassemblyOutOfOrder++;
+          incomingDatagrams.deleteSlot(srcAlias);
+        }
         appListener->processApplicationDatagram(srcAlias, data, len);
       }
       break;
@@ -26,82 +64,77 @@ void NetworkTransportLayer::processLCCMessage(uint8_t frameType, uint16_t mti_or
     // Datagram. First message (more to come)
     case 3:
       if (mti_or_dst == frameTransferLayer.sourceNodeID) {
-        linkedListNode *lln = linkedListOperation(0, &incomingDatagrams, srcAlias, data, len);
-        if (lln == NULL) sendDatagramRejected(srcAlias, 0x2040);
+        // Same as above. The new one replaces it
+        if (incomingDatagrams.findSlot(srcAlias) != NULL) {
+          reassemblyOutOfOrder++;
+          incomingDatagrams.deleteSlot(srcAlias);
+        }
+
+        // Pool full? Expired datagrams make room, live ones are never evicted
+        uint32_t now = halMillis();
+        if (incomingDatagrams.used() == DATAGRAM_POOL_SIZE) sweepIncomingDatagrams(now);
+
+        datagramSlot *slot = incomingDatagrams.insertSlot(srcAlias);
+        if (slot != NULL) {
+          memcpy(slot->data, data, len);
+          slot->len = len;
+          slot->timestamp = now;
+          slot->deadline = now + DATAGRAM_REASSEMBLY_MILLIS;
+        }
+        else {
+          reassemblyPoolFull++;
+          sendDatagramRejected(srcAlias, DATAGRAM_BUFFER_UNAVAILABLE);  // No slot. Try later
+        }
       }
       break;
 
     // Datagram. Middle message (more to come)
     case 4:
       if (mti_or_dst == frameTransferLayer.sourceNodeID) {
-        linkedListNode *lln = linkedListOperation(1, &incomingDatagrams, srcAlias, data, len);
-        if (lln == NULL) sendDatagramRejected(srcAlias, 0x2040);
+        appendToDatagram(srcAlias, data, len);
       }
       break;
 
     // Datagram. Last message
     case 5:
       if (mti_or_dst == frameTransferLayer.sourceNodeID) {
-        linkedListNode *lln = linkedListOperation(1, &incomingDatagrams, srcAlias, data, len);  // Find node
-        if (lln != NULL) {
-          appListener->processApplicationDatagram(lln->alias, lln->data, lln->len);  // Process it
-          linkedListOperation(2, &incomingDatagrams, lln->alias, lln->data, lln->len); // Delete it
+        datagramSlot *slot = appendToDatagram(srcAlias, data, len);
+        if (slot != NULL) {
+          appListener->processApplicationDatagram(slot->alias, slot->data, slot->len);  // Process it
+          incomingDatagrams.deleteSlot(srcAlias);  // Delete it
         }
-        else sendDatagramRejected(srcAlias, 0x2040);
       }
       break;
 
-    // Stream
+    // Stream data
     case 7:
+      if (mti_or_dst == frameTransferLayer.sourceNodeID) {
+        processStreamFrame(srcAlias, data, len);
+      }
       break;
   }
 }
 
-/*
- * opType can be:
- * 
- * 0 - Insert a new node at the end
- * 1 - Find & update a node with new data
- * 2 - Return the data received (all datagrams received) and delete the node
- * 3 - Find node only
- */
-linkedListNode* NetworkTransportLayer::linkedListOperation(uint8_t opType, LinkedListClass *list, uint16_t srcAlias, uint8_t data[], uint8_t len) {
-  linkedListNode *lln = NULL;
-
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    switch (opType) {
-      case 0:
-        // A little paranoic but maybe we are trying to insert a new node but we have one already
-        // We will overwrite because it is garbage
-        lln = list->findNode(srcAlias);
-        if (lln == NULL) lln = list->insertNode();
-
-        // Fill with data
-        lln->alias = srcAlias;
-        memcpy(lln->data, data, len);
-        lln->len = len;
-        break;
-
-      case 1:
-        // Update a node with newly arrived data
-        lln = list->findNode(srcAlias);
-        if (lln != NULL) {
-          memcpy(&lln->data[lln->len], data, len);
-          lln->len += len;
-        }
-        break;
-
-      case 2:
-        list->deleteNode(srcAlias);
-        break;
-
-      case 3:
-        lln = list->findNode(srcAlias);
-        break;
-    }
+datagramSlot* NetworkTransportLayer::appendToDatagram(uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  // Update a slot with newly arrived data. Rejects frames without a first one
+  // and datagrams growing beyond 72 bytes
+  datagramSlot *slot = incomingDatagrams.findSlot(srcAlias);
+  if (slot == NULL) {
+    reassemblyOutOfOrder++;
+    sendDatagramRejected(srcAlias, DATAGRAM_OUT_OF_ORDER);
+  }
+  else if (slot->len + len > DATAGRAM_MAX_LENGTH) {
+    reassemblyOverflows++;
+    incomingDatagrams.deleteSlot(srcAlias);
+    sendDatagramRejected(srcAlias, DATAGRAM_PERMANENT_ERROR);
+    slot = NULL;
+  }
+  else {
+    memcpy(&slot->data[slot->len], data, len);
+    slot->len += len;
   }
 
-  return lln;
+  return slot;
 }
 
 bool NetworkTransportLayer::isMessageForUs(uint8_t data[], uint8_t len) {
@@ -115,101 +148,214 @@ bool NetworkTransportLayer::isMessageForUs(uint8_t data[], uint8_t len) {
   return false;
 }
 
+void NetworkTransportLayer::setMessageDispatch(const MtiDispatchClass *dispatch, void *application) {
+  messageDispatch = dispatch;
+  applicationLayer = application;
+}
+
+// One lookup. MTIs nobody registered are dropped: optional interaction
+// rejected, terminate due to error, protocol support reply...
 void NetworkTransportLayer::processGlobalAndAddressedMessage(uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len) {
-  switch (mti_or_dst) {
-    case VERIFY_NODE_ID_ADDRESSED:
-      // Addressed message. First 2 bytes of data contains aliasID targeted
-      if (isMessageForUs(data, len)) {
-        sendMessage(VERIFIED_NODE_ID_FULL, UID_array, 6);
-      }
-      break;
-      
-    case VERIFY_NODE_ID_GLOBAL:
-      // If there is no NodeID it is a message for everybody: answer it
-      if (len == 0) {
-        sendMessage(VERIFIED_NODE_ID_FULL, UID_array, 6);
-      }
-      // If there is a NodeID, check it is for us
-      else if (len == 6 &&
-               data[0] == UID_array[0] && data[1] == UID_array[1] && data[2] == UID_array[2] &&
-               data[3] == UID_array[3] && data[4] == UID_array[4] && data[5] == UID_array[5]) {
-        sendMessage(VERIFIED_NODE_ID_FULL, UID_array, 6);    
-      }
-      break;
-      
-    case PROTOCOL_SUPPORT_INQUIRY:
-      if (isMessageForUs(data, len)) {
-        uint32_t supported = DATAGRAM_PROTOCOL + MEMORY_CONFIGURATION_PROTOCOL + ABREVIATED_DEFAULT_CDI_PROTOCOL +
-                             SIMPLE_NODE_INFORMATION_PROTOCOL + CONFIGURATION_DESCRIPTION_INFORMATION;
-        uint8_t supported_data[8];
-        supported_data[0] = ((srcAlias & 0x0F00) >> 8);
-        supported_data[1] = srcAlias & 0xFF;
-        supported_data[2] = ((supported & 0xFF0000) >> 16);
-        supported_data[3] = ((supported & 0x00FF00) >> 8);
-        supported_data[4] =  (supported & 0x0000FF);
-        supported_data[5] = 0;
-        supported_data[6] = 0;
-        supported_data[7] = 0;
-        sendMessage(PROTOCOL_SUPPORT_REPLY, supported_data, 8);  
-      }
-      break;
+  const mtiHandler *handler = messageDispatch->find(mti_or_dst);
+  if (handler == NULL) return;
 
-    // Nothing to do with other messages
-    case INIT_COMPLETE_FULL:
-    case INIT_COMPLETE_SIMPLE:
-    case VERIFIED_NODE_ID_FULL:
-    case VERIFIED_NODE_ID_SIMPLE:
-    case OPTIONAL_INTERACTION_REJ:
-    case TERMINATE_DUE_TO_ERROR:
-    case PROTOCOL_SUPPORT_REPLY:
-      break;
+  // Addressed message. First 2 bytes of data contains aliasID targeted
+  if ((handler->flags & MTI_ADDRESSED) && !isMessageForUs(data, len)) return;
 
-    case DATAGRAM_RECEIVED_OK:
-      linkedListOperation(2, &outgoingDatagrams, srcAlias, data, len);
-      break;
+  if (handler->flags & MTI_APPLICATION) {
+    TRACE(TRACE_APP_MESSAGE, mti_or_dst);
+    handler->handle(applicationLayer, mti_or_dst, srcAlias, data, len);
+    TRACE(TRACE_APP_MESSAGE_END, mti_or_dst);
+  }
+  else {
+    handler->handle(this, mti_or_dst, srcAlias, data, len);
+  }
+}
 
-    case DATAGRAM_REJECTED:
-      if (len >= 4) {
-        if ((data[2] & 0xF0) == 0x20) {  // If it's a temporal error resend it
-          linkedListNode *lln = linkedListOperation(3, &outgoingDatagrams, srcAlias, data, len);  // Find node
-          if (lln != NULL) {
-            fragmentDatagramAndSend(lln->alias, lln->data, lln->len);
-          }
-        }
-      }
-      break;
+void NetworkTransportLayer::verifyNodeIDAddressed(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  sendMessage(VERIFIED_NODE_ID_FULL, frameTransferLayer.nodeID, 6);
+}
 
-    // Maybe it is a message for the application layer. We will check if it is for us
-    // There should be Destination ID bit == 1 in MTI and a 2 byte data alias 
-    default:
-      if ((mti_or_dst & 0x0008) > 0 && isMessageForUs(data, len)) {
-        appListener->processApplicationMessage(mti_or_dst, srcAlias, data, len);
+void NetworkTransportLayer::verifyNodeIDGlobal(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  // If there is no NodeID it is a message for everybody: answer it
+  if (len == 0) {
+    sendMessage(VERIFIED_NODE_ID_FULL, frameTransferLayer.nodeID, 6);
+  }
+  // If there is a NodeID, check it is for us
+  else if (len == 6 &&
+           data[0] == frameTransferLayer.nodeID[0] && data[1] == frameTransferLayer.nodeID[1] && data[2] == frameTransferLayer.nodeID[2] &&
+           data[3] == frameTransferLayer.nodeID[3] && data[4] == frameTransferLayer.nodeID[4] && data[5] == frameTransferLayer.nodeID[5]) {
+    sendMessage(VERIFIED_NODE_ID_FULL, frameTransferLayer.nodeID, 6);    
+  }
+}
+
+void NetworkTransportLayer::protocolSupportInquiry(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  uint32_t supported = DATAGRAM_PROTOCOL + MEMORY_CONFIGURATION_PROTOCOL + ABREVIATED_DEFAULT_CDI_PROTOCOL +
+                       SIMPLE_NODE_INFORMATION_PROTOCOL + CONFIGURATION_DESCRIPTION_INFORMATION +
+                       PRODUCER_CONSUMER_PROTOCOL + STREAM_PROTOCOL;
+  uint8_t supported_data[8];
+  supported_data[0] = ((srcAlias & 0x0F00) >> 8);
+  supported_data[1] = srcAlias & 0xFF;
+  supported_data[2] = ((supported & 0xFF0000) >> 16);
+  supported_data[3] = ((supported & 0x00FF00) >> 8);
+  supported_data[4] =  (supported & 0x0000FF);
+  supported_data[5] = 0;
+  supported_data[6] = 0;
+  supported_data[7] = 0;
+  sendMessage(PROTOCOL_SUPPORT_REPLY, supported_data, 8);  
+}
+
+// Other nodes telling who they are
+void NetworkTransportLayer::nodeIdentified(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  if (len == 6) frameTransferLayer.aliasCache.add(srcAlias, nodeIDFromBytes(data));
+}
+
+void NetworkTransportLayer::datagramReceivedOK(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  outgoingDatagrams.deleteSlot(srcAlias);
+}
+
+void NetworkTransportLayer::datagramRejected(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  if (len >= 4) {
+    datagramSlot *slot = outgoingDatagrams.findSlot(srcAlias);
+    if (slot != NULL) {
+      datagramsRejected++;
+
+      // Temporary error: send it again later, each time waiting longer
+      if ((data[2] & 0xF0) == 0x20 && slot->retries < DATAGRAM_MAX_RETRIES) {
+        slot->backingOff = true;
+        slot->deadline = halMillis() + (DATAGRAM_BACKOFF_MILLIS << slot->retries);
       }
-      break;
+      else {
+        datagramsAbandoned++;
+        outgoingDatagrams.deleteSlot(srcAlias);
+      }
+    }
   }
 }
 
-void NetworkTransportLayer::sendMessage(uint16_t type, uint8_t data[], uint8_t len) {
+// False if its TX queue is full and the message was dropped
+bool NetworkTransportLayer::sendMessage(uint16_t type, uint8_t data[], uint8_t len) {
   uint32_t canHeader = (0x19 << 24) + (type << 12);
-  frameTransferLayer.queueFrame(canHeader, data, len);
+  return frameTransferLayer.queueFrame(canHeader, data, len);
 }
 
 void NetworkTransportLayer::sendDatagram(uint16_t dstAlias, uint8_t data[], uint8_t len, bool ackPreviousDatagram) {
+  uint8_t *buffer = datagramBuffer(dstAlias);
+  if (buffer != NULL) {
+    memcpy(buffer, data, len);
+    sendDatagramBuffer(dstAlias, len, ackPreviousDatagram);
+    return;
+  }
+
+  // No slot to keep it. Sent anyway, frames copied, but it cannot be sent again
+  if (ackPreviousDatagram) sendDatagramOK(dstAlias);
+  fragmentDatagramAndSend(dstAlias, data, len, NULL);
+}
+
+/* -------------------------------------------------------------
+ *  Datagram is stored until it is acknowledged. If the pool is
+ *  exhausted the oldest datagram gives its slot: its destination
+ *  has had plenty of time to answer
+ */
+uint8_t* NetworkTransportLayer::datagramBuffer(uint16_t dstAlias) {
+  // One datagram to that node is still being sent. It keeps its buffer
+  datagramSlot *slot = outgoingDatagrams.findSlot(dstAlias);
+  if (slot != NULL && slot->fragments.pending() > 0) outgoingDatagrams.deleteSlot(dstAlias);
+
+  slot = outgoingDatagrams.insertSlot(dstAlias);
+  if (slot == NULL && evictOldestDatagram(outgoingDatagrams)) {
+    datagramsEvicted++;
+    slot = outgoingDatagrams.insertSlot(dstAlias);
+  }
+  buildingDatagram = slot;
+  return slot != NULL ? slot->data : NULL;
+}
+
+void NetworkTransportLayer::sendDatagramBuffer(uint16_t dstAlias, uint8_t len, bool ackPreviousDatagram) {
   // Send ACK to sender?
   if (ackPreviousDatagram) sendDatagramOK(dstAlias);
 
-  // Store Datagram in dynamic linked list 
-  linkedListOperation(0, &outgoingDatagrams, dstAlias, data, len);
+  datagramSlot *slot = buildingDatagram;
+  if (slot == NULL || !slot->inUse || slot->alias != dstAlias) slot = outgoingDatagrams.findSlot(dstAlias);
+  if (slot == NULL) return;
+  slot->len = len;
+  slot->retries = 0;
+  slot->backingOff = false;
+  slot->timestamp = halMillis();
+  slot->deadline = slot->timestamp + DATAGRAM_ACK_TIMEOUT_MILLIS;
 
   // Now fragment it and queue to send the fragments
-  fragmentDatagramAndSend(dstAlias, data, len);
+  fragmentDatagramAndSend(dstAlias, slot->data, len, &slot->fragments);
+}
+
+void NetworkTransportLayer::retryDatagram(datagramSlot *slot, uint32_t now) {
+  slot->retries++;
+  slot->backingOff = false;
+  slot->timestamp = now;
+  slot->deadline = now + DATAGRAM_ACK_TIMEOUT_MILLIS;
+  datagramsResent++;
+  fragmentDatagramAndSend(slot->alias, slot->data, slot->len, &slot->fragments);
+}
+
+/* -------------------------------------------------------------
+ *  Called from run(). Resends datagrams whose backoff is over and
+ *  the ones nobody answered, and drops them after too many tries
+ */
+void NetworkTransportLayer::sweepOutgoingDatagrams() {
+  if (outgoingDatagrams.used() == 0) return;
+
+  uint32_t now = halMillis();
+  for (int i = 0; i < DATAGRAM_POOL_SIZE; i++) {
+    datagramSlot *slot = outgoingDatagrams.slotAt(i);
+    if (slot == NULL || (int32_t) (now - slot->deadline) < 0) continue;
+
+    // Last try still in the TX queue. Sent from this same buffer: wait for it
+    if (slot->fragments.pending() > 0) continue;
+
+    // Do not resend into a full TX queue, it would lose frames
+    if (frameTransferLayer.queueFree(TX_CLASS_BULK) < 9) return;
+
+    if (!slot->backingOff) datagramsTimedOut++;
+    if (slot->retries < DATAGRAM_MAX_RETRIES) {
+      retryDatagram(slot, now);
+    }
+    else {
+      datagramsAbandoned++;
+      outgoingDatagrams.deleteSlot(slot->alias);
+    }
+  }
 }
 
-void NetworkTransportLayer::fragmentDatagramAndSend(uint16_t dstAlias, uint8_t data[], uint8_t len) {
+// Drops datagrams whose sender stopped in the middle
+void NetworkTransportLayer::sweepIncomingDatagrams(uint32_t now) {
+  for (int i = 0; i < DATAGRAM_POOL_SIZE; i++) {
+    datagramSlot *slot = incomingDatagrams.slotAt(i);
+    if (slot != NULL && (int32_t) (now - slot->deadline) >= 0) {
+      reassemblyTimeouts++;
+      incomingDatagrams.deleteSlot(slot->alias);
+    }
+  }
+}
+
+bool NetworkTransportLayer::evictOldestDatagram(DatagramPoolClass &pool) {
+  datagramSlot *oldest = NULL;
+  for (int i = 0; i < DATAGRAM_POOL_SIZE; i++) {
+    datagramSlot *slot = pool.slotAt(i);
+    if (slot != NULL && (oldest == NULL || (int32_t) (slot->timestamp - oldest->timestamp) < 0)) oldest = slot;
+  }
+
+  if (oldest == NULL) return false;
+  pool.deleteSlot(oldest->alias);
+  return true;
+}
+
+// With references the frames point to data, that must stay
+// until they have been sent. Without them they are copied
+void NetworkTransportLayer::fragmentDatagramAndSend(uint16_t dstAlias, uint8_t data[], uint8_t len, bufferReferences *references) {
   // How many frames will we need to send the datagram?
   if (len <= 8) { // In one frame
     uint32_t canHeader = (0x1A << 24) + (dstAlias << 12);
-    frameTransferLayer.queueFrame(canHeader, data, len);
+    frameTransferLayer.queueFrame(canHeader, data, len, references);
   }
   else if (len <= 72) { // Max number of frames for datagrams are 9 (72 bytes)
     // How many frames are we going to send?
@@ -222,15 +368,15 @@ void NetworkTransportLayer::fragmentDatagramAndSend(uint16_t dstAlias, uint8_t d
     for (int i = 0; i < numberFrames; i++) {
       if (i == 0) {  // First frame
         canHeader = (0x1B << 24) + (dstAlias << 12);
-        frameTransferLayer.queueFrame(canHeader, &data[i], 8);
+        frameTransferLayer.queueFrame(canHeader, &data[i], 8, references);
       }
       else if (i + 1 == numberFrames) {  // Last frame
         canHeader = (0x1D << 24) + (dstAlias << 12);
-        frameTransferLayer.queueFrame(canHeader, &data[i * 8], lastFrameSize);
+        frameTransferLayer.queueFrame(canHeader, &data[i * 8], lastFrameSize, references);
       }
       else {  // Middle frame
         canHeader = (0x1C << 24) + (dstAlias << 12);
-        frameTransferLayer.queueFrame(canHeader, &data[i * 8], 8);
+        frameTransferLayer.queueFrame(canHeader, &data[i * 8], 8, references);
       }
     }
   }
@@ -248,3 +394,248 @@ void NetworkTransportLayer::sendDatagramRejected(uint16_t dstAlias, uint16_t err
                           (uint8_t) ((errorCode & 0xFF00) >> 8), (uint8_t) (errorCode & 0xFF)};
   sendMessage(DATAGRAM_REJECTED, data2send, 4);
 }
+
+void NetworkTransportLayer::datagramStatistics(uint8_t &incomingInUse, uint8_t &outgoingInUse) {
+  incomingInUse = incomingDatagrams.used();
+  outgoingInUse = outgoingDatagrams.used();
+}
+
+/* -------------------------------------------------------------
+ *  Streams
+ */
+
+// Returns our source stream ID, or STREAM_NONE if all outgoing
+// streams are busy. Data is read in place until the stream is over
+uint8_t NetworkTransportLayer::openOutgoingStream(uint16_t dstAlias, uint8_t dstStreamID, const uint8_t data[], uint32_t length) {
+  for (int i = 0; i < STREAM_OUTGOING; i++) {
+    streamSlot *stream = &outgoingStreams[i];
+    if (stream->state == STREAM_FREE) {
+      stream->alias = dstAlias;
+      stream->sourceID = i;
+      stream->destinationID = dstStreamID;
+      stream->data = data;
+      stream->length = length;
+      stream->position = 0;
+      stream->window = 0;
+      stream->windowUsed = 0;
+      stream->lastActivity = halMillis();
+
+      // Stream Initiate Request is sent from run(), after the
+      // caller has sent whatever announces the stream
+      stream->state = STREAM_PENDING;
+      return stream->sourceID;
+    }
+  }
+
+  return STREAM_NONE;
+}
+
+// Get ready to accept the stream that srcAlias will initiate. Returns
+// our destination stream ID, or STREAM_NONE if all incoming streams are busy
+uint8_t NetworkTransportLayer::openIncomingStream(uint16_t srcAlias, uint8_t srcStreamID) {
+  for (int i = 0; i < STREAM_INCOMING; i++) {
+    streamSlot *stream = &incomingStreams[i];
+    if (stream->state == STREAM_FREE) {
+      stream->alias = srcAlias;
+      stream->sourceID = srcStreamID;
+      stream->destinationID = 0x80 + i;
+      stream->position = 0;
+      stream->window = 0;
+      stream->windowUsed = 0;
+      stream->lastActivity = halMillis();
+      stream->state = STREAM_PENDING;
+      return stream->destinationID;
+    }
+  }
+
+  return STREAM_NONE;
+}
+
+void NetworkTransportLayer::processStreamMessage(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  switch (mti) {
+    // Somebody wants to send us a stream. Only expected ones are accepted
+    case STREAM_INITIATE_REQUEST:
+      if (len >= 7) {
+        uint16_t bufferSize = (data[2] << 8) + data[3];
+        uint8_t srcStreamID = data[6];
+        streamSlot *stream = NULL;
+        for (int i = 0; i < STREAM_INCOMING; i++) {
+          if (incomingStreams[i].state == STREAM_PENDING && incomingStreams[i].alias == srcAlias &&
+              incomingStreams[i].sourceID == srcStreamID) {
+            stream = &incomingStreams[i];
+          }
+        }
+
+        uint16_t flags = STREAM_NOT_ACCEPTED;
+        uint8_t dstStreamID = STREAM_NONE;
+        if (stream != NULL && bufferSize > 0) {
+          if (bufferSize > STREAM_BUFFER_SIZE) bufferSize = STREAM_BUFFER_SIZE;
+          stream->window = bufferSize;
+          stream->lastActivity = halMillis();
+          stream->state = STREAM_OPEN;
+          flags = STREAM_ACCEPT;
+          dstStreamID = stream->destinationID;
+        }
+        else {
+          bufferSize = 0;
+        }
+
+        uint8_t reply[8] = { (uint8_t) ((srcAlias & 0x0F00) >> 8), (uint8_t) (srcAlias & 0xFF),
+                             (uint8_t) (bufferSize >> 8), (uint8_t) (bufferSize & 0xFF),
+                             (uint8_t) (flags >> 8), (uint8_t) (flags & 0xFF), srcStreamID, dstStreamID };
+        sendMessage(STREAM_INITIATE_REPLY, reply, 8);
+      }
+      break;
+
+    // Our request was answered
+    case STREAM_INITIATE_REPLY:
+      if (len >= 7) {
+        for (int i = 0; i < STREAM_OUTGOING; i++) {
+          streamSlot *stream = &outgoingStreams[i];
+          if (stream->state == STREAM_INITIATED && stream->alias == srcAlias && stream->sourceID == data[6]) {
+            uint16_t bufferSize = (data[2] << 8) + data[3];
+            if ((data[4] & 0x80) > 0 && bufferSize > 0) {
+              if (bufferSize > STREAM_BUFFER_SIZE) bufferSize = STREAM_BUFFER_SIZE;
+              if (len >= 8 && data[7] != STREAM_NONE) stream->destinationID = data[7];
+              stream->window = bufferSize;
+              stream->windowUsed = 0;
+              stream->lastActivity = halMillis();
+              stream->state = STREAM_OPEN;
+            }
+            else {
+              stream->state = STREAM_FREE;  // Rejected
+            }
+          }
+        }
+      }
+      break;
+
+    // Receiver consumed the window. Go on
+    case STREAM_DATA_PROCEED:
+      if (len >= 3) {
+        for (int i = 0; i < STREAM_OUTGOING; i++) {
+          streamSlot *stream = &outgoingStreams[i];
+          if (stream->state == STREAM_WAIT_PROCEED && stream->alias == srcAlias && stream->sourceID == data[2]) {
+            stream->windowUsed = 0;
+            stream->lastActivity = halMillis();
+            stream->state = STREAM_OPEN;
+          }
+        }
+      }
+      break;
+
+    // Sender has finished
+    case STREAM_DATA_COMPLETE:
+      if (len >= 4) {
+        for (int i = 0; i < STREAM_INCOMING; i++) {
+          streamSlot *stream = &incomingStreams[i];
+          if (stream->state == STREAM_OPEN && stream->alias == srcAlias && stream->destinationID == data[3]) {
+            closeIncomingStream(stream, true);
+          }
+        }
+      }
+      break;
+  }
+}
+
+void NetworkTransportLayer::processStreamFrame(uint16_t srcAlias, uint8_t data[], uint8_t len) {
+  if (len < 2) return;
+
+  for (int i = 0; i < STREAM_INCOMING; i++) {
+    streamSlot *stream = &incomingStreams[i];
+    if (stream->state == STREAM_OPEN && stream->alias == srcAlias && stream->destinationID == data[0]) {
+      appListener->processStreamData(srcAlias, stream->destinationID, &data[1], len - 1);
+      stream->position += len - 1;
+      stream->windowUsed += len - 1;
+      stream->lastActivity = halMillis();
+
+      // Window consumed. Ask for the next one
+      if (stream->windowUsed >= stream->window) {
+        stream->windowUsed = 0;
+        uint8_t proceed[6] = { (uint8_t) ((srcAlias & 0x0F00) >> 8), (uint8_t) (srcAlias & 0xFF),
+                               stream->sourceID, stream->destinationID, 0, 0 };
+        sendMessage(STREAM_DATA_PROCEED, proceed, 6);
+      }
+      return;
+    }
+  }
+}
+
+void NetworkTransportLayer::closeIncomingStream(streamSlot *stream, bool completed) {
+  stream->state = STREAM_FREE;
+  appListener->streamClosed(stream->alias, stream->destinationID, completed);
+}
+
+/* -------------------------------------------------------------
+ *  Called from run(). Moves outgoing streams forward a few frames
+ *  at a time, always leaving room in the TX queue for other
+ *  messages, and closes streams the other end has abandoned
+ */
+void NetworkTransportLayer::sendStreams() {
+  uint32_t now = halMillis();
+
+  // Stream control messages are addressed messages and would overtake datagram
+  // or stream frames still queued in the bulk class. They wait for them
+  bool bulkQueued = frameTransferLayer.queueFree(TX_CLASS_BULK) < TX_QUEUE_SIZE;
+
+  for (int i = 0; i < STREAM_OUTGOING; i++) {
+    streamSlot *stream = &outgoingStreams[i];
+    uint8_t dst[2] = { (uint8_t) ((stream->alias & 0x0F00) >> 8), (uint8_t) (stream->alias & 0xFF) };
+
+    switch (stream->state) {
+      case STREAM_PENDING: {
+        if (bulkQueued) break;
+        uint8_t request[8] = { dst[0], dst[1], (uint8_t) (STREAM_BUFFER_SIZE >> 8), (uint8_t) (STREAM_BUFFER_SIZE & 0xFF),
+                               0, 0, stream->sourceID, stream->destinationID };
+        sendMessage(STREAM_INITIATE_REQUEST, request, 8);
+        stream->lastActivity = now;
+        stream->state = STREAM_INITIATED;
+        break;
+      }
+
+      case STREAM_OPEN: {
+        uint32_t header = (0x1F << 24) + (stream->alias << 12);
+        for (int frames = 0; frames < STREAM_FRAMES_PER_RUN; frames++) {
+          if (stream->position == stream->length || stream->windowUsed == stream->window) break;
+          if (frameTransferLayer.queueFree(TX_CLASS_BULK) <= STREAM_TX_RESERVE) break;
+
+          uint32_t size = stream->length - stream->position;
+          if (size > 7) size = 7;
+          if (size > (uint32_t) (stream->window - stream->windowUsed)) size = stream->window - stream->windowUsed;
+          uint8_t frame[8] = { stream->destinationID };
+          memcpy(&frame[1], &stream->data[stream->position], size);
+          if (!frameTransferLayer.queueFrame(header, frame, size + 1)) break;
+
+          stream->position += size;
+          stream->windowUsed += size;
+          stream->lastActivity = now;
+        }
+
+        if (stream->position == stream->length) {
+          if (frameTransferLayer.queueFree(TX_CLASS_BULK) < TX_QUEUE_SIZE) break;
+          uint8_t complete[8] = { dst[0], dst[1], stream->sourceID, stream->destinationID,
+                                  (uint8_t) (stream->length >> 24), (uint8_t) (stream->length >> 16),
+                                  (uint8_t) (stream->length >> 8), (uint8_t) (stream->length & 0xFF) };
+          sendMessage(STREAM_DATA_COMPLETE, complete, 8);
+          stream->state = STREAM_FREE;
+        }
+        else if (stream->windowUsed == stream->window) {
+          stream->state = STREAM_WAIT_PROCEED;
+        }
+        break;
+      }
+
+      case STREAM_INITIATED:
+      case STREAM_WAIT_PROCEED:
+        if (now - stream->lastActivity > STREAM_TIMEOUT_MILLIS) stream->state = STREAM_FREE;
+        break;
+    }
+  }
+
+  for (int i = 0; i < STREAM_INCOMING; i++) {
+    streamSlot *stream = &incomingStreams[i];
+    if (stream->state != STREAM_FREE && now - stream->lastActivity > STREAM_TIMEOUT_MILLIS) {
+      closeIncomingStream(stream, false);
+    }
+  }
+}
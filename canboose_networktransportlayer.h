@@ -1,14 +1,17 @@
 #ifndef __CANBOOSE_NETWORKTRANSPORTLAYER_H__
 #define __CANBOOSE_NETWORKTRANSPORTLAYER_H__
 
-#include "Arduino.h"
-#include "canboose_linkedlist.h"
+#include "canboose_hal.h"
+#include "canboose_datagrampool.h"
 #include "canboose_frametransferlayer.h"
+#include "canboose_mtidispatch.h"
 
+// Messages go to the handlers in the dispatch table, datagrams and streams here
 class ApplicationListener {
   public:
-    virtual void processApplicationMessage(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
-    virtual void processApplicationDatagram(uint16_t srcAlias, uint8_t data[], uint8_t len);
+    virtual void processApplicationDatagram(uint16_t srcAlias, uint8_t data[], uint8_t len) = 0;
+    virtual void processStreamData(uint16_t srcAlias, uint8_t streamID, uint8_t data[], uint8_t len) = 0;
+    virtual void streamClosed(uint16_t srcAlias, uint8_t streamID, bool completed) = 0;
 };
 
 /* -------------------------------------------------------------
@@ -75,28 +78,154 @@ class ApplicationListener {
 #define DATAGRAM_RECEIVED_OK      0xA28
 #define DATAGRAM_REJECTED         0xA48
 
+// Temporary errors. Sender should try again
+#define DATAGRAM_BUFFER_UNAVAILABLE   0x2020
+#define DATAGRAM_OUT_OF_ORDER         0x2040
+
+// Sent datagrams are kept until acknowledged. No answer in time or a temporary
+// rejection makes us send it again, waiting twice as long every time, up to a limit
+#define DATAGRAM_ACK_TIMEOUT_MILLIS   3000
+#define DATAGRAM_BACKOFF_MILLIS       50      // First wait after a temporary rejection
+#define DATAGRAM_MAX_RETRIES          4
+
+// Datagrams being received. One per source node at most (only one datagram can be in flight
+// between two nodes) and DATAGRAM_POOL_SIZE in total. Each must be complete within the timeout
+#define DATAGRAM_REASSEMBLY_MILLIS    3000
+#define DATAGRAM_MAX_LENGTH           72
+#define DATAGRAM_PERMANENT_ERROR      0x1000
+
+/* -------------------------------------------------------------
+ * Stream Transport
+ *
+ * Bulk transfers without a round trip every 72 bytes. The receiver
+ * grants a window (buffer size) and sends a Proceed each time it has
+ * consumed it. Data frames carry the destination stream ID in byte 0
+ * and 7 bytes of payload.
+ */
+
+#define STREAM_INITIATE_REQUEST   0xCC8
+#define STREAM_INITIATE_REPLY     0x868
+#define STREAM_DATA_PROCEED       0x888
+#define STREAM_DATA_COMPLETE      0x8A8
+
+#define STREAM_ACCEPT             0x8000
+#define STREAM_NOT_ACCEPTED       0x1080  // Permanent error
+
+#ifndef STREAM_BUFFER_SIZE
+#define STREAM_BUFFER_SIZE        2048    // Window offered to and accepted from other nodes. No RAM behind it:
+                                          // sent data is read in place, received data goes to the mirror
+#endif
+#define STREAM_OUTGOING           2       // Simultaneous streams sent
+#define STREAM_INCOMING           2       // Simultaneous streams received
+#define STREAM_FRAMES_PER_RUN     8       // Data frames queued in each run()
+#define STREAM_TX_RESERVE         12      // Bulk TX queue entries always left for datagrams
+#define STREAM_TIMEOUT_MILLIS     3000    // Silent streams are closed
+#define STREAM_NONE               0xFF    // No stream ID
+
+#define STREAM_FREE               0
+#define STREAM_PENDING            1       // Outgoing: initiate to be sent. Incoming: initiate expected
+#define STREAM_INITIATED          2       // Outgoing: waiting for the initiate reply
+#define STREAM_OPEN               3
+#define STREAM_WAIT_PROCEED       4       // Outgoing: window used, waiting for a proceed
+
+struct streamSlot {
+  uint16_t       alias;           // Remote node
+  uint8_t        sourceID;
+  uint8_t        destinationID;
+  uint8_t        state;
+  const uint8_t *data;            // Outgoing: what we send, read in place
+  uint32_t       length;
+  uint32_t       position;
+  uint16_t       window;          // Buffer size agreed
+  uint16_t       windowUsed;      // Bytes since last proceed
+  uint32_t       lastActivity;    // halMillis()
+};
+
 class NetworkTransportLayer : public NetworkTransportListener {
   public:
-    void init(ApplicationListener *listener);
+    void init(ApplicationListener *listener, CanDriver *driver, const uint8_t *nodeID = UID_array, uint16_t lastAlias = 0);
+
+    // Table with the handlers of this layer and the application ones, and the application
+    // layer they get. Must be given before init()
+    void setMessageDispatch(const MtiDispatchClass *dispatch, void *application);
+    static constexpr void registerMessageHandlers(MtiDispatchClass &dispatch) {
+      dispatch.add(VERIFY_NODE_ID_ADDRESSED, MTI_ADDRESSED, MTI_HANDLER(NetworkTransportLayer, verifyNodeIDAddressed));
+      dispatch.add(VERIFY_NODE_ID_GLOBAL,    MTI_GLOBAL,    MTI_HANDLER(NetworkTransportLayer, verifyNodeIDGlobal));
+      dispatch.add(PROTOCOL_SUPPORT_INQUIRY, MTI_ADDRESSED, MTI_HANDLER(NetworkTransportLayer, protocolSupportInquiry));
+      dispatch.add(INIT_COMPLETE_FULL,       MTI_GLOBAL,    MTI_HANDLER(NetworkTransportLayer, nodeIdentified));
+      dispatch.add(INIT_COMPLETE_SIMPLE,     MTI_GLOBAL,    MTI_HANDLER(NetworkTransportLayer, nodeIdentified));
+      dispatch.add(VERIFIED_NODE_ID_FULL,    MTI_GLOBAL,    MTI_HANDLER(NetworkTransportLayer, nodeIdentified));
+      dispatch.add(VERIFIED_NODE_ID_SIMPLE,  MTI_GLOBAL,    MTI_HANDLER(NetworkTransportLayer, nodeIdentified));
+      dispatch.add(STREAM_INITIATE_REQUEST,  MTI_ADDRESSED, MTI_HANDLER(NetworkTransportLayer, processStreamMessage));
+      dispatch.add(STREAM_INITIATE_REPLY,    MTI_ADDRESSED, MTI_HANDLER(NetworkTransportLayer, processStreamMessage));
+      dispatch.add(STREAM_DATA_PROCEED,      MTI_ADDRESSED, MTI_HANDLER(NetworkTransportLayer, processStreamMessage));
+      dispatch.add(STREAM_DATA_COMPLETE,     MTI_ADDRESSED, MTI_HANDLER(NetworkTransportLayer, processStreamMessage));
+      dispatch.add(DATAGRAM_RECEIVED_OK,     MTI_ADDRESSED, MTI_HANDLER(NetworkTransportLayer, datagramReceivedOK));
+      dispatch.add(DATAGRAM_REJECTED,        MTI_ADDRESSED, MTI_HANDLER(NetworkTransportLayer, datagramRejected));
+    }
+
+    void run();
     void initializationComplete();
+    void aliasReleased(uint16_t alias);
     void processLCCMessage(uint8_t frameType, uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len);
     void processGlobalAndAddressedMessage(uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len);
-    void sendMessage(uint16_t type, uint8_t data[], uint8_t len);
+    bool sendMessage(uint16_t type, uint8_t data[], uint8_t len);
     void sendDatagram(uint16_t dstAlias, uint8_t data[], uint8_t len, bool ackPreviousDatagram);
+
+    // Datagrams built in place: the buffer kept for retries, that the fragments are sent from.
+    // NULL if there is none available, then use sendDatagram()
+    uint8_t* datagramBuffer(uint16_t dstAlias);
+    void sendDatagramBuffer(uint16_t dstAlias, uint8_t len, bool ackPreviousDatagram);
     void sendDatagramOK(uint16_t dstAlias);
     void sendDatagramRejected(uint16_t dstAlias, uint16_t errorCode);
+    uint8_t openOutgoingStream(uint16_t dstAlias, uint8_t dstStreamID, const uint8_t data[], uint32_t length);
+    uint8_t openIncomingStream(uint16_t srcAlias, uint8_t srcStreamID);
+    uint16_t aliasForNode(uint64_t nodeID);
+    void datagramStatistics(uint8_t &incomingInUse, uint8_t &outgoingInUse);
 
     FrameTransferLayer frameTransferLayer;
+
+    // Outgoing datagrams
+    uint32_t datagramsResent = 0;
+    uint32_t datagramsTimedOut = 0;       // No answer in time
+    uint32_t datagramsRejected = 0;       // Rejected by the other node, temporary or not
+    uint32_t datagramsAbandoned = 0;      // Too many retries or permanent rejection
+    uint32_t datagramsEvicted = 0;        // Pool full, oldest one dropped
+
+    // Incoming datagrams
+    uint32_t reassemblyTimeouts = 0;      // Sender stopped in the middle
+    uint32_t reassemblyOverflows = 0;     // More than 72 bytes
+    uint32_t reassemblyOutOfOrder = 0;    // Frames without a first one, or a new start over an unfinished one
+    uint32_t reassemblyPoolFull = 0;      // Rejected, try later
     
   private:
     bool isMessageForUs(uint8_t data[], uint8_t len);
+    void verifyNodeIDAddressed(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void verifyNodeIDGlobal(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void protocolSupportInquiry(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void nodeIdentified(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void datagramReceivedOK(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void datagramRejected(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
     bool isDatagramForUs(uint16_t dstAlias);
-    linkedListNode* linkedListOperation(uint8_t opType, LinkedListClass *list, uint16_t srcAlias, uint8_t data[], uint8_t len);
-    void fragmentDatagramAndSend(uint16_t dstAlias, uint8_t data[], uint8_t len);
+    datagramSlot* appendToDatagram(uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void fragmentDatagramAndSend(uint16_t dstAlias, uint8_t data[], uint8_t len, bufferReferences *references);
+    void retryDatagram(datagramSlot *slot, uint32_t now);
+    void sweepOutgoingDatagrams();
+    void sweepIncomingDatagrams(uint32_t now);
+    bool evictOldestDatagram(DatagramPoolClass &pool);
+    void processStreamMessage(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void processStreamFrame(uint16_t srcAlias, uint8_t data[], uint8_t len);
+    void sendStreams();
+    void closeIncomingStream(streamSlot *stream, bool completed);
     
     ApplicationListener *appListener;
-    LinkedListClass outgoingDatagrams;
-    LinkedListClass incomingDatagrams;
+    const MtiDispatchClass *messageDispatch;
+    void *applicationLayer;
+    DatagramPoolClass outgoingDatagrams;
+    datagramSlot *buildingDatagram = NULL;    // Last datagramBuffer()
+    DatagramPoolClass incomingDatagrams;
+    streamSlot outgoingStreams[STREAM_OUTGOING];
+    streamSlot incomingStreams[STREAM_INCOMING];
 };
 
 #endif
@@ -4,37 +4,30 @@
 
 #include <FlexCAN.h>
 #include <util/atomic.h>
+#include "canboose_applicationlayer.h"
 
 uint8_t UID_array[6] = { 0x05, 0x01, 0x01, 0x01, 0x2D, 0x00 };
 
+TeensyCanDriver canDriver;
+EepromStorage eepromStorage;
 ApplicationLayer app;
 
 /* -------------------------------------------------------------
  *  Init in setup. Everything else asynchronous
  */
-void setup(void) {  
+void setup(void) {
   Serial.begin(9600);
-  Serial.println("Canboose Node v1.0"); 
+  Serial.println("Canboose Node v1.0");
 
-  app.init();
-}
-
-void proxyCheckID() {
-  app.network.frameTransferLayer.checkID();
-}
-
-void proxyReserveID() {
-  app.network.frameTransferLayer.reserveID();
-}
-
-void proxySendQueue() {
-  app.network.frameTransferLayer.sendQueuedFrames();
+  if (!app.init(&canDriver, &eepromStorage)) {
+    Serial.println("EEPROM too small for user and configuration spaces, node stopped");
+  }
 }
 
 /* -------------------------------------------------------------
  *  Loop event
- *  Empty
+ *  Received frames are processed here
  */
 void loop(void) {
-
+  app.run();
 }
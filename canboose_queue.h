@@ -1,33 +1,105 @@
 #ifndef __CANBOOSE_QUEUE_H__
 #define __CANBOOSE_QUEUE_H__
 
-#include "Arduino.h"
+#include "canboose_hal.h"
 
 /* --------------------------------------------------------------------------------------------------------
- *  A dynamic queue to store frames to be sent. When using protocols like Simple Node Information
+ *  A fixed size queue to store frames to be sent. When using protocols like Simple Node Information
  *  the buffer inside FlexCan Libreary is not enough. It can store up to 16 CAN Frames.
- *  Application protocols use datagrams and can send up to 9 frames, so we need a FIFO queue to 
+ *  Application protocols use datagrams and can send up to 9 frames, so we need a FIFO queue to
  *  store these messages and send them when FlexCAN TX buffer has capacity again.
  *
- *  We start a timer every 2 ms. to fill CAN TX ring buffer. We stop this timer when there are
- *  no more messages to send. So this queue uses memory in cases when we have a lot of traffic.
+ *  It is a single producer / single consumer ring: the producer only writes tail and the consumer
+ *  only writes head, so there is no need to disable interrupts and nothing is allocated.
+ *  When the ring is full the frame is dropped and counted as an overflow.
+ *
+ *  The frame transfer layer keeps one of these queues per priority class.
+ *
+ *  A frame can also be a descriptor of a slice of a buffer that lives elsewhere (a datagram
+ *  waiting for its acknowledge): data is not copied, payload points to it. The buffer owner
+ *  knows it can reuse it when every frame queued from it has gone to the CAN driver.
  */
+#ifndef TX_QUEUE_SIZE
+#define TX_QUEUE_SIZE   32      // Frames. Must be a power of two
+#endif
+
+// Frames queued from a shared buffer and frames already sent from it. Like the ring indexes,
+// the producer only writes queued and the consumer only writes sent
+struct bufferReferences {
+  volatile uint8_t queued;
+  volatile uint8_t sent;
+
+  uint8_t pending() { return queued - sent; }
+};
+
 struct queueNode {
   uint32_t header;
-  uint8_t data[8];
+  union {
+    uint8_t data[8];
+    const uint8_t *payload;       // With references: frame data is in a shared buffer
+  };
   uint8_t len;
-  queueNode *next;
+  bufferReferences *references;   // Of the shared buffer. NULL: frame data is in data
+  uint32_t queuedMicros;  // halMicros() when it was queued. Latency statistics and starvation
 };
 
-class QueueClass {
+template <typename T, uint16_t SIZE>
+class RingQueueClass {
+  static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "Ring size must be a power of two");
+
   public:
-    queueNode* push();
-    queueNode* readFront();
-    void deleteFront();
-    
+    /* -------------------------------------------------------------
+     *  Producer side. Fill the slot returned by pushSlot() and then
+     *  make it visible to the consumer with commitPush()
+     */
+    T* pushSlot() {
+      uint16_t t = tail;
+      if ((uint16_t) (t - head) == SIZE) {
+        overflows++;
+        return NULL;
+      }
+      return &slots[t & (SIZE - 1)];
+    }
+
+    void commitPush() {
+      __sync_synchronize();  // Slot contents written before the new tail
+      tail = tail + 1;
+      uint16_t used = tail - head;
+      if (used > highWater) highWater = used;
+    }
+
+    /* -------------------------------------------------------------
+     *  Consumer side. Read front element and delete it only when
+     *  it has been processed
+     */
+    T* readFront() {
+      if (head == tail) return NULL;
+      __sync_synchronize();  // Tail read before the slot contents
+      return &slots[head & (SIZE - 1)];
+    }
+
+    void deleteFront() {
+      if (head != tail) {
+        __sync_synchronize();  // Slot contents read before it is released
+        head = head + 1;
+      }
+    }
+
+    uint16_t count() {
+      return tail - head;
+    }
+
+    uint16_t capacity() {
+      return SIZE;
+    }
+
+    volatile uint32_t overflows = 0;
+    volatile uint16_t highWater = 0;
+
   private:
-    queueNode *front = NULL;
-    queueNode *rear = NULL;
+    T slots[SIZE];
+    volatile uint16_t head = 0;  // Written by the consumer only
+    volatile uint16_t tail = 0;  // Written by the producer only
 };
 
 #endif
@@ -0,0 +1,72 @@
+/*
+ * Runtime statistics, readable by any configuration tool from a vendor Memory Configuration space.
+ *
+ * Counters on the frame path live in frameCounters and are plain increments: no locks, a reader
+ * may see a value one frame old but never a torn one. The other layers keep their own counters.
+ * A read of STATISTICS_SPACE takes a snapshot of all of them as 32 bit big endian values, in
+ * the order below. Address = 4 * index. The space is read only.
+ *
+ *    0  Layout version (STATISTICS_VERSION)
+ *    1  Uptime, milliseconds
+ *  2-9  Frames received by frame type (*)
+ * 10-17 Frames sent by frame type (*)
+ *   18  Event reports dropped by the event filter
+ *   19  RX queue overflows
+ *   20  RX queue high water
+ * 21-24 TX queue high water: control, event, addressed, bulk
+ *   25  TX queue overflows, all classes
+ *   26  Alias collisions
+ *   27  Aliases in the alias cache
+ * 28-29 Alias cache hits, misses
+ *   30  Reassembly slots in use
+ *   31  Outgoing datagrams waiting for OK
+ *   32  Datagrams resent
+ *   33  Datagrams rejected by the other node
+ *   34  Datagrams abandoned
+ *   35  Datagrams timed out
+ * 36-39 Reassembly timeouts, overflows, frames out of order, rejected with pool full
+ *   40  CAN interrupts, RX and TX complete
+ *   41  Time in CAN interrupts, microseconds
+ *   42  Longest CAN interrupt, microseconds
+ *   43  Heap in use, bytes
+ * 44-45 EEPROM flushes, bytes written
+ *
+ * (*) Index 0 is CAN control frames (CID, RID, AMD, AME, AMR), 1 global and addressed
+ *     messages, 2-5 datagram frames, 7 stream data.
+ *
+ * Built with -DCANBOOSE_TRACE the flight recorder (canboose_trace.h) follows at
+ * STATISTICS_TRACE_OFFSET: trace ticks per microsecond, records in the ring and records since
+ * start, 32 bits each, then the records oldest first, 8 bytes each: ticks (32 bits), point,
+ * 0 and argument (16 bits). Reading the first byte freezes the recorder, reading the last
+ * record starts it again.
+ */
+
+#ifndef __CANBOOSE_STATISTICS_H__
+#define __CANBOOSE_STATISTICS_H__
+
+#include "canboose_hal.h"
+
+#define STATISTICS_SPACE        0xEF
+#define STATISTICS_VERSION      1
+#define STATISTICS_ENTRIES      46
+#define STATISTICS_SPACE_SIZE   (4 * STATISTICS_ENTRIES)
+#define STATISTICS_TRACE_OFFSET 0x100
+
+// RX counters are written in the CAN interrupt and TX counters mostly from loop(). Each group
+// starts its own 32 byte line, so on cores with a data cache they do not share one
+struct alignas(32) frameCounters {
+  uint32_t rxFrames[8];         // By frame type. 0 is CAN control frames
+  uint32_t txFrames[8];
+  uint32_t rxFiltered;          // Event reports dropped by the event filter
+  uint32_t aliasCollisions;
+  uint32_t isrCount;            // CAN RX and TX complete interrupts
+  uint32_t isrMicros;
+  uint32_t isrMaxMicros;
+};
+
+// Frame type index of a 29 bit header
+inline uint8_t counterFrameType(uint32_t id) {
+  return (id & 0x08000000) ? (id >> 24) & 0x07 : 0;
+}
+
+#endif
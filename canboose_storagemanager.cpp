@@ -0,0 +1,111 @@
+#include "canboose_storagemanager.h"
+
+bool StorageManagerClass::begin(NonVolatileStorage *nvStorage) {
+  // User and configuration spaces would not fit
+  if (nvStorage->size() < STORAGE_MIRROR_SIZE) return false;
+
+  backend = nvStorage;
+  mirrorSize = STORAGE_MIRROR_SIZE;
+  for (int i = 0; i < mirrorSize; i++) {
+    mirror[i] = backend->read(i);
+  }
+  dirtyStart = dirtyEnd = 0;
+  flushing = false;
+  return true;
+}
+
+/* -------------------------------------------------------------
+ *  Called from loop(). Start a flush once writes have stopped for
+ *  a while, then move it on a few bytes each time
+ */
+void StorageManagerClass::run() {
+  if (!flushing) {
+    if (!dirty() || halMillis() - lastWriteMillis < STORAGE_FLUSH_IDLE_MILLIS) return;
+    flushing = true;
+    flushMicros = 0;
+  }
+
+  uint32_t start = halMicros();
+  flushBytes(STORAGE_FLUSH_BYTES_PER_RUN);
+  uint32_t micros = halMicros() - start;
+  flushMicros += micros;
+  if (micros > maxRunMicros) maxRunMicros = micros;
+
+  if (!dirty()) flushCompleted();
+}
+
+void StorageManagerClass::flush() {
+  if (!dirty()) return;
+  if (!flushing) {
+    flushing = true;
+    flushMicros = 0;
+  }
+
+  uint32_t start = halMicros();
+  flushBytes(STORAGE_MIRROR_SIZE);
+  flushMicros += halMicros() - start;
+  flushCompleted();
+}
+
+// Writes up to maxWrites bytes from the start of the dirty range
+void StorageManagerClass::flushBytes(uint16_t maxWrites) {
+  uint16_t writes = 0;
+  while (dirty() && writes < maxWrites) {
+    uint16_t i = dirtyStart++;
+    // A byte may have been changed and then set back
+    if (backend->read(i) != mirror[i]) {
+      backend->write(i, mirror[i]);
+      bytesFlushed++;
+      writes++;
+    }
+    else {
+      bytesSkipped++;
+    }
+  }
+}
+
+void StorageManagerClass::flushCompleted() {
+  flushing = false;
+  flushes++;
+  lastFlushMicros = flushMicros;
+  if (lastFlushMicros > maxFlushMicros) maxFlushMicros = lastFlushMicros;
+}
+
+bool StorageManagerClass::dirty() {
+  return dirtyStart != dirtyEnd;
+}
+
+uint8_t StorageManagerClass::read(uint16_t address) {
+  if (address < mirrorSize) return mirror[address];
+  return backend->read(address);
+}
+
+void StorageManagerClass::write(uint16_t address, uint8_t value) {
+  if (address >= mirrorSize) {
+    backend->write(address, value);
+    return;
+  }
+
+  if (mirror[address] == value) return;
+  mirror[address] = value;
+  writesReceived++;
+
+  // Grow dirty range
+  if (!dirty()) {
+    dirtyStart = address;
+    dirtyEnd = address + 1;
+  }
+  else {
+    if (address < dirtyStart) dirtyStart = address;
+    if (address >= dirtyEnd) dirtyEnd = address + 1;
+  }
+  lastWriteMillis = halMillis();
+}
+
+uint16_t StorageManagerClass::size() {
+  return backend->size();
+}
+
+const uint8_t *StorageManagerClass::mirrored(uint16_t address) {
+  return address < mirrorSize ? &mirror[address] : NULL;
+}
@@ -0,0 +1,64 @@
+/*
+ * RAM mirror and write-behind cache in front of the non volatile storage.
+ *
+ * The first STORAGE_MIRROR_SIZE bytes (user space 0xFB and configuration space 0xFD) are read
+ * once at start up and every read is served from RAM. Writes only touch the mirror and widen a
+ * dirty range; run() flushes it when no write has arrived for STORAGE_FLUSH_IDLE_MILLIS, writing
+ * only the bytes that really differ from what is stored. A configuration tool writing a name in
+ * several datagrams costs one flush, and writing the same value again costs nothing.
+ *
+ * A Teensy EEPROM byte write waits for the flash, so a flush is spread over several run() calls,
+ * STORAGE_FLUSH_BYTES_PER_RUN written bytes at a time, and loop() keeps draining the RX queue.
+ * It eats the dirty range from its start; writes arriving meanwhile just widen it.
+ *
+ * Addresses above the mirror go straight to the backend. The backend must hold the whole mirror:
+ * begin() refuses smaller ones, so mirrored() never fails inside the mirror.
+ */
+
+#ifndef __CANBOOSE_STORAGEMANAGER_H__
+#define __CANBOOSE_STORAGEMANAGER_H__
+
+#include "canboose_hal.h"
+
+#define STORAGE_MIRROR_SIZE         384   // 128 bytes of user space + 256 bytes of configuration
+#define STORAGE_FLUSH_IDLE_MILLIS   500
+#define STORAGE_FLUSH_BYTES_PER_RUN 4
+
+class StorageManagerClass : public NonVolatileStorage {
+  public:
+    bool begin(NonVolatileStorage *nvStorage);    // False if the backend is smaller than the mirror
+    void run();
+    void flush();                   // All of it now, blocking
+    bool dirty();
+
+    // NonVolatileStorage
+    uint8_t read(uint16_t address);
+    void write(uint16_t address, uint8_t value);
+    uint16_t size();
+
+    // Direct read only access to the mirror, for strings and blocks. NULL from STORAGE_MIRROR_SIZE on
+    const uint8_t *mirrored(uint16_t address);
+
+    uint32_t writesReceived = 0;    // Writes that changed the mirror
+    uint32_t bytesFlushed = 0;      // Writes done on the backend
+    uint32_t bytesSkipped = 0;      // Dirty bytes already equal to the stored value
+    uint32_t flushes = 0;
+    uint32_t lastFlushMicros = 0;   // Time spent writing by the last complete flush, all runs together
+    uint32_t maxFlushMicros = 0;
+    uint32_t maxRunMicros = 0;      // Longest a single run() was kept by a flush
+
+  private:
+    NonVolatileStorage *backend = NULL;
+    uint8_t mirror[STORAGE_MIRROR_SIZE];
+    uint16_t mirrorSize = 0;        // STORAGE_MIRROR_SIZE once begin() has accepted a backend
+    uint16_t dirtyStart = 0;
+    uint16_t dirtyEnd = 0;          // Empty when dirtyStart == dirtyEnd
+    uint32_t lastWriteMillis = 0;
+    bool flushing = false;
+    uint32_t flushMicros = 0;       // Of the flush in progress
+
+    void flushBytes(uint16_t maxWrites);
+    void flushCompleted();
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __CANBOOSE_TEXT_H__
+#define __CANBOOSE_TEXT_H__
+
+#include "canboose_hal.h"
+
+/* --------------------------------------------------------------------------------------------------------
+ *  Text without the heap.
+ *
+ *  A textView is a view of characters that live elsewhere: a constant string, the EEPROM mirror or
+ *  a buffer of the caller. It is not null terminated and owns nothing, so it must not outlive what
+ *  it points to. Protocols copy it into their frames or datagrams with copyText().
+ *
+ *  A TextWriterClass builds text in a buffer given by the caller. What does not fit is cut, the
+ *  text is always null terminated.
+ */
+
+struct textView {
+  const char *chars;
+  uint8_t length;
+};
+
+// View of a string literal, length known at compile time
+#define TEXT(literal)   textView { literal, sizeof(literal) - 1 }
+
+// Copies text to a field of size bytes, cut if longer and padded with nulls. At least one null
+// is left at the end when it fits. Returns the bytes used by the text and its null
+inline uint8_t copyText(textView text, uint8_t dest[], uint8_t size) {
+  uint8_t length = text.length < size ? text.length : size;
+  memcpy(dest, text.chars, length);
+  memset(&dest[length], 0, size - length);
+  return length < size ? length + 1 : length;
+}
+
+class TextWriterClass {
+  public:
+    TextWriterClass(char buffer[], uint8_t size) : text(buffer), capacity(size - 1) { text[0] = 0; }
+
+    void append(char c) {
+      if (used < capacity) text[used++] = c;
+      text[used] = 0;
+    }
+
+    void append(const char *s) {
+      while (*s != 0 && used < capacity) text[used++] = *s++;
+      text[used] = 0;
+    }
+
+    void appendNumber(uint32_t value, uint8_t base = 10) {
+      char digits[10];
+      uint8_t count = 0;
+      do {
+        uint8_t digit = value % base;
+        digits[count++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        value /= base;
+      } while (value > 0);
+      while (count > 0) append(digits[--count]);
+    }
+
+    const char* c_str() { return text; }
+    textView view() { return textView { text, used }; }
+
+  private:
+    char *text;
+    uint8_t capacity;
+    uint8_t used = 0;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#include "canboose_trace.h"
+
+#if defined(CANBOOSE_TRACE)
+
+TraceRecorderClass traceRecorder;
+
+void TraceRecorderClass::begin() {
+  halTraceClockBegin();
+  recorded = 0;
+  frozen = false;
+}
+
+void TraceRecorderClass::run() {
+  // The tool reading the ring went away
+  if (frozen && halMillis() - frozenAt > TRACE_FREEZE_MILLIS) resume();
+}
+
+void TraceRecorderClass::freeze() {
+  frozenAt = halMillis();
+  frozen = true;
+}
+
+void TraceRecorderClass::resume() {
+  frozen = false;
+}
+
+uint16_t TraceRecorderClass::count() {
+  return recorded < TRACE_BUFFER_SIZE ? recorded : TRACE_BUFFER_SIZE;
+}
+
+traceRecord& TraceRecorderClass::at(uint16_t index) {
+  uint32_t oldest = recorded - count();
+  return records[(oldest + index) & (TRACE_BUFFER_SIZE - 1)];
+}
+
+void TraceRecorderClass::dump() {
+  bool wasFrozen = frozen;
+  frozen = true;
+
+  char line[48];
+  snprintf(line, sizeof(line), "# canboose trace %lu %u %lu", (unsigned long) halTraceTicksPerMicro(),
+           (unsigned int) count(), (unsigned long) recorded);
+  Serial.println(line);
+  for (uint16_t i = 0; i < count(); i++) {
+    traceRecord &r = at(i);
+    snprintf(line, sizeof(line), "%08lX %u %04X", (unsigned long) r.ticks, (unsigned int) r.point, (unsigned int) r.arg);
+    Serial.println(line);
+  }
+  Serial.println("# end");
+
+  frozen = wasFrozen;
+}
+
+#endif
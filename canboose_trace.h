@@ -0,0 +1,107 @@
+/*
+ * Flight recorder for the frame path. Compiled in only with -DCANBOOSE_TRACE.
+ *
+ * Trace points store an 8 byte record (trace clock ticks, point, argument) in a fixed ring that
+ * keeps the last TRACE_BUFFER_SIZE records. The trace clock is the DWT cycle counter on the
+ * Teensy and CLOCK_MONOTONIC nanoseconds on the host. Recording is lock free: interrupts and
+ * loop() claim slots with an atomic increment.
+ *
+ * Points come in pairs, begin and end of a stage. The argument pairs them: the RX sequence
+ * number of a frame, the MTI, the datagram type or the TX class. The ring can be dumped as text
+ * over Serial (dump()) or read from the statistics space at STATISTICS_TRACE_OFFSET, and
+ * host/canboose_tracedecode.cpp turns a dump into per-stage latency histograms.
+ */
+
+#ifndef __CANBOOSE_TRACE_H__
+#define __CANBOOSE_TRACE_H__
+
+#include "canboose_hal.h"
+
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE     256       // Records. Must be a power of two
+#endif
+#define TRACE_FREEZE_MILLIS   5000      // A frozen recorder starts again after this if nobody resumes it
+
+// Trace points
+#define TRACE_RX_INTERRUPT          1   // frameHandler() entry
+#define TRACE_RX_INTERRUPT_END      2
+#define TRACE_RX_QUEUED             3   // Frame in the RX queue. Argument: RX sequence
+#define TRACE_RX_PROCESS            4   // run() takes it from the queue
+#define TRACE_RX_PROCESSED          5   // All layers done with it
+#define TRACE_APP_MESSAGE           6   // Application layer message handler. Argument: MTI
+#define TRACE_APP_MESSAGE_END       7
+#define TRACE_APP_DATAGRAM          8   // Application layer datagram handler. Argument: datagram type
+#define TRACE_APP_DATAGRAM_END      9
+#define TRACE_TX_QUEUED             10  // queueFrame(). Argument: TX class
+#define TRACE_TX_SENT               11  // Handed to the CAN driver
+#define TRACE_TX_INTERRUPT          12  // transmitComplete() entry
+#define TRACE_TX_INTERRUPT_END      13
+
+struct traceStage {
+  const char *name;
+  uint8_t begin;
+  uint8_t end;
+};
+
+static const traceStage traceStages[] = {
+  { "CAN RX interrupt",     TRACE_RX_INTERRUPT, TRACE_RX_INTERRUPT_END },
+  { "RX queue wait",        TRACE_RX_QUEUED,    TRACE_RX_PROCESS },
+  { "Frame, all layers",    TRACE_RX_PROCESS,   TRACE_RX_PROCESSED },
+  { "Application message",  TRACE_APP_MESSAGE,  TRACE_APP_MESSAGE_END },
+  { "Application datagram", TRACE_APP_DATAGRAM, TRACE_APP_DATAGRAM_END },
+  { "TX queue wait",        TRACE_TX_QUEUED,    TRACE_TX_SENT },
+  { "CAN TX interrupt",     TRACE_TX_INTERRUPT, TRACE_TX_INTERRUPT_END },
+};
+#define TRACE_STAGES  (sizeof(traceStages) / sizeof(traceStages[0]))
+
+struct traceRecord {
+  uint32_t ticks;
+  uint8_t  point;
+  uint8_t  reserved;
+  uint16_t arg;
+};
+
+class TraceRecorderClass {
+  static_assert(TRACE_BUFFER_SIZE >= 2 && (TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1)) == 0,
+                "Trace buffer size must be a power of two");
+
+  public:
+    void begin();
+    void run();
+
+    inline void record(uint8_t point, uint16_t arg) {
+      if (frozen) return;
+      uint32_t ticks = halTraceClock();
+      traceRecord &r = records[__sync_fetch_and_add(&recorded, 1) & (TRACE_BUFFER_SIZE - 1)];
+      r.ticks = ticks;
+      r.point = point;
+      r.arg = arg;
+    }
+
+    // Stop recording while the ring is read in pieces
+    void freeze();
+    void resume();
+
+    // Records in the ring, oldest first
+    uint16_t count();
+    traceRecord& at(uint16_t index);
+
+    // Text dump: header line, one line per record, end line
+    void dump();
+
+    volatile uint32_t recorded = 0;   // Since begin(). The ring has the last TRACE_BUFFER_SIZE
+
+  private:
+    traceRecord records[TRACE_BUFFER_SIZE];
+    volatile bool frozen = false;
+    uint32_t frozenAt;
+};
+
+#if defined(CANBOOSE_TRACE)
+  extern TraceRecorderClass traceRecorder;
+  #define TRACE(point, arg)   traceRecorder.record(point, arg)
+#else
+  #define TRACE(point, arg)
+#endif
+
+#endif
@@ -0,0 +1,375 @@
+/* -------------------------------------------------------------
+ *  Host benchmark suite
+ *
+ *  Drives the node with synthetic traffic and times the frame path with the real clock:
+ *  frame decode in frameHandler() and run(), datagram fragmentation, datagram reassembly,
+ *  Simple Node Information replies, CDI reads and the other configuration requests. Every case
+ *  reports ns per operation and per frame, heap allocations and bytes per operation. Peak heap
+ *  and peak RSS are printed at the end. malloc() and free() are wrapped here to count
+ *  allocations, new included. The stack must not allocate: a case that does is an error.
+ *
+ *  The node talks to a null CAN driver: frames are counted and thrown away, TX is always
+ *  complete, so only the stack is measured.
+ *
+ *  Build from the sketch folder:
+ *    g++ -std=gnu++14 -O2 -I. canboose_*.cpp host/canboose_bench.cpp -o canboose_bench
+ *    ./canboose_bench -o baseline.txt      # save results
+ *    ./canboose_bench -c baseline.txt      # compare with saved results
+ */
+
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <map>
+#include <string>
+#include "canboose_applicationlayer.h"
+
+uint8_t UID_array[6] = { 0x05, 0x01, 0x01, 0x01, 0x2D, 0x00 };
+
+#define BENCH_ALIAS     0x0AAA
+
+/* -------------------------------------------------------------
+ *  Allocation counting
+ */
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void __libc_free(void *p);
+
+static uint64_t allocations = 0;
+static uint64_t allocatedBytes = 0;
+static int64_t heapInUse = 0;
+static int64_t heapPeak = 0;
+
+static void countAllocation(void *p) {
+  if (p == NULL) return;
+  size_t size = malloc_usable_size(p);
+  allocations++;
+  allocatedBytes += size;
+  heapInUse += size;
+  if (heapInUse > heapPeak) heapPeak = heapInUse;
+}
+
+extern "C" void *malloc(size_t size) {
+  void *p = __libc_malloc(size);
+  countAllocation(p);
+  return p;
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+  void *p = __libc_calloc(count, size);
+  countAllocation(p);
+  return p;
+}
+
+extern "C" void *realloc(void *old, size_t size) {
+  if (old != NULL) heapInUse -= malloc_usable_size(old);
+  void *p = __libc_realloc(old, size);
+  countAllocation(p);
+  return p;
+}
+
+extern "C" void free(void *p) {
+  if (p != NULL) heapInUse -= malloc_usable_size(p);
+  __libc_free(p);
+}
+
+/* -------------------------------------------------------------
+ *  A CAN driver that only counts
+ */
+class NullCanDriver : public CanDriver {
+  public:
+    bool begin(uint32_t baudRate, CanDriverListener *listener) {
+      canListener = listener;
+      return true;
+    }
+
+    bool write(canFrame &frame) {
+      framesWritten++;
+      if ((frame.id & 0xFFFFF000) == AMD) alias = frame.id & 0xFFF;
+      canListener->transmitComplete();
+      return true;
+    }
+
+    CanDriverListener *canListener = NULL;
+    uint64_t framesWritten = 0;
+    uint16_t alias = 0;
+};
+
+/* -------------------------------------------------------------
+ *  Cases
+ */
+static ApplicationLayer app;
+static NullCanDriver canDriver;
+static uint64_t framesIn = 0;
+
+static void inject(uint32_t header, const uint8_t data[], uint8_t len) {
+  canFrame frame = {0, {1, 0, 0}, 0};
+  frame.id = header;
+  frame.len = len;
+  memcpy(frame.buf, data, len);
+  app.network.frameTransferLayer.frameHandler(frame);
+  framesIn++;
+}
+
+// Other nodes on the bus. Never the node's alias, that would be a collision
+static uint16_t foreignAlias(uint32_t i) {
+  uint16_t alias = 0x100 + (i & 0x3FF);
+  return alias == canDriver.alias ? alias ^ 0x800 : alias;
+}
+
+static uint64_t nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct benchResult {
+  double nsPerOp;
+  double nsPerFrame;
+  double allocsPerOp;
+  double bytesPerOp;
+};
+
+static std::map<std::string, benchResult> results;
+static std::vector<std::string> order;
+
+static void bench(const char *name, uint32_t ops, void (*operation)(uint32_t i)) {
+  // Warm up: caches, encoded SNIP reply, pools
+  for (uint32_t i = 0; i < ops / 100 + 1; i++) operation(i);
+
+  uint64_t allocs = allocations, bytes = allocatedBytes;
+  uint64_t in = framesIn, out = canDriver.framesWritten;
+  uint64_t start = nowNanos();
+  for (uint32_t i = 0; i < ops; i++) operation(i);
+  uint64_t elapsed = nowNanos() - start;
+
+  uint64_t frames = (framesIn - in) + (canDriver.framesWritten - out);
+  benchResult r;
+  r.nsPerOp = (double) elapsed / ops;
+  r.nsPerFrame = frames > 0 ? (double) elapsed / frames : 0;
+  r.allocsPerOp = (double) (allocations - allocs) / ops;
+  r.bytesPerOp = (double) (allocatedBytes - bytes) / ops;
+  results[name] = r;
+  order.push_back(name);
+
+  printf("%-34s %9u ops %10.1f ns/op %8.1f ns/frame %6.2f allocs/op %8.1f bytes/op\n",
+         name, ops, r.nsPerOp, r.nsPerFrame, r.allocsPerOp, r.bytesPerOp);
+}
+
+// Event reports nobody here consumes. Nearly all dropped by the event filter inside
+// frameHandler(), the few false positives are processed by run() every 8 frames
+static void foreignEventReports(uint32_t i) {
+  uint8_t event[8] = { 0x02, 0x01, 0x57, 0x00, (uint8_t) (i >> 24), (uint8_t) (i >> 16), (uint8_t) (i >> 8), (uint8_t) i };
+  inject(0x195B4000 | foreignAlias(i), event, 8);
+  if ((i & 7) == 7) app.run();
+}
+
+// What a busy layout sends: verified IDs, foreign addressed messages, foreign
+// datagrams, alias definitions and events. Eight frames, then run()
+static void mixedTraffic(uint32_t i) {
+  uint16_t src = foreignAlias(i);
+  uint8_t nodeID[6] = { 0x05, 0x01, 0x01, 0x01, (uint8_t) (src >> 8), (uint8_t) src };
+  uint8_t addressed[2] = { 0x0B, 0xBB };
+  uint8_t datagram[8] = { 0x20, 0x43, 0, 0, 0, 0, 0x40, 0 };
+  uint8_t event[8] = { 0x02, 0x01, 0x57, 0x00, 0x00, 0x00, (uint8_t) (i >> 8), (uint8_t) i };
+
+  inject(0x19170000 | src, nodeID, 6);
+  inject(0x19488000 | src, addressed, 2);
+  inject(0x1ABBB000 | src, datagram, 7);
+  inject(AMD | src, nodeID, 6);
+  inject(0x195B4000 | src, event, 8);
+  inject(0x19490000 | src, NULL, 0);
+  inject(0x19914000 | src, event, 8);
+  inject(0x19A28000 | src, addressed, 2);
+  app.run();
+}
+
+// 72 bytes to another node, 9 frames. The OK clears the pool slot
+static void datagramFragmentation(uint32_t i) {
+  uint8_t data[72];
+  for (int b = 0; b < 72; b++) data[b] = i + b;
+  app.network.sendDatagram(BENCH_ALIAS, data, 72, false);
+
+  uint8_t ok[3] = { (uint8_t) (canDriver.alias >> 8), (uint8_t) (canDriver.alias & 0xFF), 0x00 };
+  inject(0x19A28000 | BENCH_ALIAS, ok, 3);
+  app.run();
+}
+
+// 72 bytes from another node, 9 frames. Unknown datagram type, so the
+// application answers with a one frame rejection
+static void datagramReassembly(uint32_t i) {
+  uint32_t dst = (uint32_t) canDriver.alias << 12;
+  uint8_t data[8] = { 0x30, (uint8_t) i, 2, 3, 4, 5, 6, 7 };
+  inject(0x1B000000 | dst | BENCH_ALIAS, data, 8);
+  for (int f = 0; f < 7; f++) inject(0x1C000000 | dst | BENCH_ALIAS, data, 8);
+  inject(0x1D000000 | dst | BENCH_ALIAS, data, 8);
+  app.run();
+  app.run();  // RX_FRAMES_PER_RUN at a time
+}
+
+static void simpleNodeInformation(uint32_t i) {
+  uint8_t dst[2] = { (uint8_t) (canDriver.alias >> 8), (uint8_t) (canDriver.alias & 0xFF) };
+  inject(0x19DE8000 | BENCH_ALIAS, dst, 2);
+  app.run();
+}
+
+// Memory configuration read of 64 bytes of CDI. Datagram OK, then a 71 byte reply
+static void cdiRead(uint32_t i) {
+  uint32_t address = (i * 64) % 1024;
+  uint8_t read[7] = { 0x20, 0x43, 0, 0, (uint8_t) (address >> 8), (uint8_t) address, 0x40 };
+  inject(0x1A000000 | ((uint32_t) canDriver.alias << 12) | BENCH_ALIAS, read, 7);
+  app.run();
+
+  uint8_t ok[3] = { (uint8_t) (canDriver.alias >> 8), (uint8_t) (canDriver.alias & 0xFF), 0x00 };
+  inject(0x19A28000 | BENCH_ALIAS, ok, 3);
+  app.run();
+}
+
+// A memory configuration datagram from the bench node, in as many frames as it takes. Then
+// the OK for the reply, if there is one
+static void configurationRequest(const uint8_t request[], uint8_t len, bool reply) {
+  uint32_t dst = (uint32_t) canDriver.alias << 12;
+  if (len <= 8) inject(0x1A000000 | dst | BENCH_ALIAS, request, len);
+  else {
+    for (uint8_t sent = 0; sent < len; sent += 8) {
+      uint32_t type = sent == 0 ? 0x1B000000 : sent + 8 >= len ? 0x1D000000 : 0x1C000000;
+      inject(type | dst | BENCH_ALIAS, &request[sent], len - sent < 8 ? len - sent : 8);
+    }
+  }
+  app.run();
+  app.run();
+
+  if (reply) {
+    uint8_t ok[3] = { (uint8_t) (canDriver.alias >> 8), (uint8_t) (canDriver.alias & 0xFF), 0x00 };
+    inject(0x19A28000 | BENCH_ALIAS, ok, 3);
+    app.run();
+  }
+}
+
+// The four manufacturer strings in turn
+static void manufacturerRead(uint32_t i) {
+  static const uint8_t addresses[4] = { 1, 42, 83, 104 };
+  uint8_t read[8] = { 0x20, 0x40, 0, 0, 0, addresses[i & 3], 0xFC, 41 };
+  configurationRequest(read, 8, true);
+}
+
+// User name and description in turn
+static void userSpaceRead(uint32_t i) {
+  uint8_t read[8] = { 0x20, 0x40, 0, 0, 0, (uint8_t) (i & 1 ? 64 : 1), 0xFB, 64 };
+  configurationRequest(read, 8, true);
+}
+
+static void addressSpaceInformation(uint32_t i) {
+  static const uint8_t spaces[5] = { 0xFF, 0xFD, 0xFC, 0xFB, STATISTICS_SPACE };
+  uint8_t request[3] = { 0x20, 0x84, spaces[i % 5] };
+  configurationRequest(request, 3, true);
+}
+
+// A new user name, so the next Simple Node Information reply is encoded again
+static void userNameChange(uint32_t i) {
+  uint8_t write[7 + 12] = { 0x20, 0x00, 0, 0, 0, 1, 0xFB, 'B', 'e', 'n', 'c', 'h', ' ', 'n', 'o', 'd', 'e', ' ', 0 };
+  write[18] = '0' + i % 10;
+  configurationRequest(write, sizeof(write), false);
+  simpleNodeInformation(i);
+}
+
+/* -------------------------------------------------------------
+ *  Baselines: one "name|ns/op|allocs/op" line per case
+ */
+static void saveResults(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return;
+  }
+  for (size_t i = 0; i < order.size(); i++) {
+    benchResult &r = results[order[i]];
+    fprintf(f, "%s|%.1f|%.2f\n", order[i].c_str(), r.nsPerOp, r.allocsPerOp);
+  }
+  fclose(f);
+}
+
+static void compareResults(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return;
+  }
+
+  printf("\nAgainst %s:\n", path);
+  char line[128];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char *bar = strchr(line, '|');
+    if (bar == NULL) continue;
+    *bar = 0;
+    double nsPerOp, allocsPerOp;
+    if (sscanf(bar + 1, "%lf|%lf", &nsPerOp, &allocsPerOp) != 2) continue;
+    if (results.count(line) == 0) continue;
+
+    benchResult &r = results[line];
+    printf("%-34s %10.1f -> %10.1f ns/op (%+6.1f %%)  %6.2f -> %6.2f allocs/op\n", line, nsPerOp, r.nsPerOp,
+           nsPerOp > 0 ? 100.0 * (r.nsPerOp - nsPerOp) / nsPerOp : 0.0, allocsPerOp, r.allocsPerOp);
+  }
+  fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+  const char *saveTo = NULL;
+  const char *compareWith = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:c:")) != -1) {
+    switch (opt) {
+      case 'o': saveTo = optarg; break;
+      case 'c': compareWith = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-o save_results] [-c compare_with]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  // Scheduler on a simulated clock, only to get through alias allocation
+  hostUseSimulatedClock(true);
+  HostStorage storage;
+  app.init(&canDriver, &storage);
+  hostRunUntil(hostNowMicros() + 300000);
+  if (canDriver.alias == 0 || canDriver.alias == BENCH_ALIAS) {
+    printf("Node did not reach permitted state\n");
+    return 1;
+  }
+
+  bench("frameHandler, foreign events", 2000000, foreignEventReports);
+  bench("frame decode, mixed traffic", 200000, mixedTraffic);
+  bench("datagram fragmentation, 72 bytes", 200000, datagramFragmentation);
+  bench("datagram reassembly, 72 bytes", 200000, datagramReassembly);
+  bench("Simple Node Information reply", 200000, simpleNodeInformation);
+  bench("CDI read, 64 bytes", 200000, cdiRead);
+  bench("manufacturer space read", 200000, manufacturerRead);
+  bench("user space read", 200000, userSpaceRead);
+  bench("address space information", 200000, addressSpaceInformation);
+  bench("user name write, then SNIP", 200000, userNameChange);
+
+  // Every case must leave the node with its alias
+  if (app.network.frameTransferLayer.counters.aliasCollisions > 0) {
+    printf("Alias collision during the benchmark, results are not valid\n");
+    return 1;
+  }
+
+  // Nothing on the frame path or in the configuration requests may use the heap
+  bool allocates = false;
+  for (size_t i = 0; i < order.size(); i++) {
+    if (results[order[i]].allocsPerOp > 0) {
+      printf("ERROR: %s allocates %.2f times per operation\n", order[i].c_str(), results[order[i]].allocsPerOp);
+      allocates = true;
+    }
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("\nPeak heap %lld bytes, peak RSS %ld kB\n", (long long) heapPeak, usage.ru_maxrss);
+
+  if (saveTo != NULL) saveResults(saveTo);
+  if (compareWith != NULL) compareResults(compareWith);
+  return allocates ? 1 : 0;
+}
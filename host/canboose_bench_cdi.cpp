@@ -0,0 +1,275 @@
+/* -------------------------------------------------------------
+ *  Full CDI download: datagrams against a stream
+ *
+ *  A configuration tool on the virtual bus (125 kbit/s, simulated clock) downloads the whole
+ *  CDI twice: with 64 bytes Memory Configuration read datagrams, the way tools without stream
+ *  support do, and with a single Read Stream command. Then it writes the configuration space
+ *  with a Write Stream command and reads it back to check it. The tool grants a 2048 bytes
+ *  window, like the node, so the CDI needs no Proceed.
+ *
+ *  Both downloads keep the bus 100 % busy, so bus time follows the frame count: a stream frame
+ *  carries 7 bytes, a read takes a request, 9 reply frames and two Datagram OKs per 64 bytes.
+ *
+ *  Build from the sketch folder:
+ *    g++ -std=gnu++14 -O2 -I. canboose_*.cpp host/canboose_bench_cdi.cpp -o bench_cdi
+ */
+
+#include "canboose_applicationlayer.h"
+
+uint8_t UID_array[6] = { 0x05, 0x01, 0x01, 0x01, 0x2D, 0x00 };
+
+#define TOOL_ALIAS      0x0AAA
+#define TOOL_STREAM_ID  0x05
+#define TOOL_WINDOW     2048
+
+static void runNode(void *node) {
+  ((ApplicationLayer*) node)->run();
+}
+
+class BenchTool : public CanDriverListener {
+  public:
+    BenchTool(VirtualCanBus *bus) : driver(bus) {}
+
+    void send(uint32_t header, const uint8_t data[], uint8_t len) {
+      canFrame frame = {0, {1, 0, 0}, 0};
+      frame.id = (header & 0x1FFFF000) | TOOL_ALIAS;
+      frame.len = len;
+      memcpy(frame.buf, data, len);
+      while (!driver.write(frame)) hostRunNextEvent(HOST_NO_EVENT);
+    }
+
+    void sendAddressed(uint16_t mti, const uint8_t data[], uint8_t len) {
+      uint8_t buf[8] = { (uint8_t) (nodeAlias >> 8), (uint8_t) (nodeAlias & 0xFF) };
+      memcpy(&buf[2], data, len);
+      send(0x19000000 | ((uint32_t) mti << 12), buf, len + 2);
+    }
+
+    void sendDatagram(const uint8_t data[], uint8_t len) {
+      uint32_t dst = (uint32_t) nodeAlias << 12;
+      if (len <= 8) {
+        send(0x1A000000 | dst, data, len);
+        return;
+      }
+      for (uint8_t i = 0; i < len; i += 8) {
+        uint8_t size = len - i > 8 ? 8 : len - i;
+        uint32_t type = i == 0 ? 0x1B000000 : (i + 8 >= len ? 0x1D000000 : 0x1C000000);
+        send(type | dst, &data[i], size);
+      }
+    }
+
+    bool frameHandler(canFrame &frame) {
+      if ((frame.id & 0xFFFFF000) == AMD) nodeAlias = frame.id & 0xFFF;
+
+      uint8_t frameType = (frame.id >> 24) & 0x1F;
+      uint16_t dst = (frame.id >> 12) & 0xFFF;
+      uint16_t mti = (frame.id >> 12) & 0xFFF;
+
+      // Datagrams for us
+      if (dst == TOOL_ALIAS && frameType >= 0x1A && frameType <= 0x1D) {
+        if (frameType == 0x1A || frameType == 0x1B) datagramLen = 0;
+        memcpy(&datagram[datagramLen], frame.buf, frame.len);
+        datagramLen += frame.len;
+        if (frameType == 0x1A || frameType == 0x1D) datagramDone = true;
+      }
+
+      // Stream data for us
+      if (dst == TOOL_ALIAS && frameType == 0x1F && frame.buf[0] == TOOL_STREAM_ID) {
+        memcpy(&stream[streamLen], &frame.buf[1], frame.len - 1);
+        streamLen += frame.len - 1;
+        windowUsed += frame.len - 1;
+        if (windowUsed >= TOOL_WINDOW) {
+          windowUsed = 0;
+          pendingProceed = true;
+        }
+      }
+
+      if (frameType == 0x19) {
+        if (mti == STREAM_INITIATE_REQUEST) pendingInitiate = frame.buf[6];
+        if (mti == STREAM_INITIATE_REPLY) streamAccepted = (frame.buf[4] & 0x80) > 0;
+        if (mti == STREAM_DATA_PROCEED) proceeded = true;
+        if (mti == STREAM_DATA_COMPLETE) streamDone = true;
+      }
+      return true;
+    }
+
+    // Answer stream requests and proceeds from the main loop, not from the bus
+    void serve() {
+      if (pendingInitiate != STREAM_NONE) {
+        uint8_t reply[6] = { TOOL_WINDOW >> 8, TOOL_WINDOW & 0xFF, 0x80, 0x00, pendingInitiate, TOOL_STREAM_ID };
+        pendingInitiate = STREAM_NONE;
+        sendAddressed(STREAM_INITIATE_REPLY, reply, 6);
+      }
+      if (pendingProceed) {
+        uint8_t proceed[4] = { 0x00, TOOL_STREAM_ID, 0x00, 0x00 };
+        pendingProceed = false;
+        sendAddressed(STREAM_DATA_PROCEED, proceed, 4);
+      }
+    }
+
+    bool waitFor(volatile bool &flag, uint64_t timeoutMicros) {
+      uint64_t end = hostNowMicros() + timeoutMicros;
+      while (!flag && hostRunNextEvent(end)) serve();
+      return flag;
+    }
+
+    void ackDatagram() {
+      uint8_t ok[1] = { 0x00 };
+      sendAddressed(DATAGRAM_RECEIVED_OK, ok, 1);
+    }
+
+    VirtualCanDriver driver;
+    uint16_t nodeAlias = 0;
+
+    uint8_t datagram[72];
+    uint8_t datagramLen = 0;
+    volatile bool datagramDone = false;
+
+    uint8_t stream[2048];
+    uint32_t streamLen = 0;
+    uint16_t windowUsed = 0;
+    uint8_t pendingInitiate = STREAM_NONE;
+    bool pendingProceed = false;
+    volatile bool streamAccepted = false;
+    volatile bool proceeded = false;
+    volatile bool streamDone = false;
+};
+
+static void report(const char *what, uint64_t micros, uint32_t frames, uint64_t busyMicros, uint32_t bytes) {
+  printf("%-22s %5u bytes  %8.2f ms  %4u frames on the bus, busy %5.1f %%\n", what, bytes, micros / 1000.0, frames,
+         100.0 * busyMicros / micros);
+}
+
+int main() {
+  hostUseSimulatedClock(true);
+
+  VirtualCanBus bus(125000);
+  VirtualCanDriver canDriver(&bus);
+  HostStorage storage;
+  BenchTool tool(&bus);
+  ApplicationLayer app;
+
+  tool.driver.begin(125000, &tool);
+  app.init(&canDriver, &storage);
+  hostAddLoop(runNode, &app);
+  hostRunUntil(hostNowMicros() + 300000);
+  if (tool.nodeAlias == 0) {
+    printf("Node did not reach permitted state\n");
+    return 1;
+  }
+
+  // CDI with read datagrams, 64 bytes each
+  static uint8_t byDatagrams[2048];
+  uint32_t received = 0;
+  uint64_t start = hostNowMicros();
+  uint32_t startFrames = bus.framesTransferred;
+  uint64_t startBusy = bus.busyMicros;
+  for (;;) {
+    uint8_t read[7] = { 0x20, 0x43, (uint8_t) (received >> 24), (uint8_t) (received >> 16),
+                        (uint8_t) (received >> 8), (uint8_t) received, 64 };
+    tool.datagramDone = false;
+    tool.sendDatagram(read, 7);
+    if (!tool.waitFor(tool.datagramDone, 1000000)) {
+      printf("No reply to read at %u\n", received);
+      return 1;
+    }
+    tool.ackDatagram();
+
+    uint8_t size = tool.datagramLen - 6;
+    memcpy(&byDatagrams[received], &tool.datagram[6], size);
+    received += size;
+    if (size < 64) break;
+  }
+  report("CDI, read datagrams", hostNowMicros() - start, bus.framesTransferred - startFrames, bus.busyMicros - startBusy, received);
+
+  // CDI with one read stream, whole space
+  hostRunUntil(hostNowMicros() + 10000);
+  start = hostNowMicros();
+  startFrames = bus.framesTransferred;
+  startBusy = bus.busyMicros;
+  uint8_t readStream[12] = { 0x20, 0x63, 0, 0, 0, 0, 0xFF, TOOL_STREAM_ID, 0, 0, 0, 0 };
+  tool.datagramDone = false;
+  tool.sendDatagram(readStream, 12);
+  if (!tool.waitFor(tool.datagramDone, 1000000) || tool.datagram[1] != 0x73) {
+    printf("Read stream refused\n");
+    return 1;
+  }
+  tool.ackDatagram();
+  if (!tool.waitFor(tool.streamDone, 5000000)) {
+    printf("Stream did not complete, %u bytes received\n", tool.streamLen);
+    return 1;
+  }
+  report("CDI, read stream", hostNowMicros() - start, bus.framesTransferred - startFrames, bus.busyMicros - startBusy, tool.streamLen);
+
+  if (tool.streamLen != received || memcmp(tool.stream, byDatagrams, received) != 0) {
+    printf("Stream and datagram downloads differ\n");
+    return 1;
+  }
+
+  // Whole configuration space with a write stream
+  hostRunUntil(hostNowMicros() + 10000);
+  uint8_t config[CONFIGURATION_SPACE_SIZE];
+  for (int i = 0; i < CONFIGURATION_SPACE_SIZE; i++) config[i] = i * 7;
+
+  start = hostNowMicros();
+  startFrames = bus.framesTransferred;
+  startBusy = bus.busyMicros;
+  uint8_t writeStream[8] = { 0x20, 0x21, 0, 0, 0, 0, TOOL_STREAM_ID, 0xFF };
+  tool.datagramDone = false;
+  tool.sendDatagram(writeStream, 8);
+  hostRunUntil(hostNowMicros() + 5000);
+
+  uint8_t initiate[6] = { TOOL_WINDOW >> 8, TOOL_WINDOW & 0xFF, 0x00, 0x00, TOOL_STREAM_ID, 0xFF };
+  tool.sendAddressed(STREAM_INITIATE_REQUEST, initiate, 6);
+  if (!tool.waitFor(tool.streamAccepted, 1000000)) {
+    printf("Write stream refused\n");
+    return 1;
+  }
+
+  // Node stream ID is in the reply. Send window by window
+  uint8_t nodeStreamID = 0x80;
+  uint32_t sent = 0;
+  uint32_t window = 0;
+  while (sent < CONFIGURATION_SPACE_SIZE) {
+    uint8_t frame[8] = { nodeStreamID };
+    uint8_t size = CONFIGURATION_SPACE_SIZE - sent > 7 ? 7 : CONFIGURATION_SPACE_SIZE - sent;
+    if (window + size > TOOL_WINDOW) size = TOOL_WINDOW - window;
+    memcpy(&frame[1], &config[sent], size);
+    tool.send(0x1F000000 | ((uint32_t) tool.nodeAlias << 12), frame, size + 1);
+    sent += size;
+    window += size;
+    if (window == TOOL_WINDOW && sent < CONFIGURATION_SPACE_SIZE) {
+      tool.proceeded = false;
+      if (!tool.waitFor(tool.proceeded, 1000000)) {
+        printf("No proceed after %u bytes\n", sent);
+        return 1;
+      }
+      window = 0;
+    }
+  }
+  uint8_t complete[2] = { TOOL_STREAM_ID, nodeStreamID };
+  tool.datagramDone = false;
+  tool.sendAddressed(STREAM_DATA_COMPLETE, complete, 2);
+  if (!tool.waitFor(tool.datagramDone, 1000000) || tool.datagram[1] != 0x31) {
+    printf("No write stream reply\n");
+    return 1;
+  }
+  tool.ackDatagram();
+  report("Config, write stream", hostNowMicros() - start, bus.framesTransferred - startFrames, bus.busyMicros - startBusy, sent);
+
+  // Read it back
+  hostRunUntil(hostNowMicros() + 10000);
+  tool.streamLen = 0;
+  tool.streamDone = false;
+  uint8_t readBack[12] = { 0x20, 0x61, 0, 0, 0, 0, 0xFF, TOOL_STREAM_ID, 0, 0, 0, 0 };
+  tool.datagramDone = false;
+  tool.sendDatagram(readBack, 12);
+  tool.waitFor(tool.datagramDone, 1000000);
+  tool.ackDatagram();
+  tool.waitFor(tool.streamDone, 5000000);
+  if (tool.streamLen != CONFIGURATION_SPACE_SIZE || memcmp(tool.stream, config, CONFIGURATION_SPACE_SIZE) != 0) {
+    printf("Configuration read back differs\n");
+    return 1;
+  }
+  printf("Configuration read back OK\n");
+  return 0;
+}
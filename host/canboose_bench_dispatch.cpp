@@ -0,0 +1,311 @@
+/* -------------------------------------------------------------
+ *  Message dispatch benchmark
+ *
+ *  Times the way from a decoded global or addressed message to its handler: the compile-time
+ *  MTI table (canboose_mtidispatch.h) against a replica of the chain it replaced, a switch on
+ *  the MTI in the network layer, then a virtual call to the application layer and a second
+ *  switch there. Both start at the same virtual processLCCMessage() and frame type switch, and
+ *  reach the same handlers, that only count. Three traffic mixes: event reports, what a busy
+ *  layout sends, and messages addressed to this node.
+ *
+ *  The process is pinned to one CPU and chain and table rounds alternate, so a noisy moment
+ *  hits both. Reported: the median of each, and the median of the table/chain ratio of the
+ *  round pairs with its spread (25th to 75th percentile). Differences inside the spread are noise.
+ *
+ *  Build from the sketch folder:
+ *    g++ -std=gnu++14 -O2 -I. canboose_*.cpp host/canboose_bench_dispatch.cpp -o bench_dispatch
+ */
+
+#include <sched.h>
+#include <time.h>
+#include <algorithm>
+#include "canboose_applicationlayer.h"
+
+uint8_t UID_array[6] = { 0x05, 0x01, 0x01, 0x01, 0x2D, 0x00 };
+
+#define OUR_ALIAS       0x0123
+#define OTHER_ALIAS     0x0456
+#define MESSAGES        2000000     // Per round
+#define ROUNDS          41
+
+struct benchMessage {
+  uint16_t mti;
+  uint8_t data[8];
+  uint8_t len;
+};
+
+// Handler calls, by handler. Both ways must end with the same counts
+static uint32_t handled[16];
+
+static bool isForUs(uint8_t data[], uint8_t len) {
+  return len >= 2 && (((data[0] & 0x0F) << 8) + data[1]) == OUR_ALIAS;
+}
+
+class BenchListener {
+  public:
+    virtual void processLCCMessage(uint8_t frameType, uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len) = 0;
+};
+
+/* -------------------------------------------------------------
+ *  The old chain
+ */
+class ChainApplicationListener {
+  public:
+    virtual void processApplicationMessage(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) = 0;
+};
+
+class ChainApplication : public ChainApplicationListener {
+  public:
+    void processApplicationMessage(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+      switch (mti) {
+        case SIMPLE_NODE_INFORMATION_REQUEST: handled[8]++; break;
+        case PRODUCER_CONSUMER_EVENT_REPORT:  if (len == 8) handled[9]++; break;
+        case IDENTIFY_CONSUMER:               if (len == 8) handled[10]++; break;
+        case IDENTIFY_EVENTS_GLOBAL:
+        case IDENTIFY_EVENTS_ADDRESSED:       handled[11]++; break;
+      }
+    }
+};
+
+class ChainNetwork : public BenchListener {
+  public:
+    void processLCCMessage(uint8_t frameType, uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+      switch (frameType) {
+        case 1: processGlobalAndAddressedMessage(mti_or_dst, srcAlias, data, len); break;
+        case 2: handled[15]++; break;
+      }
+    }
+
+    void processGlobalAndAddressedMessage(uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+      switch (mti_or_dst) {
+        case VERIFY_NODE_ID_ADDRESSED: if (isForUs(data, len)) handled[0]++; break;
+        case VERIFY_NODE_ID_GLOBAL:    if (len == 0) handled[1]++; break;
+        case PROTOCOL_SUPPORT_INQUIRY: if (isForUs(data, len)) handled[2]++; break;
+        case INIT_COMPLETE_FULL:
+        case INIT_COMPLETE_SIMPLE:
+        case VERIFIED_NODE_ID_FULL:
+        case VERIFIED_NODE_ID_SIMPLE:  if (len == 6) handled[3]++; break;
+        case OPTIONAL_INTERACTION_REJ:
+        case TERMINATE_DUE_TO_ERROR:
+        case PROTOCOL_SUPPORT_REPLY:   break;
+        case PRODUCER_CONSUMER_EVENT_REPORT:
+        case IDENTIFY_CONSUMER:
+        case IDENTIFY_EVENTS_GLOBAL:   appListener->processApplicationMessage(mti_or_dst, srcAlias, data, len); break;
+        case STREAM_INITIATE_REQUEST:
+        case STREAM_INITIATE_REPLY:
+        case STREAM_DATA_PROCEED:
+        case STREAM_DATA_COMPLETE:     if (isForUs(data, len)) handled[4]++; break;
+        case DATAGRAM_RECEIVED_OK:     handled[5]++; break;
+        case DATAGRAM_REJECTED:        if (len >= 4) handled[6]++; break;
+        default:
+          if ((mti_or_dst & 0x0008) > 0 && isForUs(data, len)) {
+            appListener->processApplicationMessage(mti_or_dst, srcAlias, data, len);
+          }
+          break;
+      }
+    }
+
+    ChainApplicationListener *appListener;
+};
+
+/* -------------------------------------------------------------
+ *  The table. Same MTIs and flags as the node's
+ */
+class TableApplication {
+  public:
+    static constexpr void registerMessageHandlers(MtiDispatchClass &dispatch) {
+      dispatch.add(SIMPLE_NODE_INFORMATION_REQUEST, MTI_ADDRESSED | MTI_APPLICATION, MTI_HANDLER(TableApplication, snipRequest));
+      dispatch.add(PRODUCER_CONSUMER_EVENT_REPORT,  MTI_GLOBAL | MTI_APPLICATION,    MTI_HANDLER(TableApplication, eventReport));
+      dispatch.add(IDENTIFY_CONSUMER,               MTI_GLOBAL | MTI_APPLICATION,    MTI_HANDLER(TableApplication, identifyConsumer));
+      dispatch.add(IDENTIFY_EVENTS_GLOBAL,          MTI_GLOBAL | MTI_APPLICATION,    MTI_HANDLER(TableApplication, identifyEvents));
+      dispatch.add(IDENTIFY_EVENTS_ADDRESSED,       MTI_ADDRESSED | MTI_APPLICATION, MTI_HANDLER(TableApplication, identifyEvents));
+    }
+
+    void snipRequest(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { handled[8]++; }
+    void eventReport(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { if (len == 8) handled[9]++; }
+    void identifyConsumer(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { if (len == 8) handled[10]++; }
+    void identifyEvents(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { handled[11]++; }
+};
+
+class TableNetwork : public BenchListener {
+  public:
+    static constexpr void registerMessageHandlers(MtiDispatchClass &dispatch) {
+      dispatch.add(VERIFY_NODE_ID_ADDRESSED, MTI_ADDRESSED, MTI_HANDLER(TableNetwork, verifyNodeIDAddressed));
+      dispatch.add(VERIFY_NODE_ID_GLOBAL,    MTI_GLOBAL,    MTI_HANDLER(TableNetwork, verifyNodeIDGlobal));
+      dispatch.add(PROTOCOL_SUPPORT_INQUIRY, MTI_ADDRESSED, MTI_HANDLER(TableNetwork, protocolSupportInquiry));
+      dispatch.add(INIT_COMPLETE_FULL,       MTI_GLOBAL,    MTI_HANDLER(TableNetwork, nodeIdentified));
+      dispatch.add(INIT_COMPLETE_SIMPLE,     MTI_GLOBAL,    MTI_HANDLER(TableNetwork, nodeIdentified));
+      dispatch.add(VERIFIED_NODE_ID_FULL,    MTI_GLOBAL,    MTI_HANDLER(TableNetwork, nodeIdentified));
+      dispatch.add(VERIFIED_NODE_ID_SIMPLE,  MTI_GLOBAL,    MTI_HANDLER(TableNetwork, nodeIdentified));
+      dispatch.add(STREAM_INITIATE_REQUEST,  MTI_ADDRESSED, MTI_HANDLER(TableNetwork, streamMessage));
+      dispatch.add(STREAM_INITIATE_REPLY,    MTI_ADDRESSED, MTI_HANDLER(TableNetwork, streamMessage));
+      dispatch.add(STREAM_DATA_PROCEED,      MTI_ADDRESSED, MTI_HANDLER(TableNetwork, streamMessage));
+      dispatch.add(STREAM_DATA_COMPLETE,     MTI_ADDRESSED, MTI_HANDLER(TableNetwork, streamMessage));
+      dispatch.add(DATAGRAM_RECEIVED_OK,     MTI_ADDRESSED, MTI_HANDLER(TableNetwork, datagramReceivedOK));
+      dispatch.add(DATAGRAM_REJECTED,        MTI_ADDRESSED, MTI_HANDLER(TableNetwork, datagramRejected));
+    }
+
+    void processLCCMessage(uint8_t frameType, uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+      switch (frameType) {
+        case 1: processGlobalAndAddressedMessage(mti_or_dst, srcAlias, data, len); break;
+        case 2: handled[15]++; break;
+      }
+    }
+
+    void processGlobalAndAddressedMessage(uint16_t mti_or_dst, uint16_t srcAlias, uint8_t data[], uint8_t len) {
+      const mtiHandler *handler = messageDispatch->find(mti_or_dst);
+      if (handler == NULL) return;
+      if ((handler->flags & MTI_ADDRESSED) && !isForUs(data, len)) return;
+      handler->handle(handler->flags & MTI_APPLICATION ? applicationLayer : this, mti_or_dst, srcAlias, data, len);
+    }
+
+    void verifyNodeIDAddressed(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { handled[0]++; }
+    void verifyNodeIDGlobal(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { if (len == 0) handled[1]++; }
+    void protocolSupportInquiry(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { handled[2]++; }
+    void nodeIdentified(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { if (len == 6) handled[3]++; }
+    void streamMessage(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { handled[4]++; }
+    void datagramReceivedOK(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { handled[5]++; }
+    void datagramRejected(uint16_t mti, uint16_t srcAlias, uint8_t data[], uint8_t len) { if (len >= 4) handled[6]++; }
+
+    const MtiDispatchClass *messageDispatch;
+    void *applicationLayer;
+};
+
+static constexpr MtiDispatchClass buildMessageDispatch() {
+  MtiDispatchClass dispatch;
+  TableNetwork::registerMessageHandlers(dispatch);
+  TableApplication::registerMessageHandlers(dispatch);
+  return dispatch;
+}
+
+static constexpr MtiDispatchClass messageDispatch = buildMessageDispatch();
+
+/* -------------------------------------------------------------
+ *  Traffic
+ */
+static benchMessage message(uint16_t mti, uint16_t dst, uint8_t len) {
+  benchMessage m = { mti, { 0 }, len };
+  if (dst != 0) {
+    m.data[0] = dst >> 8;
+    m.data[1] = dst & 0xFF;
+  }
+  for (uint8_t i = dst != 0 ? 2 : 0; i < len; i++) m.data[i] = 0x10 + i;
+  return m;
+}
+
+static std::vector<benchMessage> eventTraffic() {
+  std::vector<benchMessage> mix;
+  for (int i = 0; i < 14; i++) mix.push_back(message(PRODUCER_CONSUMER_EVENT_REPORT, 0, 8));
+  mix.push_back(message(IDENTIFY_CONSUMER, 0, 8));
+  mix.push_back(message(VERIFIED_NODE_ID_FULL, 0, 6));
+  return mix;
+}
+
+// Events, nodes announcing themselves and configuration tools talking to other nodes
+static std::vector<benchMessage> layoutTraffic() {
+  std::vector<benchMessage> mix;
+  for (int i = 0; i < 6; i++) mix.push_back(message(PRODUCER_CONSUMER_EVENT_REPORT, 0, 8));
+  mix.push_back(message(VERIFIED_NODE_ID_FULL, 0, 6));
+  mix.push_back(message(INIT_COMPLETE_FULL, 0, 6));
+  mix.push_back(message(VERIFY_NODE_ID_GLOBAL, 0, 6));
+  mix.push_back(message(SIMPLE_NODE_INFORMATION_REQUEST, OTHER_ALIAS, 2));
+  mix.push_back(message(0xA08, OTHER_ALIAS, 8));                          // SNIP reply
+  mix.push_back(message(DATAGRAM_RECEIVED_OK, OUR_ALIAS, 2));
+  mix.push_back(message(PROTOCOL_SUPPORT_REPLY, OTHER_ALIAS, 8));
+  mix.push_back(message(IDENTIFY_CONSUMER, 0, 8));
+  mix.push_back(message(PRODUCER_IDENTIFIED_VALID, 0, 8));
+  mix.push_back(message(IDENTIFY_EVENTS_ADDRESSED, OTHER_ALIAS, 2));
+  return mix;
+}
+
+static std::vector<benchMessage> addressedTraffic() {
+  std::vector<benchMessage> mix;
+  mix.push_back(message(SIMPLE_NODE_INFORMATION_REQUEST, OUR_ALIAS, 2));
+  mix.push_back(message(VERIFY_NODE_ID_ADDRESSED, OUR_ALIAS, 2));
+  mix.push_back(message(PROTOCOL_SUPPORT_INQUIRY, OUR_ALIAS, 2));
+  mix.push_back(message(IDENTIFY_EVENTS_ADDRESSED, OUR_ALIAS, 2));
+  mix.push_back(message(DATAGRAM_RECEIVED_OK, OUR_ALIAS, 2));
+  mix.push_back(message(DATAGRAM_REJECTED, OUR_ALIAS, 4));
+  mix.push_back(message(STREAM_DATA_PROCEED, OUR_ALIAS, 6));
+  mix.push_back(message(STREAM_DATA_COMPLETE, OUR_ALIAS, 6));
+  return mix;
+}
+
+static uint64_t nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// ns per message of one round. The listener is reached through a pointer the compiler
+// cannot see through, like frameHandler() reaches the network layer
+static double round(BenchListener *volatile *listener, std::vector<benchMessage> &mix) {
+  size_t mask = mix.size() - 1;
+  uint64_t start = nowNanos();
+  for (uint32_t i = 0; i < MESSAGES; i++) {
+    benchMessage &m = mix[i & mask];
+    (*listener)->processLCCMessage(1, m.mti, OTHER_ALIAS, m.data, m.len);
+  }
+  return (double) (nowNanos() - start) / MESSAGES;
+}
+
+static double percentile(std::vector<double> values, int p) {
+  std::sort(values.begin(), values.end());
+  return values[(values.size() - 1) * p / 100];
+}
+
+int main() {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(sched_getcpu(), &cpus);
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) perror("sched_setaffinity");
+
+  ChainApplication chainApplication;
+  ChainNetwork chainNetwork;
+  chainNetwork.appListener = &chainApplication;
+  TableApplication tableApplication;
+  TableNetwork tableNetwork;
+  tableNetwork.messageDispatch = &messageDispatch;
+  tableNetwork.applicationLayer = &tableApplication;
+
+  printf("Dispatch table: %u MTIs in %u slots, longest probe %u\n",
+         messageDispatch.registered, MTI_DISPATCH_SLOTS, messageDispatch.longestProbe);
+
+  struct { const char *name; std::vector<benchMessage> mix; } mixes[] = {
+    { "event reports", eventTraffic() },
+    { "layout traffic", layoutTraffic() },
+    { "addressed to us", addressedTraffic() },
+  };
+
+  bool differ = false;
+  for (auto &m : mixes) {
+    // Same handlers reached both ways
+    uint32_t chainHandled[16], tableHandled[16];
+    BenchListener *volatile listener = &chainNetwork;
+    memset(handled, 0, sizeof(handled));
+    round(&listener, m.mix);
+    memcpy(chainHandled, handled, sizeof(handled));
+    listener = &tableNetwork;
+    memset(handled, 0, sizeof(handled));
+    round(&listener, m.mix);
+    memcpy(tableHandled, handled, sizeof(handled));
+
+    std::vector<double> chain, table, ratio;
+    for (int r = 0; r < ROUNDS; r++) {
+      listener = &chainNetwork;
+      chain.push_back(round(&listener, m.mix));
+      listener = &tableNetwork;
+      table.push_back(round(&listener, m.mix));
+      ratio.push_back(table.back() / chain.back());
+    }
+
+    printf("%-16s  switch chain %6.2f ns/message   table %6.2f ns/message   table/chain %+6.1f %% (%+6.1f .. %+6.1f)\n",
+           m.name, percentile(chain, 50), percentile(table, 50), 100.0 * (percentile(ratio, 50) - 1),
+           100.0 * (percentile(ratio, 25) - 1), 100.0 * (percentile(ratio, 75) - 1));
+    if (memcmp(chainHandled, tableHandled, sizeof(handled)) != 0) {
+      printf("ERROR: %s reached different handlers\n", m.name);
+      differ = true;
+    }
+  }
+  return differ ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+/* -------------------------------------------------------------
+ *  Datagram transmit latency benchmark
+ *
+ *  A configuration tool on the virtual bus (125 kbit/s, simulated clock) reads the CDI with
+ *  Memory Configuration read datagrams. Latency is measured from the moment the tool sends the
+ *  request until the last frame of the reply datagram arrives.
+ *
+ *  Then the same reads are repeated with a Verify Node ID Global sent as soon as the first frame
+ *  of each reply arrives, and the latency of the Verified Node ID answer is measured: with TX
+ *  priority classes it does not wait for the rest of the datagram.
+ *
+ *  Build from the sketch folder, TX complete driven (default) and 2 ms polling timer:
+ *    g++ -std=gnu++14 -O2 -I. canboose_*.cpp host/canboose_bench_txlatency.cpp -o bench_txlatency
+ *    g++ -std=gnu++14 -O2 -I. -DTX_DRAIN_POLLING canboose_*.cpp host/canboose_bench_txlatency.cpp -o bench_txlatency_polling
+ */
+
+#include "canboose_applicationlayer.h"
+
+uint8_t UID_array[6] = { 0x05, 0x01, 0x01, 0x01, 0x2D, 0x00 };
+
+#define TOOL_ALIAS  0x0AAA
+#define REQUESTS    200
+
+static void runNode(void *node) {
+  ((ApplicationLayer*) node)->run();
+}
+
+class BenchTool : public CanDriverListener {
+  public:
+    BenchTool(VirtualCanBus *bus) : driver(bus) {}
+
+    void send(uint32_t header, const uint8_t data[], uint8_t len) {
+      canFrame frame = {0, {1, 0, 0}, 0};
+      frame.id = (header & 0x1FFFF000) | TOOL_ALIAS;
+      frame.len = len;
+      memcpy(frame.buf, data, len);
+      while (!driver.write(frame)) hostRunNextEvent(HOST_NO_EVENT);
+    }
+
+    bool frameHandler(canFrame &frame) {
+      if ((frame.id & 0xFFFFF000) == AMD) nodeAlias = frame.id & 0xFFF;
+
+      // Last (or only) frame of a datagram for us
+      uint8_t frameType = (frame.id >> 24) & 0x1F;
+      if (((frame.id >> 12) & 0xFFF) == TOOL_ALIAS && (frameType == 0x1A || frameType == 0x1D)) {
+        replyDone = true;
+        replyMicros = hostNowMicros();
+      }
+      if (((frame.id >> 12) & 0xFFF) == TOOL_ALIAS && frameType == 0x1B) replyStarted = true;
+      if ((frame.id & 0x1FFFF000) == (0x19000000 | (VERIFIED_NODE_ID_FULL << 12))) {
+        verifiedDone = true;
+        verifiedMicros = hostNowMicros();
+      }
+      return true;
+    }
+
+    VirtualCanDriver driver;
+    uint16_t nodeAlias = 0;
+    bool replyDone = false;
+    bool replyStarted = false;
+    uint64_t replyMicros = 0;
+    bool verifiedDone = false;
+    uint64_t verifiedMicros = 0;
+};
+
+int main() {
+  hostUseSimulatedClock(true);
+
+  VirtualCanBus bus(125000);
+  VirtualCanDriver canDriver(&bus);
+  HostStorage storage;
+  BenchTool tool(&bus);
+  ApplicationLayer app;
+
+  tool.driver.begin(125000, &tool);
+  app.init(&canDriver, &storage);
+  hostAddLoop(runNode, &app);
+  hostRunUntil(hostNowMicros() + 300000);
+  if (tool.nodeAlias == 0) {
+    printf("Node did not reach permitted state\n");
+    return 1;
+  }
+
+  uint8_t dst[2] = { (uint8_t) (tool.nodeAlias >> 8), (uint8_t) (tool.nodeAlias & 0xFF) };
+  uint64_t total = 0, worst = 0, best = HOST_NO_EVENT;
+
+  for (int i = 0; i < REQUESTS; i++) {
+    // Read 64 bytes of CDI. Reply is a 9 frames datagram preceded by Datagram Received OK
+    uint32_t address = (i * 64) % 1024;
+    uint8_t readCDI[7] = { 0x20, 0x43, (uint8_t) (address >> 24), (uint8_t) (address >> 16),
+                           (uint8_t) (address >> 8), (uint8_t) address, 0x40 };
+    tool.replyDone = false;
+    uint64_t start = hostNowMicros();
+    tool.send(0x1A000000 | ((uint32_t) tool.nodeAlias << 12), readCDI, 7);
+    while (!tool.replyDone && hostRunNextEvent(start + 1000000));
+    if (!tool.replyDone) {
+      printf("No reply to request %d\n", i);
+      return 1;
+    }
+
+    uint64_t latency = tool.replyMicros - start;
+    total += latency;
+    if (latency > worst) worst = latency;
+    if (latency < best) best = latency;
+
+    // Acknowledge it and let the bus go idle
+    uint8_t ok[3] = { dst[0], dst[1], 0x00 };
+    tool.send(0x19000000 | (DATAGRAM_RECEIVED_OK << 12), ok, 3);
+    hostRunUntil(hostNowMicros() + 5000);
+  }
+
+  // Verify Node ID Global while a reply datagram is being sent
+  uint64_t verifyTotal = 0, verifyWorst = 0;
+  for (int i = 0; i < REQUESTS; i++) {
+    uint32_t address = (i * 64) % 1024;
+    uint8_t readCDI[7] = { 0x20, 0x43, (uint8_t) (address >> 24), (uint8_t) (address >> 16),
+                           (uint8_t) (address >> 8), (uint8_t) address, 0x40 };
+    tool.replyDone = false;
+    tool.replyStarted = false;
+    tool.verifiedDone = false;
+    uint64_t start = hostNowMicros();
+    tool.send(0x1A000000 | ((uint32_t) tool.nodeAlias << 12), readCDI, 7);
+    while (!tool.replyStarted && hostRunNextEvent(start + 1000000));
+
+    uint64_t verifyStart = hostNowMicros();
+    tool.send(0x19000000 | (VERIFY_NODE_ID_GLOBAL << 12), NULL, 0);
+    while (!(tool.replyDone && tool.verifiedDone) && hostRunNextEvent(start + 1000000));
+    if (!tool.verifiedDone || !tool.replyDone) {
+      printf("No reply to verify %d\n", i);
+      return 1;
+    }
+
+    uint64_t latency = tool.verifiedMicros - verifyStart;
+    verifyTotal += latency;
+    if (latency > verifyWorst) verifyWorst = latency;
+
+    uint8_t ok[3] = { dst[0], dst[1], 0x00 };
+    tool.send(0x19000000 | (DATAGRAM_RECEIVED_OK << 12), ok, 3);
+    hostRunUntil(hostNowMicros() + 5000);
+  }
+
+  // Request + Datagram Received OK + 9 frames of reply, back to back
+  canFrame request = {0, {1, 0, 0}, 7};
+  canFrame ack = {0, {1, 0, 0}, 3};
+  canFrame full = {0, {1, 0, 0}, 8};
+  canFrame last = {0, {1, 0, 0}, 6};
+  uint32_t busOnly = bus.frameMicros(request) + bus.frameMicros(ack) + 8 * bus.frameMicros(full) + bus.frameMicros(last);
+
+#if defined(TX_DRAIN_POLLING)
+  printf("TX drain: %u us polling timer\n", TX_WATCHDOG_MICROS);
+#else
+  printf("TX drain: TX complete events, %u us watchdog\n", TX_WATCHDOG_MICROS);
+#endif
+  printf("Datagram read latency over %d requests: mean %.3f ms  min %.3f ms  max %.3f ms  (bus time alone %.3f ms)\n",
+         REQUESTS, total / 1000.0 / REQUESTS, best / 1000.0, worst / 1000.0, busOnly / 1000.0);
+  printf("Verified Node ID latency during a reply datagram: mean %.3f ms  max %.3f ms\n",
+         verifyTotal / 1000.0 / REQUESTS, verifyWorst / 1000.0);
+
+  const char *classNames[TX_CLASSES] = { "control", "event", "addressed", "bulk" };
+  txClassStats *stats = app.network.frameTransferLayer.txStats;
+  for (int c = 0; c < TX_CLASSES; c++) {
+    printf("TX class %-9s %6u frames  queued mean %.3f ms  max %.3f ms  %u promoted\n", classNames[c], stats[c].frames,
+           stats[c].frames ? stats[c].totalMicros / 1000.0 / stats[c].frames : 0.0, stats[c].maxMicros / 1000.0, stats[c].promoted);
+  }
+  return 0;
+}
@@ -0,0 +1,262 @@
+/* -------------------------------------------------------------
+ *  Startup of many nodes on one bus
+ *
+ *  Instantiates a number of independent node stacks, each with its own Node ID, EEPROM and
+ *  virtual CAN driver, on one virtual bus at 125 kbit/s with arbitration and a simulated clock,
+ *  powers them up together (or spread over a time window) and follows the alias allocation
+ *  from a bus monitor. Reports the time until every node is permitted (its Alias Map Definition
+ *  is on the bus) and has sent Initialization Complete, alias collisions, the CAN control frames
+ *  it took and the bus load during startup.
+ *
+ *  Build from the sketch folder:
+ *    g++ -std=gnu++14 -O2 -I. canboose_*.cpp host/canboose_busim.cpp -o canboose_busim
+ *    ./canboose_busim -n 200           200 nodes powered up at the same moment
+ *    -w millis                         Power-up times spread at random over this window
+ *    -s seed                           Random seed. Every node gets its own alias sequence from it
+ *    -t seconds                        Give up after this much bus time (default 60)
+ */
+
+#include <unistd.h>
+#include <algorithm>
+#include <new>
+#include "canboose_applicationlayer.h"
+
+uint8_t UID_array[6] = { 0x05, 0x01, 0x01, 0x01, 0x2D, 0x00 };
+
+#define LOAD_WINDOW_MICROS  100000    // Bus load is also reported for the busiest window of this length
+
+struct simNode {
+  simNode(VirtualCanBus *bus) : driver(bus), storage(4096) {}
+
+  VirtualCanDriver driver;
+  HostStorage storage;
+  ApplicationLayer app;
+  uint8_t nodeID[6];
+  uint64_t powerUpMicros = 0;
+  uint64_t permittedMicros = 0;     // Last AMD seen. 0 while the node has none
+  uint64_t initializedMicros = 0;   // Initialization Complete seen
+  uint16_t alias = 0;
+};
+
+static void runNode(void *node) {
+  ((ApplicationLayer*) node)->run();
+}
+
+/* -------------------------------------------------------------
+ *  Bus monitor. Sees every frame like a CAN analyser would
+ */
+class BusMonitor : public CanDriverListener {
+  public:
+    BusMonitor(VirtualCanBus *virtualBus) : driver(virtualBus), bus(virtualBus) {}
+
+    bool frameHandler(canFrame &frame) {
+      uint64_t now = hostNowMicros();
+      uint32_t micros = bus->frameMicros(frame);
+      uint32_t header = frame.id & 0xFFFFF000;
+      uint8_t cid = frame.id >> 24;
+
+      if (cid >= 0x14 && cid <= 0x17) {
+        checkIDFrames++;
+        if (cid == 0x17) checkIDSequences++;
+      }
+      else if (header == RID) reserveIDFrames++;
+      else if (header == AMD) {
+        mapDefinitionFrames++;
+        simNode *node = findNode(frame);
+        if (node != NULL) {
+          if (node->permittedMicros == 0) permittedNodes++;
+          node->permittedMicros = now;
+          node->alias = frame.id & 0xFFF;
+        }
+      }
+      // A node giving its alias up is not permitted until its next AMD. It stays
+      // initialized: with a spare alias it goes straight to that AMD
+      else if (header == AMR) {
+        aliasResets++;
+        simNode *node = findNode(frame);
+        if (node != NULL && node->permittedMicros != 0) {
+          node->permittedMicros = 0;
+          permittedNodes--;
+        }
+      }
+      else if ((frame.id & 0x0FFFF000) == (0x09000000 | (INIT_COMPLETE_FULL << 12))) {
+        initCompleteFrames++;
+        simNode *node = findNode(frame);
+        if (node != NULL && node->initializedMicros == 0) {
+          node->initializedMicros = now;
+          initializedNodes++;
+        }
+      }
+      else otherFrames++;
+
+      busyMicros += micros;
+      if (initializedNodes == nodes.size() && permittedNodes == nodes.size() && allInitializedMicros == 0) {
+        allInitializedMicros = now;
+        busyAtAllInitialized = busyMicros;
+      }
+      else if (initializedNodes < nodes.size() || permittedNodes < nodes.size()) {
+        allInitializedMicros = 0;
+      }
+
+      // Bus time of the frame, split between the windows it was in. It ends now
+      for (uint64_t t = now - micros; t < now; ) {
+        size_t window = t / LOAD_WINDOW_MICROS;
+        uint64_t end = std::min(now, (uint64_t) (window + 1) * LOAD_WINDOW_MICROS);
+        if (windowMicros.size() <= window) windowMicros.resize(window + 1, 0);
+        windowMicros[window] += end - t;
+        t = end;
+      }
+      return true;
+    }
+
+    simNode* findNode(canFrame &frame) {
+      if (frame.len != 6) return NULL;
+      for (size_t i = 0; i < nodes.size(); i++) {
+        if (memcmp(nodes[i]->nodeID, frame.buf, 6) == 0) return nodes[i];
+      }
+      return NULL;
+    }
+
+    VirtualCanDriver driver;
+    VirtualCanBus *bus;
+    std::vector<simNode*> nodes;
+    uint32_t checkIDFrames = 0;
+    uint32_t checkIDSequences = 0;
+    uint32_t reserveIDFrames = 0;
+    uint32_t mapDefinitionFrames = 0;
+    uint32_t aliasResets = 0;             // AMR frames
+    uint32_t initCompleteFrames = 0;
+    uint32_t otherFrames = 0;
+    uint32_t permittedNodes = 0;
+    uint32_t initializedNodes = 0;
+    uint64_t allInitializedMicros = 0;    // When the last node got there, 0 while one is missing
+    uint64_t busyMicros = 0;
+    uint64_t busyAtAllInitialized = 0;
+    std::vector<uint64_t> windowMicros;
+};
+
+static double percentile(std::vector<uint64_t> &values, int p) {
+  if (values.empty()) return 0;
+  return values[(values.size() - 1) * p / 100] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  int count = 100;
+  uint32_t spreadMillis = 0;
+  uint32_t seed = 0x12345678;
+  uint32_t timeoutSeconds = 60;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:w:s:t:")) != -1) {
+    switch (opt) {
+      case 'n': count = atoi(optarg); break;
+      case 'w': spreadMillis = atoi(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      case 't': timeoutSeconds = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-n nodes] [-w spread_millis] [-s seed] [-t timeout_seconds]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (count < 1 || count > 4000) {
+    fprintf(stderr, "Between 1 and 4000 nodes\n");
+    return 2;
+  }
+
+  hostUseSimulatedClock(true);
+  hostRandomSeed(seed);
+  VirtualCanBus bus(125000);
+  BusMonitor monitor(&bus);
+  monitor.driver.begin(125000, &monitor);
+
+  // Node IDs from the sketch one, last two bytes the node number. Power-up order by time
+  for (int i = 0; i < count; i++) {
+    // Frame counters are cache line aligned, plain new does not know before C++17
+    void *memory;
+    if (posix_memalign(&memory, alignof(simNode), sizeof(simNode)) != 0) return 1;
+    simNode *node = new (memory) simNode(&bus);
+    memcpy(node->nodeID, UID_array, 6);
+    node->nodeID[4] = i >> 8;
+    node->nodeID[5] = i & 0xFF;
+    if (spreadMillis > 0) node->powerUpMicros = halRandom(0, spreadMillis * 1000);
+    monitor.nodes.push_back(node);
+  }
+  std::vector<simNode*> powerUp = monitor.nodes;
+  std::stable_sort(powerUp.begin(), powerUp.end(),
+                   [](const simNode *a, const simNode *b) { return a->powerUpMicros < b->powerUpMicros; });
+
+  uint64_t start = hostNowMicros();
+  for (size_t i = 0; i < powerUp.size(); i++) {
+    hostRunUntil(start + powerUp[i]->powerUpMicros);
+    powerUp[i]->app.init(&powerUp[i]->driver, &powerUp[i]->storage, powerUp[i]->nodeID);
+    hostAddLoop(runNode, &powerUp[i]->app);
+  }
+
+  // Until every node has announced itself and nobody has given its alias up for a second,
+  // or the time is up. A node permitted too early can still lose its alias to a later one
+  uint64_t deadline = start + (uint64_t) timeoutSeconds * 1000000;
+  while (hostNowMicros() < deadline &&
+         (monitor.allInitializedMicros == 0 || hostNowMicros() - monitor.allInitializedMicros < 1000000)) {
+    hostRunUntil(hostNowMicros() + 10000);
+  }
+  bool settled = monitor.allInitializedMicros != 0;
+  uint64_t finished = settled ? monitor.allInitializedMicros : hostNowMicros();
+  uint64_t busyAtFinish = settled ? monitor.busyAtAllInitialized : monitor.busyMicros;
+
+  // The aliases held must be unique
+  uint32_t duplicates = 0;
+  uint32_t collisions = 0;
+  uint32_t sparesUsed = 0;
+  std::vector<uint16_t> aliases;
+  for (int i = 0; i < count; i++) {
+    aliases.push_back(monitor.nodes[i]->app.network.frameTransferLayer.sourceNodeID);
+    collisions += monitor.nodes[i]->app.network.frameTransferLayer.counters.aliasCollisions;
+    sparesUsed += monitor.nodes[i]->app.network.frameTransferLayer.spareAliasesUsed;
+  }
+  std::sort(aliases.begin(), aliases.end());
+  for (size_t i = 1; i < aliases.size(); i++) {
+    if (aliases[i] == aliases[i - 1]) duplicates++;
+  }
+
+  std::vector<uint64_t> permitted;
+  std::vector<uint64_t> initialized;
+  for (int i = 0; i < count; i++) {
+    simNode *node = monitor.nodes[i];
+    if (node->permittedMicros) permitted.push_back(node->permittedMicros - start - node->powerUpMicros);
+    if (node->initializedMicros) initialized.push_back(node->initializedMicros - start - node->powerUpMicros);
+  }
+  std::sort(permitted.begin(), permitted.end());
+  std::sort(initialized.begin(), initialized.end());
+
+  uint64_t busiest = 0;
+  for (size_t i = 0; i < monitor.windowMicros.size() && i * LOAD_WINDOW_MICROS < finished - start; i++) {
+    busiest = std::max(busiest, monitor.windowMicros[i]);
+  }
+
+  printf("%d nodes, power-up spread %u ms, seed 0x%08X\n", count, spreadMillis, seed);
+  if (!settled) {
+    printf("Only %u nodes permitted and %u initialized after %u s\n", monitor.permittedNodes, monitor.initializedNodes, timeoutSeconds);
+  }
+  else {
+    printf("All permitted and initialized %.3f ms after the first power-up\n", (finished - start) / 1000.0);
+  }
+  printf("Per node, from its power-up:\n");
+  printf("  permitted    p50 %9.3f ms  p90 %9.3f ms  max %9.3f ms\n", percentile(permitted, 50), percentile(permitted, 90), percentile(permitted, 100));
+  printf("  initialized  p50 %9.3f ms  p90 %9.3f ms  max %9.3f ms\n", percentile(initialized, 50), percentile(initialized, 90), percentile(initialized, 100));
+  printf("Alias collisions %u, CheckID sequences %u (%.2f per node, spare aliases included), Alias Map Resets %u, spare aliases used %u\n",
+         collisions, monitor.checkIDSequences, (double) monitor.checkIDSequences / count, monitor.aliasResets, sparesUsed);
+  printf("Frames: %u CheckID, %u Reserve ID, %u AMD, %u AMR, %u Init Complete, %u other. %u on the bus in total\n",
+         monitor.checkIDFrames, monitor.reserveIDFrames, monitor.mapDefinitionFrames, monitor.aliasResets,
+         monitor.initCompleteFrames, monitor.otherFrames, bus.framesTransferred);
+  printf("Bus load during startup %.1f %%, busiest %u ms window %.1f %%\n",
+         finished > start ? 100.0 * busyAtFinish / (finished - start) : 0.0, LOAD_WINDOW_MICROS / 1000,
+         100.0 * busiest / LOAD_WINDOW_MICROS);
+  if (duplicates > 0) printf("ERROR: %u nodes share an alias with another\n", duplicates);
+
+  // Every frame on the bus is in exactly one category
+  uint32_t counted = monitor.checkIDFrames + monitor.reserveIDFrames + monitor.mapDefinitionFrames + monitor.aliasResets +
+                     monitor.initCompleteFrames + monitor.otherFrames;
+  if (counted != bus.framesTransferred) printf("ERROR: monitor counted %u frames, the bus transferred %u\n", counted, bus.framesTransferred);
+
+  return duplicates > 0 || !settled || counted != bus.framesTransferred ? 1 : 0;
+}
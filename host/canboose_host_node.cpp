@@ -0,0 +1,216 @@
+/* -------------------------------------------------------------
+ *  Canboose Node on a Linux host
+ *
+ *  Build from the sketch folder:
+ *    g++ -std=gnu++14 -O2 -I. canboose_*.cpp host/canboose_host_node.cpp -o canboose_host_node
+ *
+ *  canboose_host_node                  In-process virtual bus with a simulated clock. A small
+ *                                      configuration tool names the node, asks for its identity,
+ *                                      SNIP and the first CDI block and prints every frame, then
+ *                                      reads the statistics space
+ *  canboose_host_node -i vcan0         Real node on a SocketCAN interface (real clock)
+ *  -e file                             File backed EEPROM (default: RAM only)
+ *  -t                                  Dump the flight recorder at the end of the virtual bus run.
+ *                                      Build with -DCANBOOSE_TRACE, decode with canboose_tracedecode
+ */
+
+#include <unistd.h>
+#include "canboose_applicationlayer.h"
+
+uint8_t UID_array[6] = { 0x05, 0x01, 0x01, 0x01, 0x2D, 0x00 };
+
+#define TOOL_ALIAS  0x0AAA
+
+static void runNode(void *node) {
+  ((ApplicationLayer*) node)->run();
+}
+
+static void printFrame(const char *who, canFrame &frame) {
+  printf("%10.3f ms  %s  %08X [%d]", hostNowMicros() / 1000.0, who, frame.id, frame.len);
+  for (int i = 0; i < frame.len; i++) printf(" %02X", frame.buf[i]);
+  printf("\n");
+}
+
+/* -------------------------------------------------------------
+ *  A tiny configuration tool living on the virtual bus
+ */
+class ConfigurationTool : public CanDriverListener {
+  public:
+    ConfigurationTool(VirtualCanBus *bus) : driver(bus) {}
+
+    void begin() {
+      driver.begin(125000, this);
+    }
+
+    void send(uint32_t header, const uint8_t data[], uint8_t len) {
+      canFrame frame = {0, {1, 0, 0}, 0};
+      frame.id = (header & 0x1FFFF000) | TOOL_ALIAS;
+      frame.len = len;
+      memcpy(frame.buf, data, len);
+      printFrame("tool", frame);
+
+      // Wait for the single TX mailbox
+      while (!driver.write(frame)) hostRunNextEvent(HOST_NO_EVENT);
+    }
+
+    bool frameHandler(canFrame &frame) {
+      printFrame("node", frame);
+
+      // Learn node alias from its Alias Map Definition
+      if ((frame.id & 0xFFFFF000) == AMD) nodeAlias = frame.id & 0xFFF;
+
+      // Acknowledge every datagram ending addressed to us, and keep its data
+      uint8_t frameType = (frame.id >> 24) & 0x1F;
+      if ((frame.id >> 12 & 0xFFF) == TOOL_ALIAS && frameType >= 0x1A && frameType <= 0x1D) {
+        if (frameType == 0x1A || frameType == 0x1B) datagramLen = 0;
+        if (datagramLen + frame.len <= 72) {
+          memcpy(&datagram[datagramLen], frame.buf, frame.len);
+          datagramLen += frame.len;
+        }
+        if (frameType == 0x1A || frameType == 0x1D) pendingAck = true;
+      }
+
+      return true;
+    }
+
+    VirtualCanDriver driver;
+    uint16_t nodeAlias = 0;
+    bool pendingAck = false;
+    uint8_t datagram[72];
+    uint8_t datagramLen = 0;
+};
+
+static void runAcknowledging(ConfigurationTool &tool, uint64_t until) {
+  uint8_t dst[2] = { (uint8_t) (tool.nodeAlias >> 8), (uint8_t) (tool.nodeAlias & 0xFF) };
+  while (hostRunNextEvent(until)) {
+    if (tool.pendingAck) {
+      tool.pendingAck = false;
+      uint8_t ok[3] = { dst[0], dst[1], 0x00 };
+      tool.send(0x19000000 | (DATAGRAM_RECEIVED_OK << 12), ok, 3);
+    }
+  }
+}
+
+static uint32_t statistic(const uint8_t image[], int index) {
+  const uint8_t *p = &image[4 * index];
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static int runVirtualBus(NonVolatileStorage *storage, bool dumpTrace) {
+  hostUseSimulatedClock(true);
+
+  VirtualCanBus bus(125000);
+  VirtualCanDriver canDriver(&bus);
+  ConfigurationTool tool(&bus);
+  ApplicationLayer app;
+
+  tool.begin();
+  if (!app.init(&canDriver, storage)) {
+    fprintf(stderr, "EEPROM too small for user and configuration spaces\n");
+    return 1;
+  }
+  hostAddLoop(runNode, &app);
+
+  // Alias allocation takes at least 250 ms
+  hostRunUntil(hostNowMicros() + 300000);
+  if (tool.nodeAlias == 0) {
+    printf("Node did not reach permitted state\n");
+    return 1;
+  }
+
+  // Node name "Yard" in user space, a two frames datagram
+  uint8_t writeFirst[8] = { 0x20, 0x00, 0x00, 0x00, 0x00, 0x01, 0xFB, 'Y' };
+  uint8_t writeLast[4] = { 'a', 'r', 'd', 0x00 };
+  tool.send(0x1B000000 | ((uint32_t) tool.nodeAlias << 12), writeFirst, 8);
+  tool.send(0x1D000000 | ((uint32_t) tool.nodeAlias << 12), writeLast, 4);
+  hostRunUntil(hostNowMicros() + 20000);
+
+  uint8_t dst[2] = { (uint8_t) (tool.nodeAlias >> 8), (uint8_t) (tool.nodeAlias & 0xFF) };
+  tool.send(0x19000000 | (VERIFY_NODE_ID_GLOBAL << 12), NULL, 0);
+  tool.send(0x19000000 | (SIMPLE_NODE_INFORMATION_REQUEST << 12), dst, 2);
+  hostRunUntil(hostNowMicros() + 100000);
+
+  uint8_t readCDI[7] = { 0x20, 0x43, 0x00, 0x00, 0x00, 0x00, 0x40 };
+  tool.send(0x1A000000 | ((uint32_t) tool.nodeAlias << 12), readCDI, 7);
+
+  runAcknowledging(tool, hostNowMicros() + 200000);
+
+  // Statistics space, 64 bytes at a time
+  uint8_t image[STATISTICS_SPACE_SIZE];
+  for (uint32_t address = 0; address < STATISTICS_SPACE_SIZE; address += 64) {
+    uint8_t count = STATISTICS_SPACE_SIZE - address < 64 ? STATISTICS_SPACE_SIZE - address : 64;
+    uint8_t readStatistics[8] = { 0x20, 0x40, 0x00, 0x00, 0x00, (uint8_t) address, STATISTICS_SPACE, count };
+    tool.datagramLen = 0;
+    tool.send(0x1A000000 | ((uint32_t) tool.nodeAlias << 12), readStatistics, 8);
+    runAcknowledging(tool, hostNowMicros() + 50000);
+    if (tool.datagramLen != 7 + count || tool.datagram[1] != 0x50) {
+      printf("Statistics space read failed\n");
+      return 1;
+    }
+    memcpy(&image[address], &tool.datagram[7], count);
+  }
+
+  printf("Statistics: RX %u control, %u messages, %u datagram frames; TX %u control, %u messages, %u datagram frames\n",
+         statistic(image, 2), statistic(image, 3), statistic(image, 4) + statistic(image, 5) + statistic(image, 6) + statistic(image, 7),
+         statistic(image, 10), statistic(image, 11), statistic(image, 12) + statistic(image, 13) + statistic(image, 14) + statistic(image, 15));
+  printf("            TX queue high water %u/%u/%u/%u, %u interrupts, %u us (max %u us), heap %u bytes\n",
+         statistic(image, 21), statistic(image, 22), statistic(image, 23), statistic(image, 24),
+         statistic(image, 40), statistic(image, 41), statistic(image, 42), statistic(image, 43));
+
+  printf("Bus: %u frames, %.1f %% load\n", bus.framesTransferred, 100.0 * bus.busyMicros / hostNowMicros());
+  printf("Acceptance filter: %u frames accepted, %u filtered\n", canDriver.framesAccepted, canDriver.framesFiltered);
+
+  // Let the write-behind cache flush the name
+  hostRunUntil(hostNowMicros() + STORAGE_FLUSH_IDLE_MILLIS * 1000);
+  StorageManagerClass &s = app.storage;
+  printf("Storage: %u writes, %u flushes, %u bytes written, %u unchanged, last flush %u us (max %u us, %u us in one run)\n",
+         s.writesReceived, s.flushes, s.bytesFlushed, s.bytesSkipped, s.lastFlushMicros, s.maxFlushMicros, s.maxRunMicros);
+
+#if defined(CANBOOSE_TRACE)
+  if (dumpTrace) traceRecorder.dump();
+#else
+  if (dumpTrace) printf("Trace points not compiled in, build with -DCANBOOSE_TRACE\n");
+#endif
+  return 0;
+}
+
+static int runSocketCan(const char *ifName, NonVolatileStorage *storage) {
+  SocketCanDriver canDriver(ifName);
+  ApplicationLayer app;
+
+  if (!app.init(&canDriver, storage)) {
+    fprintf(stderr, "EEPROM too small for user and configuration spaces\n");
+    return 1;
+  }
+  hostAddLoop(runNode, &app);
+  printf("Canboose Node v1.0 on %s\n", ifName);
+
+  for (;;) {
+    hostPoll();
+    usleep(100);
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *ifName = NULL;
+  const char *eepromFile = NULL;
+  bool dumpTrace = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:e:t")) != -1) {
+    switch (opt) {
+      case 'i': ifName = optarg; break;
+      case 'e': eepromFile = optarg; break;
+      case 't': dumpTrace = true; break;
+      default:
+        fprintf(stderr, "Usage: %s [-i can_interface] [-e eeprom_file] [-t]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  HostStorage storage(4096, eepromFile);
+  if (ifName != NULL) return runSocketCan(ifName, &storage);
+  return runVirtualBus(&storage, dumpTrace);
+}
@@ -0,0 +1,452 @@
+/* -------------------------------------------------------------
+ *  Replay of captured bus traffic
+ *
+ *  Reads a candump log ("(1712345678.123456) can0 19490123#", candump -l) or candump screen
+ *  output ("can0  19490123   [0]", with or without a "(timestamp)" first) or GridConnect
+ *  (":X19490123N;"), and feeds every frame to the node's frameHandler() on a simulated clock,
+ *  through the node's acceptance filter like the CAN controller would. The node's own frames
+ *  go out on a virtual bus at 125 kbit/s and are captured.
+ *
+ *  Timing is the original one from the log timestamps, or with -f back to back at bus speed.
+ *  GridConnect has no timestamps, so it is always back to back.
+ *
+ *  -a alias tells which alias the recorded node had. Its frames in the log are not injected,
+ *  they are the expected output, and the recorded alias and the one the node picks here are
+ *  swapped in every frame, both ways, so logs and captured output can be compared directly.
+ *  -e file takes the expected output from another log instead. -w file writes the captured
+ *  output as a candump log, to be used later with -e.
+ *
+ *  Reports replay throughput, response latency per request MTI and the first divergence from
+ *  the expected output.
+ *
+ *  Build from the sketch folder:
+ *    g++ -std=gnu++14 -O2 -I. canboose_*.cpp host/canboose_replay.cpp -o canboose_replay
+ *    ./canboose_replay -a 123 layout.log
+ *    ./canboose_replay -f -w out.log layout.log && ./canboose_replay -f -e out.log layout.log
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include "canboose_applicationlayer.h"
+
+uint8_t UID_array[6] = { 0x05, 0x01, 0x01, 0x01, 0x2D, 0x00 };
+
+struct logFrame {
+  uint64_t micros;      // From the start of the log. 0 when the log has no timestamps
+  canFrame frame;
+};
+
+/* -------------------------------------------------------------
+ *  Log parsing
+ */
+static bool parseHexBytes(const char *text, canFrame &frame, bool spaced) {
+  frame.len = 0;
+  while (*text != 0 && *text != '\n' && *text != '\r' && *text != ';') {
+    if (*text == ' ') {
+      text++;
+      continue;
+    }
+    unsigned int value;
+    if (frame.len == 8 || sscanf(text, "%2x", &value) != 1) return false;
+    frame.buf[frame.len++] = value;
+    text += 2;
+    if (spaced && *text != ' ' && *text != 0 && *text != '\n' && *text != '\r') return false;
+  }
+  return true;
+}
+
+static bool parseLine(const char *line, std::vector<logFrame> &frames, bool &timestamped) {
+  canFrame frame = {0, {1, 0, 0}, 0};
+  double seconds = -1;
+  unsigned int id;
+  int used = 0;
+
+  // GridConnect. Several frames may share a line
+  if (strchr(line, ':') != NULL && strstr(line, ":X") != NULL) {
+    bool found = false;
+    for (const char *p = strstr(line, ":X"); p != NULL; p = strstr(p + 1, ":X")) {
+      char data[32] = "";
+      if (sscanf(p, ":X%8xN%31[0-9A-Fa-f];", &id, data) < 1) continue;
+      frame.id = id & 0x1FFFFFFF;
+      if (!parseHexBytes(data, frame, false)) continue;
+      frames.push_back({ 0, frame });
+      found = true;
+    }
+    return found;
+  }
+
+  // candump. Optional timestamp
+  if (sscanf(line, " (%lf)%n", &seconds, &used) == 1) {
+    line += used;
+    timestamped = true;
+  }
+
+  char interface[32];
+  char rest[128];
+  if (sscanf(line, " %31s %127[^\n]", interface, rest) != 2) return false;
+
+  // Log format: id#data
+  char *hash = strchr(rest, '#');
+  if (hash != NULL) {
+    if (hash[1] == 'R' || sscanf(rest, "%x#", &id) != 1 || hash - rest != 8) return false;
+    frame.id = id & 0x1FFFFFFF;
+    if (!parseHexBytes(hash + 1, frame, false)) return false;
+  }
+  // Screen format: id [len] data
+  else {
+    unsigned int len;
+    if (sscanf(rest, "%x [%u]%n", &id, &len, &used) != 2 || len > 8) return false;
+    frame.id = id & 0x1FFFFFFF;
+    if (!parseHexBytes(rest + used, frame, true) || frame.len != len) return false;
+  }
+
+  frames.push_back({ seconds >= 0 ? (uint64_t) (seconds * 1000000) : 0, frame });
+  return true;
+}
+
+static bool readLog(const char *path, std::vector<logFrame> &frames, bool &timestamped) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+
+  timestamped = false;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    parseLine(line, frames, timestamped);
+  }
+  fclose(f);
+
+  // Relative to the first frame
+  if (timestamped && !frames.empty()) {
+    uint64_t first = frames[0].micros;
+    for (size_t i = 0; i < frames.size(); i++) frames[i].micros -= first;
+  }
+  return true;
+}
+
+static void writeFrame(FILE *f, uint64_t micros, canFrame &frame) {
+  fprintf(f, "(%llu.%06llu) vcan0 %08X#", (unsigned long long) (micros / 1000000), (unsigned long long) (micros % 1000000), frame.id);
+  for (int i = 0; i < frame.len; i++) fprintf(f, "%02X", frame.buf[i]);
+  fprintf(f, "\n");
+}
+
+/* -------------------------------------------------------------
+ *  Aliases. The recorded node's alias and ours are swapped, so
+ *  nothing else on the bus can collide with us
+ */
+static uint16_t recordedAlias = 0;
+static uint16_t nodeAlias = 0;
+
+static uint16_t swapAlias(uint16_t alias) {
+  if (recordedAlias == 0 || nodeAlias == 0) return alias;
+  if (alias == recordedAlias) return nodeAlias;
+  if (alias == nodeAlias) return recordedAlias;
+  return alias;
+}
+
+static bool isAddressedMessage(uint32_t id) {
+  return (id & 0x0F000000) == 0x09000000 && (id & 0x00008000);
+}
+
+static bool hasDestinationField(uint32_t id) {
+  uint8_t frameType = (id >> 24) & 0x0F;
+  return frameType >= 0x0A && frameType <= 0x0F && frameType != 0x0E;
+}
+
+static uint16_t destinationOf(canFrame &frame) {
+  if (hasDestinationField(frame.id)) return (frame.id >> 12) & 0xFFF;
+  if (isAddressedMessage(frame.id) && frame.len >= 2) return ((frame.buf[0] & 0x0F) << 8) | frame.buf[1];
+  return 0;
+}
+
+static void swapAliases(canFrame &frame) {
+  frame.id = (frame.id & ~0xFFFu) | swapAlias(frame.id & 0xFFF);
+  if ((frame.id & 0x08000000) == 0) return;   // CAN control frames have no destination
+
+  if (hasDestinationField(frame.id)) {
+    frame.id = (frame.id & ~0xFFF000u) | ((uint32_t) swapAlias((frame.id >> 12) & 0xFFF) << 12);
+  }
+  else if (isAddressedMessage(frame.id) && frame.len >= 2) {
+    uint16_t dst = swapAlias(((frame.buf[0] & 0x0F) << 8) | frame.buf[1]);
+    frame.buf[0] = (frame.buf[0] & 0xF0) | (dst >> 8);
+    frame.buf[1] = dst & 0xFF;
+  }
+}
+
+/* -------------------------------------------------------------
+ *  Response latency. A request is answered by the node's first
+ *  frame to the requester; a global one by its first global frame
+ */
+struct latencyStats {
+  uint32_t count = 0;
+  uint32_t unanswered = 0;
+  uint64_t totalMicros = 0;
+  uint64_t maxMicros = 0;
+};
+
+struct pendingRequest {
+  uint16_t key;
+  uint64_t micros;
+};
+
+static std::map<uint16_t, latencyStats> latencies;   // By MTI, 0xD000 + type for datagrams
+static std::map<uint16_t, pendingRequest> pending;   // By requester alias, 0 for global requests
+
+static const char* requestName(uint16_t key) {
+  switch (key) {
+    case VERIFY_NODE_ID_GLOBAL:           return "Verify Node ID Global";
+    case VERIFY_NODE_ID_ADDRESSED:        return "Verify Node ID Addressed";
+    case PROTOCOL_SUPPORT_INQUIRY:        return "Protocol Support Inquiry";
+    case SIMPLE_NODE_INFORMATION_REQUEST: return "Simple Node Information Request";
+    case IDENTIFY_EVENTS_GLOBAL:          return "Identify Events Global";
+    case IDENTIFY_EVENTS_ADDRESSED:       return "Identify Events Addressed";
+    case IDENTIFY_CONSUMER:               return "Identify Consumer";
+    case STREAM_INITIATE_REQUEST:         return "Stream Initiate Request";
+    case 0xD020:                          return "Datagram, memory configuration";
+  }
+  return NULL;
+}
+
+static void requestSeen(canFrame &frame, uint64_t now) {
+  if ((frame.id & 0x08000000) == 0) return;
+  uint8_t frameType = (frame.id >> 24) & 0x07;
+  uint16_t mti = (frame.id >> 12) & 0xFFF;
+  uint16_t key;
+  uint16_t from = frame.id & 0xFFF;
+
+  if (frameType == 1 && (mti == VERIFY_NODE_ID_GLOBAL || mti == IDENTIFY_EVENTS_GLOBAL)) {
+    key = mti;
+    from = 0;
+  }
+  else if (frameType == 1 && isAddressedMessage(frame.id) && destinationOf(frame) == nodeAlias) {
+    // Acknowledges are answers, not requests
+    if (mti == DATAGRAM_RECEIVED_OK || mti == DATAGRAM_REJECTED || mti == STREAM_DATA_PROCEED) return;
+    key = mti;
+  }
+  else if ((frameType == 2 || frameType == 3) && destinationOf(frame) == nodeAlias && frame.len > 0) {
+    key = 0xD000 + frame.buf[0];
+  }
+  else {
+    return;
+  }
+
+  // An older request from the same node that got no answer
+  if (pending.count(from)) latencies[pending[from].key].unanswered++;
+  pending[from] = { key, now };
+}
+
+static void responseSeen(canFrame &frame, uint64_t now) {
+  if ((frame.id & 0x08000000) == 0) return;
+  uint16_t dst = destinationOf(frame);
+  uint16_t from = dst;
+  if (dst == 0 && (frame.id & 0x0F000000) == 0x09000000) from = 0;
+  else if (dst == 0) return;
+
+  std::map<uint16_t, pendingRequest>::iterator p = pending.find(from);
+  if (p == pending.end()) return;
+
+  latencyStats &stats = latencies[p->second.key];
+  uint64_t latency = now - p->second.micros;
+  stats.count++;
+  stats.totalMicros += latency;
+  if (latency > stats.maxMicros) stats.maxMicros = latency;
+  pending.erase(p);
+}
+
+/* -------------------------------------------------------------
+ *  Captures everything the node sends
+ */
+class Capture : public CanDriverListener {
+  public:
+    Capture(VirtualCanBus *bus) : driver(bus) {}
+
+    bool frameHandler(canFrame &frame) {
+      if ((frame.id & 0xFFFFF000) == AMD) nodeAlias = frame.id & 0xFFF;
+      if (!replaying) return true;
+
+      responseSeen(frame, hostNowMicros());
+      canFrame captured = frame;
+      captured.flags.extended = 1;
+      swapAliases(captured);
+      frames.push_back({ hostNowMicros() - replayStart, captured });
+      return true;
+    }
+
+    VirtualCanDriver driver;
+    bool replaying = false;
+    uint64_t replayStart = 0;
+    std::vector<logFrame> frames;
+};
+
+static void runNode(void *node) {
+  ((ApplicationLayer*) node)->run();
+}
+
+static uint64_t wallNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool sameFrame(canFrame &a, canFrame &b) {
+  return a.id == b.id && a.len == b.len && memcmp(a.buf, b.buf, a.len) == 0;
+}
+
+static void printFrame(const char *label, canFrame &frame) {
+  printf("  %-9s %08X [%d]", label, frame.id, frame.len);
+  for (int i = 0; i < frame.len; i++) printf(" %02X", frame.buf[i]);
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  bool fast = false;
+  const char *expectedFile = NULL;
+  const char *writeFile = NULL;
+  const char *eepromFile = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "fa:e:w:s:")) != -1) {
+    switch (opt) {
+      case 'f': fast = true; break;
+      case 'a': recordedAlias = strtoul(optarg, NULL, 16) & 0xFFF; break;
+      case 'e': expectedFile = optarg; break;
+      case 'w': writeFile = optarg; break;
+      case 's': eepromFile = optarg; break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s [-f] [-a recorded_alias] [-e expected_log] [-w output_log] [-s eeprom_file] log\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<logFrame> input;
+  bool timestamped;
+  if (!readLog(argv[optind], input, timestamped)) return 1;
+  if (input.empty()) {
+    fprintf(stderr, "%s: no frames\n", argv[optind]);
+    return 1;
+  }
+  if (!timestamped) fast = true;
+
+  // Recorded node's frames are the expected output unless another log is given
+  std::vector<logFrame> expected;
+  std::vector<logFrame> injected;
+  for (size_t i = 0; i < input.size(); i++) {
+    if (recordedAlias != 0 && (input[i].frame.id & 0xFFF) == recordedAlias) expected.push_back(input[i]);
+    else injected.push_back(input[i]);
+  }
+  if (expectedFile != NULL) {
+    expected.clear();
+    bool unused;
+    if (!readLog(expectedFile, expected, unused)) return 1;
+  }
+
+  // Node on a virtual bus, simulated clock
+  hostUseSimulatedClock(true);
+  VirtualCanBus bus(125000);
+  VirtualCanDriver canDriver(&bus);
+  Capture capture(&bus);
+  HostStorage storage(4096, eepromFile);
+  ApplicationLayer app;
+
+  capture.driver.begin(125000, &capture);
+  app.init(&canDriver, &storage);
+  hostAddLoop(runNode, &app);
+  hostRunUntil(hostNowMicros() + 300000);
+  if (nodeAlias == 0) {
+    printf("Node did not reach permitted state\n");
+    return 1;
+  }
+
+  // Replay
+  capture.replaying = true;
+  capture.replayStart = hostNowMicros();
+  uint64_t next = capture.replayStart;
+  uint32_t filtered = 0;
+  uint64_t wallStart = wallNanos();
+  for (size_t i = 0; i < injected.size(); i++) {
+    canFrame frame = injected[i].frame;
+    swapAliases(frame);
+
+    if (fast) {
+      hostRunUntil(next);
+      next = hostNowMicros() + bus.frameMicros(frame);
+    }
+    else {
+      hostRunUntil(capture.replayStart + injected[i].micros);
+    }
+
+    if (!canDriver.accepts(frame.id)) {
+      filtered++;
+      continue;
+    }
+    requestSeen(frame, hostNowMicros());
+    app.network.frameTransferLayer.frameHandler(frame);
+    app.run();
+  }
+
+  // Let the node finish its answers
+  hostRunUntil(hostNowMicros() + 1000000);
+  uint64_t wallElapsed = wallNanos() - wallStart;
+  uint64_t busElapsed = hostNowMicros() - capture.replayStart;
+  for (std::map<uint16_t, pendingRequest>::iterator p = pending.begin(); p != pending.end(); ++p) {
+    latencies[p->second.key].unanswered++;
+  }
+
+  printf("Replayed %zu frames (%u dropped by the acceptance filter) in %.3f s of bus time, %s timing\n",
+         injected.size(), filtered, busElapsed / 1000000.0, fast ? "back to back" : "original");
+  printf("Wall clock %.3f ms, %.0f frames/s. Node sent %zu frames, bus load %.1f %%\n", wallElapsed / 1000000.0,
+         injected.size() * 1e9 / (wallElapsed > 0 ? wallElapsed : 1), capture.frames.size(), 100.0 * bus.busyMicros / hostNowMicros());
+
+  if (!latencies.empty()) {
+    printf("\nResponse latency by request:\n");
+    for (std::map<uint16_t, latencyStats>::iterator l = latencies.begin(); l != latencies.end(); ++l) {
+      char name[48];
+      const char *known = requestName(l->first);
+      if (known != NULL) snprintf(name, sizeof(name), "%s", known);
+      else if (l->first >= 0xD000) snprintf(name, sizeof(name), "Datagram type 0x%02X", l->first - 0xD000);
+      else snprintf(name, sizeof(name), "MTI 0x%03X", l->first);
+      latencyStats &s = l->second;
+      printf("  %-34s %6u answered  mean %8.3f ms  max %8.3f ms  %u unanswered\n", name, s.count,
+             s.count ? s.totalMicros / 1000.0 / s.count : 0.0, s.maxMicros / 1000.0, s.unanswered);
+    }
+  }
+
+  if (writeFile != NULL) {
+    FILE *f = fopen(writeFile, "w");
+    if (f == NULL) {
+      perror(writeFile);
+      return 1;
+    }
+    for (size_t i = 0; i < capture.frames.size(); i++) writeFrame(f, capture.frames[i].micros, capture.frames[i].frame);
+    fclose(f);
+  }
+
+  // Same frames in the same order. Timing is not compared
+  if (!expected.empty()) {
+    size_t compared = expected.size() < capture.frames.size() ? expected.size() : capture.frames.size();
+    size_t matched = 0;
+    long divergence = -1;
+    for (size_t i = 0; i < compared; i++) {
+      if (sameFrame(expected[i].frame, capture.frames[i].frame)) matched++;
+      else if (divergence < 0) divergence = i;
+    }
+    if (divergence < 0 && expected.size() != capture.frames.size()) divergence = compared;
+
+    printf("\nExpected output: %zu frames, %zu sent, %zu matched\n", expected.size(), capture.frames.size(), matched);
+    if (divergence >= 0) {
+      printf("First divergence at frame %ld:\n", divergence);
+      if ((size_t) divergence < expected.size()) printFrame("expected", expected[divergence].frame);
+      if ((size_t) divergence < capture.frames.size()) printFrame("sent", capture.frames[divergence].frame);
+      return 3;
+    }
+    printf("No divergence\n");
+  }
+  return 0;
+}
@@ -0,0 +1,127 @@
+/* -------------------------------------------------------------
+ *  Flight recorder decoder
+ *
+ *  Reads the text dump written by TraceRecorderClass::dump() (over Serial on the Teensy, on
+ *  stdout with canboose_host_node -t) and prints a latency histogram for each stage of the
+ *  frame path. Lines outside the dump are ignored, so a whole Serial capture can be fed in.
+ *
+ *  Build from the sketch folder. It only needs the trace point definitions:
+ *    g++ -std=gnu++14 -O2 -I. host/canboose_tracedecode.cpp -o canboose_tracedecode
+ *    g++ -std=gnu++14 -O2 -I. -DCANBOOSE_TRACE canboose_*.cpp host/canboose_host_node.cpp -o canboose_host_node
+ *    ./canboose_host_node -t | ./canboose_tracedecode
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+#include "canboose_trace.h"
+
+#define HISTOGRAM_BUCKETS   16    // Powers of two microseconds: <1, 1-2, 2-4 ... >= 16384
+#define HISTOGRAM_WIDTH     40
+
+struct stageSamples {
+  std::map<uint16_t, std::deque<uint32_t> > open;   // Begin ticks waiting for their end, by argument
+  std::vector<uint32_t> ticks;
+};
+
+static void printStage(const traceStage &stage, stageSamples &samples, uint32_t ticksPerMicro) {
+  std::vector<uint32_t> &t = samples.ticks;
+  printf("%s: %zu samples", stage.name, t.size());
+  if (t.empty()) {
+    printf("\n\n");
+    return;
+  }
+
+  std::sort(t.begin(), t.end());
+  double sum = 0;
+  for (size_t i = 0; i < t.size(); i++) sum += t[i];
+  double scale = 1.0 / ticksPerMicro;
+  printf(", min %.2f us  mean %.2f us  p50 %.2f us  p99 %.2f us  max %.2f us\n",
+         t.front() * scale, sum / t.size() * scale, t[t.size() / 2] * scale,
+         t[(t.size() * 99) / 100] * scale, t.back() * scale);
+
+  uint32_t buckets[HISTOGRAM_BUCKETS] = { 0 };
+  uint32_t largest = 0;
+  for (size_t i = 0; i < t.size(); i++) {
+    uint32_t micros = t[i] / ticksPerMicro;
+    int b = 0;
+    while (micros > 0 && b < HISTOGRAM_BUCKETS - 1) {
+      micros >>= 1;
+      b++;
+    }
+    buckets[b]++;
+    if (buckets[b] > largest) largest = buckets[b];
+  }
+
+  for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+    if (buckets[b] == 0) continue;
+    char range[24];
+    if (b == 0) snprintf(range, sizeof(range), "< 1 us");
+    else if (b == HISTOGRAM_BUCKETS - 1) snprintf(range, sizeof(range), ">= %u us", 1u << (b - 1));
+    else snprintf(range, sizeof(range), "%u-%u us", 1u << (b - 1), 1u << b);
+    int bar = (buckets[b] * HISTOGRAM_WIDTH + largest - 1) / largest;
+    printf("  %14s %7u  %.*s\n", range, buckets[b], bar, "########################################");
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  FILE *in = stdin;
+  if (argc > 1) {
+    in = fopen(argv[1], "r");
+    if (in == NULL) {
+      perror(argv[1]);
+      return 1;
+    }
+  }
+
+  stageSamples samples[TRACE_STAGES];
+  uint32_t ticksPerMicro = 0;
+  unsigned int records = 0;
+  unsigned long recorded = 0;
+  bool inDump = false;
+  char line[256];
+
+  while (fgets(line, sizeof(line), in) != NULL) {
+    unsigned long perMicro;
+    unsigned int count;
+    if (sscanf(line, "# canboose trace %lu %u %lu", &perMicro, &count, &recorded) == 3) {
+      ticksPerMicro = perMicro > 0 ? perMicro : 1;
+      inDump = true;
+      continue;
+    }
+    if (!inDump) continue;
+    if (strncmp(line, "# end", 5) == 0) break;
+
+    unsigned int ticks, point, arg;
+    if (sscanf(line, "%x %u %x", &ticks, &point, &arg) != 3) continue;
+    records++;
+
+    // Each point is the begin and/or end of some stages. Ends pair with the oldest
+    // open begin with the same argument. Ends without a begin fell off the ring
+    for (size_t s = 0; s < TRACE_STAGES; s++) {
+      if (point == traceStages[s].end) {
+        std::deque<uint32_t> &open = samples[s].open[arg];
+        if (!open.empty()) {
+          samples[s].ticks.push_back((uint32_t) ticks - open.front());
+          open.pop_front();
+        }
+      }
+      if (point == traceStages[s].begin) samples[s].open[arg].push_back(ticks);
+    }
+  }
+
+  if (ticksPerMicro == 0) {
+    fprintf(stderr, "No trace dump found\n");
+    return 1;
+  }
+
+  printf("%u records (%lu since start), %u ticks per microsecond\n\n", records, recorded, ticksPerMicro);
+  for (size_t s = 0; s < TRACE_STAGES; s++) {
+    printStage(traceStages[s], samples[s], ticksPerMicro);
+  }
+  return 0;
+}